@@ -0,0 +1,133 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+/* mksrc writes synthetic partition sources
+ * for the benchmarks in bench/run */
+
+static void
+usage(void)
+{
+    dprintf(2, "usage: mksrc [-e extent] [-r seed] dense|sparse|fragmented|zeros size file\n" \
+	    "    dense        random data throughout\n" \
+	    "    sparse       1M of random data every 16M, holes elsewhere\n" \
+	    "    fragmented   alternating extents and holes of 'extent' bytes (default 16K)\n" \
+	    "    zeros        fully allocated, but zeros apart from 64K of data every 4M\n");
+    _exit(1);
+}
+
+static off_t
+parse_size(const char *str)
+{
+    char *end;
+    off_t n;
+
+    n = strtoll(str, &end, 0);
+    switch (*end) {
+    case 'G': n <<= 10; /* fallthrough */
+    case 'M': n <<= 10; /* fallthrough */
+    case 'K': n <<= 10; end++; break;
+    }
+    if (*end || n <= 0)
+	errx(1, "bad size %s", str);
+    return n;
+}
+
+/* xorshift64: cheap, and the same for every run */
+static uint64_t state;
+
+static void
+fill(char *buf, size_t len)
+{
+    uint64_t x = state;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	memcpy(buf + i, &x, 8);
+    }
+    state = x;
+}
+
+static void
+put(int fd, char *buf, off_t off, off_t len, int random)
+{
+    size_t amt;
+    ssize_t n;
+
+    while (len > 0) {
+	amt = len > (1 << 20) ? (1 << 20) : (size_t)len;
+	if (random)
+	    fill(buf, amt);
+	else
+	    memset(buf, 0, amt);
+	if ((n = pwrite(fd, buf, amt, off)) < 0)
+	    err(1, "pwrite");
+	off += n;
+	len -= n;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    off_t size, off, extent;
+    const char *profile;
+    char *buf;
+    int fd, c;
+
+    extent = 16 << 10;
+    state = 0x9e3779b97f4a7c15ULL;
+    while ((c = getopt(argc, argv, "e:r:h")) != -1) {
+	switch (c) {
+	case 'e':
+	    extent = parse_size(optarg);
+	    if (extent & 4095)
+		errx(1, "extent size must be a multiple of 4K");
+	    break;
+	case 'r':
+	    state = strtoull(optarg, NULL, 0) | 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 3)
+	usage();
+    profile = argv[0];
+    size = parse_size(argv[1]);
+    if (!(buf = malloc(1 << 20)))
+	err(1, "malloc");
+    if ((fd = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+	err(1, "%s", argv[2]);
+
+    if (strcmp(profile, "dense") == 0) {
+	put(fd, buf, 0, size, 1);
+    } else if (strcmp(profile, "sparse") == 0) {
+	for (off = 0; off < size; off += 16 << 20)
+	    put(fd, buf, off, size - off < (1 << 20) ? size - off : (1 << 20), 1);
+    } else if (strcmp(profile, "fragmented") == 0) {
+	for (off = 0; off < size; off += 2 * extent)
+	    put(fd, buf, off, size - off < extent ? size - off : extent, 1);
+    } else if (strcmp(profile, "zeros") == 0) {
+	put(fd, buf, 0, size, 0);
+	for (off = 0; off < size; off += 4 << 20)
+	    put(fd, buf, off, size - off < (64 << 10) ? size - off : (64 << 10), 1);
+    } else {
+	usage();
+    }
+    if (ftruncate(fd, size) < 0 || fsync(fd) < 0)
+	err(1, "%s", argv[2]);
+    close(fd);
+    return 0;
+}
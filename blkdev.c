@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "blkdev.h"
+
+#define rc(e) (errno=(e), -1)
+
+/* write zeros by hand, for files that can't punch holes */
+static int
+write_zeros(int fd, off_t off, off_t len)
+{
+    static const unsigned char zeros[65536];
+    ssize_t n;
+
+    while (len > 0) {
+	n = pwrite(fd, zeros, len > (off_t)sizeof(zeros) ? sizeof(zeros) : (size_t)len, off);
+	if (n <= 0)
+	    return n < 0 ? -1 : rc(EIO);
+	off += n;
+	len -= n;
+    }
+    return 0;
+}
+
+int
+blk_zero(int fd, off_t off, off_t len)
+{
+    uint64_t r[2];
+    struct stat st;
+    off_t head, tail;
+    int ssz;
+
+    if (len <= 0)
+	return 0;
+    if (fstat(fd, &st) < 0)
+	return -1;
+    if (!S_ISBLK(st.st_mode)) {
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+	    return 0;
+	if (errno != EOPNOTSUPP)
+	    return -1;
+	return write_zeros(fd, off, len);
+    }
+
+    /* the device only zeros whole logical blocks,
+     * so the partial ones at either end are written by hand */
+    if (ioctl(fd, BLKSSZGET, &ssz) < 0)
+	return -1;
+    head = (ssz - off % ssz) % ssz;
+    if (head >= len)
+	return write_zeros(fd, off, len);
+    tail = (off + len) % ssz;
+    if ((head && write_zeros(fd, off, head) < 0) ||
+	(tail && write_zeros(fd, off + len - tail, tail) < 0))
+	return -1;
+    off += head;
+    len -= head + tail;
+    if (len == 0)
+	return 0;
+    /* on a block device, punching a hole only succeeds
+     * if the device can zero (or unmap) without being sent zeros */
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+	return 0;
+    r[0] = (uint64_t)off;
+    r[1] = (uint64_t)len;
+    return ioctl(fd, BLKZEROOUT, r);
+}
+
+int
+dio_align(int fd)
+{
+    struct stat st;
+    int ssz;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+#endif
+
+    if (fstat(fd, &st) < 0)
+	return -1;
+    if (S_ISBLK(st.st_mode))
+	return ioctl(fd, BLKSSZGET, &ssz) == 0 ? ssz : -1;
+#ifdef STATX_DIOALIGN
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+	(stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+	if (stx.stx_dio_mem_align > stx.stx_dio_offset_align)
+	    return (int)stx.stx_dio_mem_align;
+	return (int)stx.stx_dio_offset_align;
+    }
+#endif
+    return 4096;
+}
+
+int
+dio_reopen(int fd, int flags)
+{
+    char path[32];
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, flags|O_DIRECT|O_CLOEXEC);
+}
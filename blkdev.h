@@ -0,0 +1,31 @@
+#ifndef __BLKDEV_H_
+#define __BLKDEV_H_
+#include <sys/types.h>
+
+/* blk_zero() makes [off, off+len) of 'fd' read as zeros
+ * without writing zeros where the device or filesystem can avoid it:
+ *
+ * on block devices the range is zeroed by the device itself if it
+ * can (write-zeroes/unmap), or with BLKZEROOUT; discarding isn't
+ * used, since devices no longer promise that discarded blocks read
+ * back as zeros (BLKDISCARDZEROES is always 0); on regular files a
+ * hole is punched
+ *
+ * on block devices, the parts of logical blocks at either end
+ * of the range are zeroed by writing zeros
+ *
+ * returns 0 on success or -1 with errno set */
+int blk_zero(int fd, off_t off, off_t len);
+
+/* dio_align() returns the offset and length alignment in bytes
+ * required for O_DIRECT I/O on 'fd': the logical block size for
+ * block devices, and what statx(2) reports (or 4096) for files */
+int dio_align(int fd);
+
+/* dio_reopen() opens a second file description for 'fd'
+ * with O_DIRECT set and the access mode in 'flags'
+ *
+ * returns the new fd, or -1 with errno set */
+int dio_reopen(int fd, int flags);
+
+#endif
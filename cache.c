@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "part.h"
+#include "cache.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define CACHE_BUFSZ (1L << 20)
+
+int
+cache_key(const struct partinfo *part, char *key, size_t len)
+{
+    struct stat st;
+
+    /* only contents that have to be decoded are worth keeping:
+     * a plain file is copied or cloned just as well from where it
+     * is, and a file that is only part of srcfd (a member of an
+     * archive) can't be told apart from the rest of it by srcfd */
+    if (part->srcfd < 0 || !part->rd || part->rd->backing ||
+	fstat(part->srcfd, &st) < 0 || !S_ISREG(st.st_mode))
+	return -1;
+    if (snprintf(key, len, "%llx-%llx-%llx-%lld.%09ld-%llx",
+		 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+		 (unsigned long long)st.st_size, (long long)st.st_mtim.tv_sec,
+		 st.st_mtim.tv_nsec, (unsigned long long)part->srcsz) >= (int)len)
+	return rc(ENAMETOOLONG);
+    return 0;
+}
+
+int
+cache_open(int dirfd, const char *key)
+{
+    int fd;
+
+    if ((fd = openat(dirfd, key, O_RDONLY|O_CLOEXEC)) < 0)
+	return -1;
+    /* mark the entry as used, so old entries can be found and removed */
+    futimens(fd, NULL);
+    return fd;
+}
+
+/* copy [off, off+len) of 'in' to 'out' at 'dstoff' */
+static int
+copy_span(int in, off_t off, int out, off_t dstoff, off_t len)
+{
+    unsigned char *buf;
+    loff_t src, dst;
+    ssize_t n;
+
+    src = off;
+    dst = dstoff;
+    while (src < off + len) {
+	n = copy_file_range(in, &src, out, &dst, off + len - src, 0);
+	if (n > 0)
+	    continue;
+	if (n == 0 || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)
+	    break;
+	return -1;
+    }
+    if (src == off + len)
+	return 0;
+    if (!(buf = malloc(CACHE_BUFSZ)))
+	return -1;
+    n = 0;
+    while (src < off + len) {
+	n = pread(in, buf, off + len - src < CACHE_BUFSZ ? off + len - src : CACHE_BUFSZ, src);
+	if (n <= 0 || pwrite(out, buf, n, dst) != n)
+	    break;
+	src += n;
+	dst += n;
+    }
+    free(buf);
+    if (src == off + len)
+	return 0;
+    return n == 0 ? rc(EIO) : -1;
+}
+
+/* copy the data in [off, off+len) of 'img' to the start of 'fd',
+ * skipping holes, or share it if the filesystem can; the partition
+ * holding it ends at 'end' */
+static int
+copy_data(int fd, int img, off_t off, off_t len, off_t end)
+{
+    struct file_clone_range fcr = {0};
+    off_t pos, data, hole;
+    struct stat st;
+
+    /* a clone has to cover whole blocks (or run to the end of
+     * the image), so it may take in some of the partition past
+     * 'len'; the caller truncates the file afterwards */
+    if (fstat(img, &st) < 0)
+	return -1;
+    if (end > st.st_size)
+	end = st.st_size;
+    fcr.src_fd = img;
+    fcr.src_offset = off;
+    fcr.src_length = len;
+    if (st.st_blksize > 0)
+	fcr.src_length = (len + st.st_blksize - 1) / st.st_blksize * st.st_blksize;
+    if (off + (off_t)fcr.src_length > end)
+	fcr.src_length = end - off;
+    if (ioctl(fd, FICLONERANGE, &fcr) == 0)
+	return 0;
+
+    for (pos = off; pos < off + len; pos = hole) {
+	data = lseek(img, pos, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+	    return 0;
+	if (data < 0) /* no hole information */
+	    return copy_span(img, pos, fd, pos - off, off + len - pos);
+	if (data >= off + len)
+	    return 0;
+	hole = lseek(img, data, SEEK_HOLE);
+	if (hole < 0 || hole > off + len)
+	    hole = off + len;
+	if (copy_span(img, data, fd, data - off, hole - data) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+int
+cache_store(int dirfd, const char *key, int imgfd, off_t off, off_t len, off_t end)
+{
+    char tmp[CACHE_KEY_MAX + 8], path[64];
+    int fd, ret, e;
+
+    /* an unnamed file can't be mistaken for a complete entry */
+    tmp[0] = 0;
+    if ((fd = openat(dirfd, ".", O_TMPFILE|O_WRONLY|O_CLOEXEC, 0644)) < 0) {
+	snprintf(tmp, sizeof(tmp), ".%s.tmp", key);
+	if ((fd = openat(dirfd, tmp, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0644)) < 0)
+	    return -1;
+    }
+    ret = -1;
+    if (copy_data(fd, imgfd, off, len, end) < 0 || ftruncate(fd, len) < 0 || fsync(fd) < 0)
+	goto fail;
+    if (tmp[0]) {
+	ret = renameat(dirfd, tmp, dirfd, key);
+    } else {
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ret = linkat(AT_FDCWD, path, dirfd, key, AT_SYMLINK_FOLLOW);
+	if (ret < 0 && errno == EEXIST)
+	    ret = 0; /* someone else stored it first */
+    }
+fail:
+    e = errno;
+    if (ret < 0 && tmp[0])
+	unlinkat(dirfd, tmp, 0);
+    close(fd);
+    errno = e;
+    return ret;
+}
+
+void
+cache_fetch(int dirfd, struct partinfo *head, char (*keys)[CACHE_KEY_MAX])
+{
+    int i, fd, hits, misses;
+
+    hits = misses = 0;
+    for (i = 0; head; head = head->next, i++) {
+	keys[i][0] = 0;
+	if (cache_key(head, keys[i], CACHE_KEY_MAX) < 0) {
+	    keys[i][0] = 0;
+	    continue;
+	}
+	if ((fd = cache_open(dirfd, keys[i])) < 0) {
+	    if (errno != ENOENT)
+		warnf("p%d: warning: cache: %s\n", head->num, strerror(errno));
+	    misses++;
+	    continue;
+	}
+	if (head->rd)
+	    head->rd->close(head->rd);
+	close(head->srcfd);
+	head->rd = NULL;
+	head->srcfd = fd;
+	head->pipe = false;
+	keys[i][0] = 0;
+	hits++;
+	warnf("p%d: cache hit\n", head->num);
+    }
+    warnf("cache: %d hits, %d misses\n", hits, misses);
+}
+
+void
+cache_save(int dirfd, int imgfd, const struct partinfo *head, char (*keys)[CACHE_KEY_MAX])
+{
+    int i;
+
+    for (i = 0; head; head = head->next, i++)
+	if (keys[i][0] && cache_store(dirfd, keys[i], imgfd, head->startlba << 9, head->srcsz,
+					      (head->startlba + head->nsectors) << 9) < 0)
+	    warnf("p%d: warning: storing in cache: %s\n", head->num, strerror(errno));
+}
@@ -0,0 +1,45 @@
+#ifndef __CACHE_H_
+#define __CACHE_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "part.h"
+
+/* a cache directory holds the decoded contents of compressed
+ * and qcow2 partitions from earlier builds, each in a file named
+ * by the identity of its source (device, inode, size and mtime,
+ * plus the size of the contents), so that a partition whose
+ * source hasn't changed is copied or cloned from the cached
+ * copy like a plain file instead of being decoded again */
+
+#define CACHE_KEY_MAX 128
+
+/* cache_key() writes the key for the source of 'part' to 'key';
+ * returns -1 if the source isn't cached (it isn't decoded, isn't
+ * a regular file, or is only part of one) */
+int cache_key(const struct partinfo *part, char *key, size_t len);
+
+/* cache_open() returns a read-only fd for the cached contents
+ * named 'key' in 'dirfd', or -1 with errno ENOENT if there are none */
+int cache_open(int dirfd, const char *key);
+
+/* cache_store() saves [off, off+len) of 'imgfd' in 'dirfd' as
+ * the contents named 'key', cloning the range where the filesystem
+ * supports it (the partition holding it ends at 'end'); the entry
+ * only appears once it is complete and synced
+ *
+ * returns 0 on success or -1 with errno set */
+int cache_store(int dirfd, const char *key, int imgfd, off_t off, off_t len, off_t end);
+
+/* cache_fetch() swaps in the cached contents of each partition
+ * in 'head' whose source hasn't changed since it was stored, closing
+ * its source, and leaves keys[i] holding the key under which the
+ * i'th partition is to be stored once it has been copied (or ""),
+ * reporting the hits and misses on stderr */
+void cache_fetch(int dirfd, struct partinfo *head, char (*keys)[CACHE_KEY_MAX]);
+
+/* cache_save() stores every partition cache_fetch() left a key
+ * for from the finished raw image 'imgfd', warning on stderr
+ * about any that can't be stored */
+void cache_save(int dirfd, int imgfd, const struct partinfo *head, char (*keys)[CACHE_KEY_MAX]);
+
+#endif
@@ -0,0 +1,1545 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/vfs.h>
+#include "filesize.h"
+#include "part.h"
+#include "extent.h"
+#include "zero.h"
+#include "blkdev.h"
+#include "stats.h"
+#include "uring.h"
+#include "copy.h"
+
+#define rc(e) (errno=(e), -1)
+
+/* partitions are only split into pieces
+ * of at least this many bytes of data, and
+ * the split points are aligned to 1 << CHUNK_ALIGN_BITS */
+#define MIN_CHUNK        (16L << 20)
+#define CHUNK_ALIGN_BITS 20
+
+/* the buffered engine keeps RING_SLOTS buffers
+ * of RING_BUFSZ bytes in flight between its reader
+ * and writer threads */
+#define RING_SLOTS 8
+#define RING_BUFSZ (1L << 20)
+#define RING_ALIGN 4096
+
+/* the io_uring engine keeps up to URING_SLOTS reads
+ * and writes of URING_BUFSZ bytes in flight per worker */
+#define URING_SLOTS 32
+#define URING_BUFSZ (512L << 10)
+
+/* granularity of zero-block detection */
+#define ZERO_BLOCK 4096
+
+#define NFS_SUPER_MAGIC  0x6969
+#define FUSE_SUPER_MAGIC 0x65735546
+
+/* per-partition copy state */
+struct cpart {
+    struct partinfo *part;
+    int img;            /* index of the image it goes into */
+    int dstfd;          /* ... and that image */
+    int ddstfd;         /* O_DIRECT dstfd for COPY_DIRECT, or -1 */
+    struct extmap map;  /* data extents of part->srcfd */
+    off_t data;         /* number of data bytes in map */
+    int engine;         /* engine for new copies (updated atomically) */
+    int used;           /* bitmask of engines that copied data */
+    int fallback;       /* errno that caused a fallback, or 0 */
+    int nouring;        /* errno that ruled out COPY_URING, or 0 */
+    bool reflink;       /* try FICLONERANGE first (updated atomically) */
+    int noclone;        /* errno that disabled reflinks, or 0 */
+    unsigned blkbits;   /* log2 of the filesystem block size */
+    off_t cloned;       /* bytes shared via FICLONERANGE */
+    off_t copied;       /* bytes copied by any other means */
+    off_t zeroed;       /* bytes of zero blocks left as holes */
+    int dsrcfd;         /* O_DIRECT source fd for COPY_DIRECT, or -1 */
+    int dsrcerr;        /* errno from opening dsrcfd */
+    bool eof;           /* a pipe source ended before part->srcsz */
+    long ncfr;          /* syscall counts; see struct partstats */
+    long nclone;
+    long npread;
+    long npwrite;
+    long nretry;
+    long nsfr;
+    long nfadvise;
+    double t0, t1;      /* when the first job started and the last one ended */
+};
+
+/* one writer's rolling writeback of the image (see struct writeback) */
+struct wbwin {
+    const struct writeback *wb;
+    struct cpart *cp;
+    off_t lo, hi;       /* written since writeback was last started */
+    off_t plo, phi;     /* being written back */
+};
+
+/* a unit of work: copy the data of one
+ * partition that lies within [lo, hi) of its source */
+struct copyjob {
+    struct cpart *cp;
+    off_t lo, hi;
+};
+
+/* work queue shared by copy workers */
+struct pool {
+    pthread_mutex_t lock;
+    struct copyjob *todo; /* jobs, largest partitions first */
+    int ntodo;            /* length of todo */
+    int next;             /* index of next job to hand out */
+    int *ddstfds;         /* O_DIRECT fd of each image for COPY_DIRECT, or -1 */
+    int dalign;           /* O_DIRECT alignment for both sides, in bytes */
+    bool skipzero;        /* see copyopts.skipzero */
+    bool zerofill;        /* see copyopts.zerofill */
+    struct writeback wb;  /* see copyopts.wb */
+    int err;              /* errno of first failure, or 0 */
+    struct cpart *cps;    /* every partition being copied */
+    int ncps;
+    off_t total;          /* bytes of data in cps */
+    pthread_cond_t cond;  /* signalled when the workers are done */
+    bool finished;
+    const struct copyopts *opts; /* for the progress callback */
+};
+
+/* per-worker state of the io_uring engine: the buffer
+ * of slot i is mem + i*URING_BUFSZ, and slot i holds
+ * the pieces numbered i, i+URING_SLOTS, ... */
+struct ucopy {
+    struct uring ring;
+    unsigned char *mem;   /* URING_SLOTS * URING_BUFSZ bytes */
+    int err;              /* why the ring can't be used, or 0 */
+    bool ready;           /* ring and mem are set up */
+    struct {
+	off_t off;        /* source offset of the piece */
+	size_t len;
+	size_t done;      /* bytes read, then bytes written */
+	enum { SLOT_FREE, SLOT_READING, SLOT_READ, SLOT_WRITING } state;
+    } slot[URING_SLOTS];
+};
+
+/* ring of buffers shared by the reader
+ * and writer sides of the buffered engine */
+struct ring {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *mem;   /* RING_SLOTS * RING_BUFSZ bytes */
+    struct {
+	off_t dstoff;
+	size_t len;
+    } slot[RING_SLOTS];
+    unsigned head;        /* next slot to fill (reader) */
+    unsigned tail;        /* next slot to drain (writer) */
+    bool done;            /* reader has no more slots to post */
+    int err;              /* errno of first failure, or 0 */
+    int dstfd;
+    int ddstfd;           /* O_DIRECT dstfd, or -1 */
+    off_t dmask;          /* O_DIRECT alignment mask */
+    bool skipzero;        /* leave all-zero blocks as holes */
+    bool zerofill;        /* ... and zero them with blk_zero() */
+    struct cpart *cp;
+    struct wbwin win;     /* writeback of what the writer has written */
+};
+
+static const char *engine_names[] = {
+    [COPY_AUTO] = "auto",
+    [COPY_RANGE] = "copy_file_range",
+    [COPY_BUFFERED] = "buffered",
+    [COPY_REFLINK] = "reflink",
+    [COPY_DIRECT] = "direct",
+    [COPY_URING] = "io_uring",
+};
+
+int
+copy_engine(const char *name)
+{
+    int i;
+
+    if (strcmp(name, "cfr") == 0)
+	return COPY_RANGE;
+    if (strcmp(name, "uring") == 0)
+	return COPY_URING;
+    for (i=0; i<sizeof(engine_names)/sizeof(engine_names[0]); i++)
+	if (strcmp(name, engine_names[i]) == 0)
+	    return i;
+    return rc(EINVAL);
+}
+
+/* can't_range() returns true if a copy_file_range(2) error
+ * means that the call can't be used on this pair of files
+ * (rather than a real I/O error) */
+static bool
+cant_range(int e)
+{
+    return e == EXDEV || e == EINVAL || e == EOPNOTSUPP || e == ENOSYS || e == EBADF;
+}
+
+/* cant_clone() is like cant_range() for FICLONERANGE */
+static bool
+cant_clone(int e)
+{
+    return cant_range(e) || e == ENOTTY || e == EPERM;
+}
+
+static void
+ring_fail(struct ring *r, int e)
+{
+    pthread_mutex_lock(&r->lock);
+    if (!r->err)
+	r->err = e ? e : EIO;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* aligned() returns true if an I/O of 'len' bytes
+ * at 'off' into 'buf' satisfies the O_DIRECT alignment 'mask' */
+static inline bool
+aligned(const void *buf, size_t len, off_t off, off_t mask)
+{
+    return ((off | (off_t)len | (off_t)(uintptr_t)buf) & mask) == 0;
+}
+
+static void
+wb_init(struct wbwin *w, const struct writeback *wb, struct cpart *cp)
+{
+    memset(w, 0, sizeof(*w));
+    w->wb = wb;
+    w->cp = cp;
+}
+
+/* wait for the batch being written back, and drop it from
+ * the page cache if that's the policy */
+static int
+wb_wait(struct wbwin *w)
+{
+    int fd = w->cp->dstfd;
+
+    if (w->phi > w->plo) {
+	__atomic_fetch_add(&w->cp->nsfr, 1, __ATOMIC_RELAXED);
+	if (sync_file_range(fd, w->plo, w->phi - w->plo, SYNC_FILE_RANGE_WAIT_BEFORE|
+			    SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+	    return -1;
+	if (w->wb->dontneed) {
+	    __atomic_fetch_add(&w->cp->nfadvise, 1, __ATOMIC_RELAXED);
+	    posix_fadvise(fd, w->plo, w->phi - w->plo, POSIX_FADV_DONTNEED);
+	}
+    }
+    w->plo = w->phi = 0;
+    return 0;
+}
+
+/* start writing back what has been written, then wait for the batch before */
+static int
+wb_kick(struct wbwin *w)
+{
+    if (w->hi > w->lo) {
+	__atomic_fetch_add(&w->cp->nsfr, 1, __ATOMIC_RELAXED);
+	if (sync_file_range(w->cp->dstfd, w->lo, w->hi - w->lo, SYNC_FILE_RANGE_WRITE) < 0)
+	    return -1;
+    }
+    if (wb_wait(w) < 0)
+	return -1;
+    w->plo = w->lo;
+    w->phi = w->hi;
+    w->lo = w->hi = 0;
+    return 0;
+}
+
+/* note that [off, off+len) of the image has been written through the page cache */
+static int
+wb_wrote(struct wbwin *w, off_t off, off_t len)
+{
+    off_t dirty = w->wb->dirty;
+
+    if (!dirty)
+	return 0;
+    /* the batch is one range, so a write far away starts a new one */
+    if (w->hi > w->lo && (off < w->lo || off > w->hi + dirty) && wb_kick(w) < 0)
+	return -1;
+    if (w->hi == w->lo)
+	w->lo = off;
+    if (off + len > w->hi)
+	w->hi = off + len;
+    return w->hi - w->lo >= dirty ? wb_kick(w) : 0;
+}
+
+/* write back everything at the end of a job */
+static int
+wb_done(struct wbwin *w)
+{
+    if (!w->wb->dirty)
+	return 0;
+    if (wb_kick(w) < 0)
+	return -1;
+    return wb_wait(w);
+}
+
+/* note that [off, off+len) of the source has been copied */
+static void
+wb_read(struct wbwin *w, off_t off, off_t len)
+{
+    if (!w->wb->dontneed || w->cp->part->pipe || w->cp->part->rd)
+	return;
+    __atomic_fetch_add(&w->cp->nfadvise, 1, __ATOMIC_RELAXED);
+    posix_fadvise(w->cp->part->srcfd, off, len, POSIX_FADV_DONTNEED);
+}
+
+/* write [buf, buf+len) to the image at 'dstoff' */
+static int
+ring_write(struct ring *r, const unsigned char *buf, size_t len, off_t dstoff)
+{
+    size_t done;
+    ssize_t n;
+    int fd;
+
+    fd = r->dstfd;
+    if (r->ddstfd >= 0 && aligned(buf, len, dstoff, r->dmask))
+	fd = r->ddstfd;
+    for (done = 0; done < len; done += n) {
+	if (done)
+	    __atomic_fetch_add(&r->cp->nretry, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->cp->npwrite, 1, __ATOMIC_RELAXED);
+	n = pwrite(fd, buf + done, len - done, dstoff + done);
+	if (n <= 0)
+	    return n < 0 ? -1 : rc(EIO);
+    }
+    /* O_DIRECT writes don't go through the page cache */
+    return fd == r->dstfd ? wb_wrote(&r->win, dstoff, (off_t)len) : 0;
+}
+
+static int
+ring_put(struct ring *r, const unsigned char *buf, size_t len, off_t dstoff)
+{
+    if (ring_write(r, buf, len, dstoff) < 0)
+	return -1;
+    __atomic_fetch_add(&r->cp->copied, (off_t)len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* write out a run of a slot; runs of zeros are skipped,
+ * or zeroed without being written if r->zerofill is set */
+static int
+ring_flush(struct ring *r, const unsigned char *buf, size_t len, off_t dstoff, bool zero)
+{
+    if (!zero)
+	return ring_put(r, buf, len, dstoff);
+    __atomic_fetch_add(&r->cp->zeroed, (off_t)len, __ATOMIC_RELAXED);
+    if (!r->zerofill)
+	return 0;
+    if (((dstoff | (off_t)len) & 511) == 0)
+	return blk_zero(r->dstfd, dstoff, (off_t)len);
+    /* counted as zeroed, not copied */
+    return ring_write(r, buf, len, dstoff);
+}
+
+/* write out the slot at 'buf', treating every block
+ * (aligned to ZERO_BLOCK in the image) that is all zeros
+ * as a hole */
+static int
+ring_put_sparse(struct ring *r, const unsigned char *buf, size_t len, off_t dstoff)
+{
+    size_t pos, end, run;
+    bool zero, runzero;
+
+    run = 0;
+    runzero = false;
+    for (pos = 0; pos < len; pos = end) {
+	end = pos + ZERO_BLOCK - ((dstoff + pos) & (ZERO_BLOCK-1));
+	if (end > len)
+	    end = len;
+	zero = allzero(buf + pos, end - pos);
+	if (pos == 0) {
+	    runzero = zero;
+	} else if (zero != runzero) {
+	    if (ring_flush(r, buf + run, pos - run, dstoff + run, runzero) < 0)
+		return -1;
+	    run = pos;
+	    runzero = zero;
+	}
+    }
+    return ring_flush(r, buf + run, len - run, dstoff + run, runzero);
+}
+
+static void *
+ring_writer(void *arg)
+{
+    struct ring *r = arg;
+    unsigned char *buf;
+    off_t dstoff;
+    size_t len;
+    unsigned i;
+    int ret;
+
+    for (;;) {
+	pthread_mutex_lock(&r->lock);
+	while (r->tail == r->head && !r->done && !r->err)
+	    pthread_cond_wait(&r->cond, &r->lock);
+	if (r->err || r->tail == r->head) {
+	    ret = r->err;
+	    pthread_mutex_unlock(&r->lock);
+	    if (!ret && wb_done(&r->win) < 0)
+		ring_fail(r, errno);
+	    return NULL;
+	}
+	i = r->tail % RING_SLOTS;
+	pthread_mutex_unlock(&r->lock);
+
+	buf = r->mem + (size_t)i*RING_BUFSZ;
+	dstoff = r->slot[i].dstoff;
+	len = r->slot[i].len;
+	ret = r->skipzero ? ring_put_sparse(r, buf, len, dstoff) : ring_put(r, buf, len, dstoff);
+	if (ret < 0) {
+	    ring_fail(r, errno);
+	    return NULL;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	r->tail++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* read_next() reads the next bytes of a pipe source at 'off' */
+static ssize_t
+read_next(const struct partinfo *part, void *buf, size_t len, off_t off)
+{
+    if (part->rd)
+	return part->rd->read(part->rd, buf, len, off);
+    return read(part->srcfd, buf, len);
+}
+
+/* read the next 'len' bytes of a pipe source, which must
+ * be at 'off'; if the pipe ends early, cp->eof is set and
+ * cp->data is the number of bytes it produced, and if it
+ * produces more than part->srcsz bytes, that's an error */
+static int
+read_pipe(struct cpart *cp, unsigned char *buf, size_t len, off_t off)
+{
+    size_t got;
+    ssize_t n;
+    char c;
+
+    for (got = 0; got < len; got += n) {
+	n = read_next(cp->part, buf + got, len - got, off + got);
+	if (n < 0 && errno == EINTR) {
+	    n = 0;
+	    continue;
+	}
+	if (n < 0)
+	    return -1;
+	if (n == 0) {
+	    cp->eof = true;
+	    cp->data = off + got;
+	    return 0;
+	}
+    }
+    if (off + (off_t)len < cp->part->srcsz)
+	return 0;
+    cp->data = cp->part->srcsz;
+    while ((n = read_next(cp->part, &c, 1, off + len)) < 0 && errno == EINTR)
+	;
+    if (n > 0)
+	return rc(EFBIG);
+    return n;
+}
+
+/* read 'len' bytes of cp's source at 'off' into 'buf', going through
+ * the O_DIRECT fd where the alignment allows; in direct mode the
+ * range may extend past the end of the source, which reads as zeros */
+static int
+read_src(struct cpart *cp, unsigned char *buf, size_t len, off_t off, off_t mask)
+{
+    size_t got;
+    ssize_t n;
+    int fd;
+
+    if (cp->part->pipe)
+	return read_pipe(cp, buf, len, off);
+    if (cp->part->rd)
+	return cp->part->rd->read(cp->part->rd, buf, len, off) < 0 ? -1 : 0;
+    fd = cp->part->srcfd;
+    if (cp->dsrcfd >= 0 && aligned(buf, len, off, mask))
+	fd = cp->dsrcfd;
+    for (got = 0; got < len; got += n) {
+	if (got)
+	    __atomic_fetch_add(&cp->nretry, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cp->npread, 1, __ATOMIC_RELAXED);
+	n = pread(fd, buf + got, len - got, off + got);
+	if (n < 0)
+	    return -1;
+	if (n == 0) {
+	    if (off + (off_t)got < cp->part->srcsz)
+		return rc(EIO); /* source shrank underneath us */
+	    memset(buf + got, 0, len - got);
+	    break;
+	}
+	/* O_DIRECT reads come back short at an unaligned EOF */
+	if (fd != cp->part->srcfd && (n & mask))
+	    fd = cp->part->srcfd;
+    }
+    return 0;
+}
+
+/* copy the data extents of cp that fall within [srcoff, hi)
+ * with ordinary reads and writes; the calling thread reads
+ * into a ring of buffers while a second thread writes them
+ * out, so that the next read overlaps the current write
+ *
+ * if p->skipzero is set, blocks of zeros are not written
+ * (and are zeroed with blk_zero() instead if p->zerofill is set);
+ * pipe sources are always checked for zeros, and their partitions
+ * have already been zeroed if p->zerofill is set
+ *
+ * for COPY_DIRECT, each extent is widened to the O_DIRECT alignment
+ * (without going past the end of the partition) so that the I/O can
+ * bypass the page cache; the extra bytes are read from the source,
+ * so they are whatever the image would contain there anyway */
+static int
+copy_buffered(struct pool *p, struct cpart *cp, off_t srcoff, off_t hi)
+{
+    const struct extmap *m = &cp->map;
+    struct ring r = {0};
+    unsigned char *buf;
+    off_t off, end, shift, mask, pend, prev;
+    pthread_t writer;
+    size_t len;
+    size_t i;
+    unsigned s;
+    int e;
+
+    mask = 0;
+    if (cp->engine == COPY_DIRECT && (cp->dsrcfd >= 0 || cp->ddstfd >= 0))
+	mask = p->dalign - 1;
+    if ((e = posix_memalign((void **)&r.mem, mask >= RING_ALIGN ? mask+1 : RING_ALIGN, RING_SLOTS*RING_BUFSZ)))
+	return rc(e);
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.cond, NULL);
+    r.dstfd = cp->dstfd;
+    r.ddstfd = mask ? cp->ddstfd : -1;
+    r.dmask = mask;
+    r.skipzero = p->skipzero || cp->part->pipe;
+    r.zerofill = p->zerofill && !cp->part->pipe;
+    r.cp = cp;
+    wb_init(&r.win, &p->wb, cp);
+    if ((e = pthread_create(&writer, NULL, ring_writer, &r))) {
+	free(r.mem);
+	return rc(e);
+    }
+
+    shift = cp->part->startlba << 9;
+    pend = cp->part->nsectors << 9;
+    prev = 0;
+    for (i = extmap_find(m, srcoff); i < m->len && m->ext[i].off < hi; i++) {
+	off = m->ext[i].off > srcoff ? m->ext[i].off : srcoff;
+	end = m->ext[i].off + m->ext[i].len;
+	if (end > hi)
+	    end = hi;
+	if (mask) {
+	    off &= ~mask;
+	    if (off < prev)
+		off = prev;
+	    end = (end + mask) & ~mask;
+	    if (end > pend)
+		end = pend;
+	    prev = end;
+	}
+	while (off < end) {
+	    pthread_mutex_lock(&r.lock);
+	    while (r.head - r.tail == RING_SLOTS && !r.err)
+		pthread_cond_wait(&r.cond, &r.lock);
+	    e = r.err;
+	    s = r.head % RING_SLOTS;
+	    pthread_mutex_unlock(&r.lock);
+	    if (e)
+		goto out;
+
+	    buf = r.mem + (size_t)s*RING_BUFSZ;
+	    len = end - off > RING_BUFSZ ? RING_BUFSZ : (size_t)(end - off);
+	    if (read_src(cp, buf, len, off, mask) < 0) {
+		ring_fail(&r, errno);
+		goto out;
+	    }
+	    if (cp->eof && (len = cp->data - off) == 0)
+		goto out;
+	    wb_read(&r.win, off, (off_t)len);
+	    r.slot[s].dstoff = off + shift;
+	    r.slot[s].len = len;
+	    off += len;
+
+	    pthread_mutex_lock(&r.lock);
+	    r.head++;
+	    pthread_cond_broadcast(&r.cond);
+	    pthread_mutex_unlock(&r.lock);
+	    if (cp->eof)
+		goto out;
+	}
+    }
+out:
+    pthread_mutex_lock(&r.lock);
+    r.done = true;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+    pthread_join(writer, NULL);
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.lock);
+    free(r.mem);
+    return r.err ? rc(r.err) : 0;
+}
+
+/* copy [*srcoff, end) of 'srcfd' (cp's source, or the file backing
+ * part of it) with copy_file_range(2), advancing *srcoff
+ *
+ * returns 0 when done, -1 on error, or 1 if copy_file_range(2)
+ * turned out not to work for this source and the caller should
+ * continue from *srcoff with the buffered engine */
+static int
+range_piece(int dstfd, struct cpart *cp, int srcfd, off_t *srcoff, off_t end, off_t shift, struct wbwin *w)
+{
+    loff_t off, dstoff;
+    size_t len;
+    ssize_t n;
+
+    off = *srcoff;
+    n = len = 0;
+    while (off < end) {
+	dstoff = off + shift;
+	if ((size_t)n < len)
+	    __atomic_fetch_add(&cp->nretry, 1, __ATOMIC_RELAXED);
+	/* no more than the writeback window at a time, so that it can roll */
+	len = (size_t)(end - off);
+	if (w->wb->dirty && len > (size_t)w->wb->dirty)
+	    len = (size_t)w->wb->dirty;
+	__atomic_fetch_add(&cp->ncfr, 1, __ATOMIC_RELAXED);
+	n = copy_file_range(srcfd, &off, dstfd, &dstoff, len, 0);
+	if (n > 0) {
+	    __atomic_fetch_or(&cp->used, 1 << COPY_RANGE, __ATOMIC_RELAXED);
+	    __atomic_fetch_add(&cp->copied, (off_t)n, __ATOMIC_RELAXED);
+	    wb_read(w, off - n, n);
+	    if (wb_wrote(w, dstoff - n, n) < 0)
+		return -1;
+	    continue;
+	}
+	*srcoff = off;
+	/* a zero-length copy before the end of the data
+	 * means copy_file_range(2) isn't implemented for
+	 * this kind of file (or the source shrank) */
+	if (n == 0)
+	    errno = EINVAL;
+	if (cp->engine == COPY_RANGE || cp->engine == COPY_REFLINK || !cant_range(errno))
+	    return n == 0 ? rc(EIO) : -1;
+	/* let the other workers know, too */
+	if (__atomic_exchange_n(&cp->engine, COPY_BUFFERED, __ATOMIC_RELAXED) != COPY_BUFFERED)
+	    cp->fallback = errno;
+	return 1;
+    }
+    *srcoff = off;
+    return 0;
+}
+
+/* share the block-aligned range [off, end) of cp with the image
+ *
+ * returns 0 on success, -1 on error, or 1 if the filesystem
+ * can't clone this source and the range should be copied instead */
+static int
+clone_piece(int dstfd, struct cpart *cp, off_t off, off_t end, off_t shift)
+{
+    struct file_clone_range fcr = {0};
+
+    fcr.src_fd = cp->part->srcfd;
+    fcr.src_offset = off;
+    fcr.src_length = end - off;
+    fcr.dest_offset = off + shift;
+    __atomic_fetch_add(&cp->nclone, 1, __ATOMIC_RELAXED);
+    if (ioctl(dstfd, FICLONERANGE, &fcr) == 0) {
+	__atomic_fetch_or(&cp->used, 1 << COPY_REFLINK, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cp->cloned, end - off, __ATOMIC_RELAXED);
+	return 0;
+    }
+    if (cp->engine == COPY_REFLINK || !cant_clone(errno))
+	return -1;
+    if (__atomic_exchange_n(&cp->reflink, false, __ATOMIC_RELAXED))
+	cp->noclone = errno;
+    return 1;
+}
+
+/* set up the ring and buffers of the io_uring engine for one worker */
+static int
+ucopy_init(struct ucopy *uc)
+{
+    int e;
+
+    if ((e = posix_memalign((void **)&uc->mem, RING_ALIGN, URING_SLOTS*URING_BUFSZ)))
+	return rc(e);
+    if (uring_init(&uc->ring, URING_SLOTS) < 0) {
+	e = errno;
+	free(uc->mem);
+	uc->mem = NULL;
+	return rc(e);
+    }
+    /* this fails if the buffer can't be locked
+     * (RLIMIT_MEMLOCK), but the ring works without it */
+    uring_buffer(&uc->ring, uc->mem, URING_SLOTS*URING_BUFSZ);
+    uc->ready = true;
+    return 0;
+}
+
+static void
+ucopy_free(struct ucopy *uc)
+{
+    if (!uc->ready)
+	return;
+    uring_free(&uc->ring);
+    free(uc->mem);
+    uc->ready = false;
+}
+
+/* forget the pieces in every slot, after an error */
+static void
+ucopy_reset(struct ucopy *uc)
+{
+    unsigned s;
+
+    for (s = 0; s < URING_SLOTS; s++)
+	uc->slot[s].state = SLOT_FREE;
+}
+
+/* give up on a ring that failed with I/O still in flight: closing
+ * it cancels that I/O, but the kernel may go on reading into the
+ * buffers for a while, so they are left allocated; the worker never
+ * uses io_uring again (see uc->err) */
+static void
+ucopy_abandon(struct ucopy *uc, int err)
+{
+    uring_free(&uc->ring);
+    uc->mem = NULL;
+    uc->ready = false;
+    uc->err = err;
+    ucopy_reset(uc);
+}
+
+/* queue the rest of the read or write of slot s */
+static int
+ucopy_queue(struct ucopy *uc, struct cpart *cp, unsigned s, off_t shift)
+{
+    bool write = uc->slot[s].state == SLOT_WRITING;
+    size_t done = uc->slot[s].done;
+
+    if (done)
+	__atomic_fetch_add(&cp->nretry, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &cp->npwrite : &cp->npread, 1, __ATOMIC_RELAXED);
+    return uring_rw(&uc->ring, write, write ? cp->dstfd : cp->part->srcfd,
+		    uc->mem + (size_t)s*URING_BUFSZ + done, uc->slot[s].len - done,
+		    uc->slot[s].off + (write ? shift : 0) + (off_t)done, s);
+}
+
+/* copy the data extents of cp that fall within [lo, hi) through
+ * io_uring: the extents are cut into pieces of up to URING_BUFSZ
+ * bytes, URING_SLOTS of which can be being read or written at once,
+ * and the writes are submitted in the order of the pieces (so in
+ * ascending image offset) however the reads happen to complete
+ *
+ * returns 0 when done, -1 on error, or 1 (with errno set) if
+ * io_uring can't be used, in which case nothing has been written
+ * and the caller should copy the range some other way */
+static int
+copy_uring(struct pool *p, struct ucopy *uc, struct cpart *cp, off_t lo, off_t hi)
+{
+    const struct extmap *m = &cp->map;
+    struct wbwin w;
+    uint64_t nread, nwrite, data;
+    off_t off, end, shift;
+    size_t i;
+    unsigned s, busy;
+    int fds[2], res, err;
+    bool wrote;
+
+    if (!uc->ready && !uc->err && ucopy_init(uc) < 0)
+	uc->err = errno;
+    if (uc->err) {
+	errno = uc->err;
+	return 1;
+    }
+    fds[0] = cp->part->srcfd;
+    fds[1] = cp->dstfd;
+    /* like the buffer, this is just an optimization */
+    uring_files(&uc->ring, fds, 2);
+
+    shift = cp->part->startlba << 9;
+    wb_init(&w, &p->wb, cp);
+    i = extmap_find(m, lo);
+    off = lo;
+    nread = nwrite = 0;
+    busy = 0;
+    err = 0;
+    wrote = false;
+    for (;;) {
+	/* read the next pieces into free slots... */
+	while (!err && i < m->len && m->ext[i].off < hi &&
+	       uc->slot[s = nread % URING_SLOTS].state == SLOT_FREE) {
+	    if (off < m->ext[i].off)
+		off = m->ext[i].off;
+	    end = m->ext[i].off + m->ext[i].len;
+	    if (end > hi)
+		end = hi;
+	    if (off >= end) {
+		i++;
+		continue;
+	    }
+	    uc->slot[s].off = off;
+	    uc->slot[s].len = end - off > URING_BUFSZ ? URING_BUFSZ : (size_t)(end - off);
+	    uc->slot[s].done = 0;
+	    uc->slot[s].state = SLOT_READING;
+	    if (ucopy_queue(uc, cp, s, shift) < 0) {
+		err = errno;
+		uc->slot[s].state = SLOT_FREE;
+		break;
+	    }
+	    off += uc->slot[s].len;
+	    nread++;
+	    busy++;
+	}
+	/* ... and write them out in the same order */
+	while (!err && nwrite < nread && uc->slot[s = nwrite % URING_SLOTS].state == SLOT_READ) {
+	    uc->slot[s].done = 0;
+	    uc->slot[s].state = SLOT_WRITING;
+	    if (ucopy_queue(uc, cp, s, shift) < 0) {
+		err = errno;
+		uc->slot[s].state = SLOT_FREE;
+		busy--;
+		break;
+	    }
+	    nwrite++;
+	}
+	/* pieces that were read won't be written after an error */
+	for (s = 0; err && s < URING_SLOTS; s++) {
+	    if (uc->slot[s].state == SLOT_READ) {
+		uc->slot[s].state = SLOT_FREE;
+		busy--;
+	    }
+	}
+	if (!busy)
+	    break;
+
+	if (uring_wait(&uc->ring, &data, &res) < 0) {
+	    err = errno;
+	    ucopy_abandon(uc, err);
+	    return rc(err);
+	}
+	s = (unsigned)data;
+	/* a zero-length read or write before the end means
+	 * that the source shrank, or the image can't grow */
+	if (res <= 0 && !err)
+	    err = res < 0 ? -res : EIO;
+	if (err) {
+	    /* wait for everything else to finish */
+	    uc->slot[s].state = SLOT_FREE;
+	    busy--;
+	    continue;
+	}
+	uc->slot[s].done += res;
+	if (uc->slot[s].done < uc->slot[s].len) {
+	    if (ucopy_queue(uc, cp, s, shift) < 0) {
+		err = errno;
+		uc->slot[s].state = SLOT_FREE;
+		busy--;
+	    }
+	    continue;
+	}
+	if (uc->slot[s].state == SLOT_READING) {
+	    uc->slot[s].state = SLOT_READ;
+	    wb_read(&w, uc->slot[s].off, (off_t)uc->slot[s].len);
+	    continue;
+	}
+	__atomic_fetch_add(&cp->copied, (off_t)uc->slot[s].len, __ATOMIC_RELAXED);
+	uc->slot[s].state = SLOT_FREE;
+	busy--;
+	wrote = true;
+	if (wb_wrote(&w, uc->slot[s].off + shift, (off_t)uc->slot[s].len) < 0)
+	    err = errno;
+    }
+    if (!err && wb_done(&w) < 0)
+	err = errno;
+    if (!err) {
+	if (wrote)
+	    __atomic_fetch_or(&cp->used, 1 << COPY_URING, __ATOMIC_RELAXED);
+	return 0;
+    }
+    ucopy_reset(uc);
+    /* kernels that have io_uring but not these
+     * requests (before 5.6) reject them */
+    if (!wrote && (err == EINVAL || err == EOPNOTSUPP)) {
+	uc->err = err;
+	errno = err;
+	return 1;
+    }
+    return rc(err);
+}
+
+/* copy [lo, hi) of a reader that knows which files back its
+ * contents (see srcreader.backing): those pieces are copied from
+ * the files with copy_file_range(2), and the rest is buffered */
+static int
+copy_backed(struct pool *p, struct cpart *cp, off_t lo, off_t hi)
+{
+    struct srcreader *rd = cp->part->rd;
+    const struct extmap *m = &cp->map;
+    off_t off, end, ext, n, fdoff, start, shift;
+    struct wbwin w;
+    size_t i;
+    int fd, r;
+
+    shift = cp->part->startlba << 9;
+    wb_init(&w, &p->wb, cp);
+    for (i = extmap_find(m, lo); i < m->len && m->ext[i].off < hi; i++) {
+	off = m->ext[i].off > lo ? m->ext[i].off : lo;
+	ext = m->ext[i].off + m->ext[i].len;
+	if (ext > hi)
+	    ext = hi;
+	for (; off < ext; off = end) {
+	    if ((n = rd->backing(rd, off, &fd, &fdoff)) <= 0)
+		return n < 0 ? -1 : rc(EIO);
+	    end = n < ext - off ? off + n : ext;
+	    start = fdoff;
+	    r = 1;
+	    if (fd >= 0 && __atomic_load_n(&cp->engine, __ATOMIC_RELAXED) != COPY_BUFFERED)
+		r = range_piece(cp->dstfd, cp, fd, &fdoff, start + (end - off), off + shift - start, &w);
+	    if (fd >= 0 && rd->release)
+		rd->release(rd, off);
+	    if (r < 0)
+		return -1;
+	    if (r == 0)
+		continue;
+	    off += fdoff - start;
+	    __atomic_fetch_or(&cp->used, 1 << COPY_BUFFERED, __ATOMIC_RELAXED);
+	    if (copy_buffered(p, cp, off, end) < 0)
+		return -1;
+	}
+    }
+    return wb_done(&w);
+}
+
+/* copy the data extents of cp that fall within [lo, hi)
+ * into dstfd at the partition's offset
+ *
+ * whole filesystem blocks are shared with FICLONERANGE when
+ * cp->reflink is set, and everything else is copied with
+ * copy_file_range(2); each call passes explicit offsets, so
+ * many ranges of the same source can be copied at once
+ *
+ * if copy_file_range(2) turns out not to work for this source,
+ * the rest of the range is copied by the buffered engine, which
+ * is also used for everything when p->skipzero is set (since the data
+ * has to pass through userspace to be checked for zeros anyway)
+ * and for COPY_DIRECT
+ *
+ * COPY_URING goes through copy_uring() with the worker's ring 'uc',
+ * unless io_uring turns out not to work, in which case cp switches
+ * to COPY_AUTO */
+static int
+copy_range(struct pool *p, struct ucopy *uc, struct cpart *cp, off_t lo, off_t hi)
+{
+    const struct extmap *m = &cp->map;
+    off_t off, end, shift, cs, ce;
+    struct wbwin w;
+    size_t i;
+    int dstfd, r;
+
+    off = lo;
+    wb_init(&w, &p->wb, cp);
+    dstfd = cp->dstfd;
+    if (cp->part->rd && cp->part->rd->backing && !p->skipzero)
+	return copy_backed(p, cp, lo, hi);
+    if (p->skipzero || cp->engine == COPY_DIRECT || cp->part->pipe || cp->part->rd)
+	goto buffered;
+    if (__atomic_load_n(&cp->engine, __ATOMIC_RELAXED) == COPY_URING) {
+	if ((r = copy_uring(p, uc, cp, lo, hi)) <= 0)
+	    return r;
+	if (__atomic_exchange_n(&cp->engine, COPY_AUTO, __ATOMIC_RELAXED) == COPY_URING)
+	    cp->nouring = errno;
+    }
+    shift = cp->part->startlba << 9;
+    for (i = extmap_find(m, lo); i < m->len && m->ext[i].off < hi; i++) {
+	off = m->ext[i].off > lo ? m->ext[i].off : lo;
+	end = m->ext[i].off + m->ext[i].len;
+	if (end > hi)
+	    end = hi;
+	if (__atomic_load_n(&cp->engine, __ATOMIC_RELAXED) == COPY_BUFFERED)
+	    goto buffered;
+
+	/* clone the aligned middle of the extent,
+	 * leaving the head and tail to be copied */
+	if (__atomic_load_n(&cp->reflink, __ATOMIC_RELAXED)) {
+	    cs = alignup(off, cp->blkbits);
+	    ce = aligndown(end, cp->blkbits);
+	    if (cs < ce) {
+		if ((r = range_piece(dstfd, cp, cp->part->srcfd, &off, cs, shift, &w)))
+		    goto check;
+		if ((r = clone_piece(dstfd, cp, cs, ce, shift)) < 0)
+		    return -1;
+		if (r == 0)
+		    off = ce;
+	    }
+	}
+	if ((r = range_piece(dstfd, cp, cp->part->srcfd, &off, end, shift, &w)))
+	    goto check;
+    }
+    return wb_done(&w);
+
+check:
+    if (r < 0 || wb_done(&w) < 0)
+	return -1;
+buffered:
+    __atomic_fetch_or(&cp->used, 1 << (cp->engine == COPY_DIRECT ? COPY_DIRECT : COPY_BUFFERED), __ATOMIC_RELAXED);
+    return copy_buffered(p, cp, off, hi);
+}
+
+static void *
+worker(void *arg)
+{
+    struct pool *p = arg;
+    struct ucopy uc = {0};
+    struct copyjob *job;
+    double t0, t1;
+
+    for (;;) {
+	pthread_mutex_lock(&p->lock);
+	job = NULL;
+	if (!p->err && p->next < p->ntodo)
+	    job = &p->todo[p->next++];
+	pthread_mutex_unlock(&p->lock);
+	if (!job)
+	    break;
+
+	t0 = now();
+	if (copy_range(p, &uc, job->cp, job->lo, job->hi) < 0) {
+	    warnf("p%d: copying contents: %m\n", job->cp->part->num);
+	    pthread_mutex_lock(&p->lock);
+	    if (!p->err)
+		p->err = errno ? errno : EIO;
+	    pthread_mutex_unlock(&p->lock);
+	}
+	t1 = now();
+	pthread_mutex_lock(&p->lock);
+	if (!job->cp->t0 || t0 < job->cp->t0)
+	    job->cp->t0 = t0;
+	if (t1 > job->cp->t1)
+	    job->cp->t1 = t1;
+	pthread_mutex_unlock(&p->lock);
+    }
+    ucopy_free(&uc);
+    return NULL;
+}
+
+/* how much of the data has been dealt with */
+static off_t
+progress(const struct pool *p)
+{
+    off_t done = 0;
+    int i;
+
+    for (i = 0; i < p->ncps; i++)
+	done += __atomic_load_n(&p->cps[i].cloned, __ATOMIC_RELAXED) +
+	    __atomic_load_n(&p->cps[i].copied, __ATOMIC_RELAXED) +
+	    __atomic_load_n(&p->cps[i].zeroed, __ATOMIC_RELAXED);
+    return done;
+}
+
+/* reporter() calls opts->progress every PROGRESS_MSEC
+ * until the workers are finished */
+static void *
+reporter(void *arg)
+{
+    struct pool *p = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->finished) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += PROGRESS_MSEC * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	if (pthread_cond_timedwait(&p->cond, &p->lock, &ts) != ETIMEDOUT || p->finished)
+	    continue;
+	pthread_mutex_unlock(&p->lock);
+	p->opts->progress(p->opts->progress_arg, progress(p), p->total);
+	pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* decide whether cp can be cloned in blocks of the
+ * larger of the two filesystem block sizes; this only works
+ * if the partition starts on a block boundary */
+static bool
+pick_reflink(int dstfd, struct cpart *cp, int engine)
+{
+    struct stat src, dst;
+    blksize_t bs;
+
+    if (engine != COPY_AUTO && engine != COPY_REFLINK)
+	return false;
+    if (fstat(cp->part->srcfd, &src) < 0 || fstat(dstfd, &dst) < 0)
+	return false;
+    if (!S_ISREG(src.st_mode) || !S_ISREG(dst.st_mode)) {
+	if (engine == COPY_REFLINK)
+	    warnf("p%d: only regular files can be cloned\n", cp->part->num);
+	return false;
+    }
+    bs = src.st_blksize > dst.st_blksize ? src.st_blksize : dst.st_blksize;
+    if (bs <= 0 || (bs & (bs-1))) {
+	if (engine == COPY_REFLINK)
+	    warnf("p%d: no block size to clone with\n", cp->part->num);
+	return false;
+    }
+    for (cp->blkbits = 0; (1L << cp->blkbits) < bs; cp->blkbits++)
+	;
+    if ((cp->part->startlba << 9) & (bs-1)) {
+	if (engine == COPY_REFLINK)
+	    warnf("p%d: start not aligned to %ld-byte blocks, so it can't be cloned\n",
+		  cp->part->num, (long)bs);
+	return false;
+    }
+    return true;
+}
+
+/* pick the engine a partition starts out with; fails (saying why)
+ * if the engine asked for can't be used for it */
+static int
+pick_engine(int dstfd, struct cpart *cp, int engine)
+{
+    struct statfs fs;
+    struct stat src, dst;
+
+    cp->dsrcfd = -1;
+    /* pipes can only be read(2), and readers need a buffer to read
+     * into, unless they can point at the files they are made of */
+    if (cp->part->pipe || (cp->part->rd && !cp->part->rd->backing)) {
+	if (engine == COPY_RANGE || engine == COPY_REFLINK) {
+	    warnf("p%d: the %s engine can't read this source\n", cp->part->num, engine_names[engine]);
+	    return rc(EINVAL);
+	}
+	return COPY_BUFFERED;
+    }
+    /* the pieces of a directory or archive lie wherever
+     * they happen to, so they are never block-aligned */
+    if (cp->part->rd && engine == COPY_REFLINK) {
+	warnf("p%d: files in a directory or archive can't be cloned\n", cp->part->num);
+	return rc(EINVAL);
+    }
+    if (cp->part->rd)
+	return engine == COPY_RANGE || engine == COPY_BUFFERED ? engine : COPY_AUTO;
+    cp->reflink = pick_reflink(dstfd, cp, engine);
+    if (engine == COPY_REFLINK && !cp->reflink)
+	return rc(EINVAL);
+    if (engine == COPY_DIRECT && (cp->dsrcfd = dio_reopen(cp->part->srcfd, O_RDONLY)) < 0)
+	cp->dsrcerr = errno;
+    if (engine != COPY_AUTO)
+	return engine;
+    /* copy_file_range(2) from a network or FUSE filesystem
+     * onto a different filesystem ends up as a single-threaded
+     * bounce copy inside the kernel; pipelining does better */
+    if (fstatfs(cp->part->srcfd, &fs) == 0 &&
+	(fs.f_type == NFS_SUPER_MAGIC || fs.f_type == FUSE_SUPER_MAGIC) &&
+	fstat(cp->part->srcfd, &src) == 0 && fstat(dstfd, &dst) == 0 &&
+	src.st_dev != dst.st_dev)
+	return COPY_BUFFERED;
+    return COPY_AUTO;
+}
+
+/* write the names of the engines that copied cp into 'how' (64 bytes) */
+static void
+engines_used(const struct cpart *cp, char *how)
+{
+    static const int order[] = { COPY_REFLINK, COPY_URING, COPY_RANGE, COPY_BUFFERED, COPY_DIRECT };
+    size_t i;
+
+    how[0] = 0;
+    for (i=0; i<sizeof(order)/sizeof(order[0]); i++) {
+	if (!(cp->used & (1 << order[i])))
+	    continue;
+	if (how[0])
+	    strcat(how, "+");
+	strcat(how, engine_names[order[i]]);
+    }
+    if (!how[0])
+	strcpy(how, "nothing to copy");
+}
+
+static void
+fill_stats(const struct cpart *cp, struct partstats *st)
+{
+    st->extents = cp->part->pipe ? 0 : cp->map.len;
+    st->data = cp->data;
+    st->cloned = cp->cloned;
+    st->copied = cp->copied;
+    st->zeroed = cp->zeroed;
+    st->nlseek = cp->map.nlseek;
+    st->nfiemap = cp->map.nfiemap;
+    st->ncfr = cp->ncfr;
+    st->nclone = cp->nclone;
+    st->npread = cp->npread;
+    st->npwrite = cp->npwrite;
+    st->nretry = cp->nretry;
+    st->nsfr = cp->nsfr;
+    st->nfadvise = cp->nfadvise;
+    st->seconds = cp->t1 - cp->t0;
+    engines_used(cp, st->engine);
+}
+
+/* tell the user how each partition was copied */
+static void
+report(const struct cpart *cp)
+{
+    char how[64];
+
+    engines_used(cp, how);
+    if (cp->zeroed)
+	warnf("p%d: %lld bytes via %s (%lld cloned, %lld copied, %lld zeros skipped)\n", cp->part->num,
+	      (long long)cp->data, how, (long long)cp->cloned, (long long)cp->copied, (long long)cp->zeroed);
+    else
+	warnf("p%d: %lld bytes via %s (%lld cloned, %lld copied)\n", cp->part->num,
+	      (long long)cp->data, how, (long long)cp->cloned, (long long)cp->copied);
+    /* not worth mentioning if the filesystem just doesn't do reflinks */
+    if (cp->noclone && cp->noclone != EOPNOTSUPP && cp->noclone != EXDEV && cp->noclone != ENOTTY)
+	warnf("p%d: note: not cloning: %s\n", cp->part->num, strerror(cp->noclone));
+    if (cp->nouring)
+	warnf("p%d: note: not using io_uring: %s\n", cp->part->num, strerror(cp->nouring));
+    if (cp->fallback)
+	warnf("p%d: note: not using copy_file_range: %s\n", cp->part->num, strerror(cp->fallback));
+    if (cp->dsrcerr)
+	warnf("p%d: note: reading without O_DIRECT: %s\n", cp->part->num, strerror(cp->dsrcerr));
+}
+
+/* open the images for O_DIRECT and pick an alignment that
+ * satisfies every image and every source opened for O_DIRECT;
+ * if there is no usable alignment, fall back to ordinary I/O */
+static int
+setup_direct(struct pool *p, const struct copyimage *imgs, int nimgs, struct cpart *cps, int n)
+{
+    int i, a;
+
+    if (!(p->ddstfds = calloc(nimgs, sizeof(int))))
+	return -1;
+    for (i=0; i<nimgs; i++) {
+	if ((a = dio_align(imgs[i].fd)) > p->dalign)
+	    p->dalign = a;
+	if ((p->ddstfds[i] = dio_reopen(imgs[i].fd, O_WRONLY)) < 0)
+	    warnf("note: writing without O_DIRECT: %s\n", strerror(errno));
+    }
+    for (i=0; i<n; i++)
+	if (cps[i].dsrcfd >= 0 && (a = dio_align(cps[i].dsrcfd)) > p->dalign)
+	    p->dalign = a;
+    if (p->dalign > 0 && !(p->dalign & (p->dalign-1)) && p->dalign <= (1L << CHUNK_ALIGN_BITS)) {
+	for (i=0; i<n; i++)
+	    cps[i].ddstfd = p->ddstfds[cps[i].img];
+	return 0;
+    }
+    warnf("note: can't use O_DIRECT alignment %d; using ordinary I/O\n", p->dalign);
+    for (i=0; i<nimgs; i++) {
+	if (p->ddstfds[i] >= 0)
+	    close(p->ddstfds[i]);
+	p->ddstfds[i] = -1;
+    }
+    for (i=0; i<n; i++) {
+	if (cps[i].dsrcfd >= 0)
+	    close(cps[i].dsrcfd);
+	cps[i].dsrcfd = -1;
+    }
+    return 0;
+}
+
+/* make everything in 'part' that isn't covered by an extent
+ * in 'map' (which may be NULL) read as zeros; the ranges are
+ * rounded out to whole sectors, which is fine as long as
+ * this happens before any data is copied */
+static int
+zero_holes(int dstfd, const struct partinfo *part, const struct extmap *map)
+{
+    off_t base, end, pos, lo, hi;
+    size_t i, n;
+
+    base = part->startlba << 9;
+    end = base + (part->nsectors << 9);
+    n = map ? map->len : 0;
+    pos = base;
+    for (i=0; i<=n; i++) {
+	lo = aligndown(pos, 9);
+	hi = i < n ? alignup(base + map->ext[i].off, 9) : end;
+	if (hi > lo && blk_zero(dstfd, lo, hi - lo) < 0)
+	    return -1;
+	if (i < n)
+	    pos = base + map->ext[i].off + map->ext[i].len;
+    }
+    return 0;
+}
+
+/* sort by descending source size, then by image
+ * and partition number, so that the schedule is deterministic */
+static int
+bysize(const void *a, const void *b)
+{
+    const struct cpart *pa = a, *pb = b;
+
+    if (pa->part->srcsz != pb->part->srcsz)
+	return pa->part->srcsz > pb->part->srcsz ? -1 : 1;
+    if (pa->img != pb->img)
+	return pa->img - pb->img;
+    return pa->part->num - pb->part->num;
+}
+
+/* sort jobs by image and then image offset, so that
+ * COPY_URING writes each image front to back */
+static int
+byoffset(const void *a, const void *b)
+{
+    const struct copyjob *ja = a, *jb = b;
+    off_t oa, ob;
+
+    if (ja->cp->img != jb->cp->img)
+	return ja->cp->img - jb->cp->img;
+    oa = (ja->cp->part->startlba << 9) + ja->lo;
+    ob = (jb->cp->part->startlba << 9) + jb->lo;
+    return oa < ob ? -1 : oa > ob;
+}
+
+/* split the data of cp into at most 'nchunks' source
+ * ranges holding roughly equal amounts of data;
+ * returns the number of jobs written to 'out' */
+static int
+split(struct cpart *cp, int nchunks, struct copyjob *out)
+{
+    const struct extmap *m = &cp->map;
+    off_t lo, acc, want, cut;
+    size_t i;
+    int n, k;
+
+    n = 0;
+    lo = 0;
+    acc = 0;
+    k = 1;
+    for (i=0; i<m->len && k<nchunks; i++) {
+	while (k < nchunks && acc + m->ext[i].len > (want = cp->data*k/nchunks)) {
+	    cut = alignup(m->ext[i].off + (want - acc), CHUNK_ALIGN_BITS);
+	    if (cut > lo && cut < m->size) {
+		out[n].cp = cp;
+		out[n].lo = lo;
+		out[n].hi = cut;
+		n++;
+		lo = cut;
+	    }
+	    k++;
+	}
+	acc += m->ext[i].len;
+    }
+    out[n].cp = cp;
+    out[n].lo = lo;
+    out[n].hi = m->size;
+    return n+1;
+}
+
+int
+copy_images(const struct copyimage *imgs, int nimgs, const struct copyopts *opts)
+{
+    struct pool pool = {0};
+    struct partinfo *head;
+    struct cpart *cps;
+    pthread_t *tids, rtid;
+    off_t total, per;
+    int i, j, k, n, nstarted, nchunks, nthreads, ret;
+
+    /* zero blocks can only be found in data read into buffers */
+    if (opts->skipzero && (opts->engine == COPY_RANGE || opts->engine == COPY_REFLINK ||
+			   opts->engine == COPY_URING))
+	return rc(EINVAL);
+    nthreads = opts->nthreads;
+    n = 0;
+    for (j=0; j<nimgs; j++) {
+	for (head = imgs[j].parts; head; head = head->next) {
+	    if (head->srcfd >= 0)
+		n++;
+	    else if (opts->zerofill && !head->hidden && zero_holes(imgs[j].fd, head, NULL) < 0) {
+		warnf("p%d: zeroing: %m\n", head->num);
+		return -1;
+	    }
+	}
+    }
+    if (!n)
+	return 0;
+    if (nthreads < 1)
+	nthreads = 1;
+
+    ret = -1;
+    tids = NULL;
+    cps = calloc(n, sizeof(struct cpart));
+    if (!cps)
+	return -1;
+    i = 0;
+    for (j=0; j<nimgs; j++) {
+	for (head = imgs[j].parts; head; head = head->next) {
+	    if (head->srcfd < 0)
+		continue;
+	    cps[i].dsrcfd = -1;
+	    cps[i].ddstfd = -1;
+	    cps[i].dstfd = imgs[j].fd;
+	    cps[i].img = j;
+	    cps[i++].part = head;
+	}
+    }
+    qsort(cps, n, sizeof(struct cpart), bysize);
+
+    total = 0;
+    for (i=0; i<n; i++) {
+	if (cps[i].part->pipe) {
+	    /* all we know is how much a pipe may produce */
+	    cps[i].map.size = cps[i].part->srcsz;
+	    if (extmap_add(&cps[i].map, 0, cps[i].part->srcsz) < 0)
+		goto done;
+	} else if (cps[i].part->map) {
+	    if (extmap_copy(&cps[i].map, cps[i].part->map) < 0)
+		goto done;
+	} else if (cps[i].part->rd ? cps[i].part->rd->extents(cps[i].part->rd, &cps[i].map) < 0 :
+		   extmap_scan(&cps[i].map, cps[i].part->srcfd, cps[i].part->srcsz) < 0) {
+	    warnf("p%d: finding data extents: %m\n", cps[i].part->num);
+	    goto done;
+	}
+	if (opts->zerofill && zero_holes(cps[i].dstfd, cps[i].part, cps[i].part->pipe ? NULL : &cps[i].map) < 0) {
+	    warnf("p%d: zeroing holes: %m\n", cps[i].part->num);
+	    goto done;
+	}
+	cps[i].data = extmap_bytes(&cps[i].map);
+	if ((cps[i].engine = pick_engine(cps[i].dstfd, &cps[i], opts->engine)) < 0)
+	    goto done;
+	if (opts->wb.sequential && !cps[i].part->pipe) {
+	    cps[i].nfadvise++;
+	    posix_fadvise(cps[i].part->srcfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	total += cps[i].data;
+    }
+
+    /* each partition gets a number of chunks proportional
+     * to its share of the total data, so that one huge partition
+     * is spread across all of the workers */
+    per = total / nthreads;
+    if (per < MIN_CHUNK)
+	per = MIN_CHUNK;
+    /* split() never produces more than nthreads jobs per partition */
+    pool.todo = calloc((unsigned)n, (unsigned)nthreads*sizeof(struct copyjob));
+    if (!pool.todo)
+	goto done;
+    for (i=0; i<n; i++) {
+	nchunks = (int)((cps[i].data + per - 1) / per);
+	if (nchunks > nthreads)
+	    nchunks = nthreads;
+	if (nchunks < 1 || cps[i].part->pipe)
+	    nchunks = 1;
+	pool.ntodo += split(&cps[i], nchunks, pool.todo + pool.ntodo);
+    }
+    if (opts->engine == COPY_URING)
+	qsort(pool.todo, pool.ntodo, sizeof(struct copyjob), byoffset);
+    pool.skipzero = opts->skipzero;
+    pool.zerofill = opts->zerofill;
+    pool.wb = copy_writeback(&opts->wb);
+    if (opts->engine == COPY_DIRECT && setup_direct(&pool, imgs, nimgs, cps, n) < 0)
+	goto done;
+    if (nthreads > pool.ntodo)
+	nthreads = pool.ntodo;
+    /* the calling thread is always one of the workers; nothing
+     * may fail once the reporter is running, since it reads pool */
+    tids = calloc(nthreads, sizeof(pthread_t));
+    if (!tids)
+	goto done;
+    pool.cps = cps;
+    pool.ncps = n;
+    pool.total = total;
+    pool.opts = opts;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    if (opts->progress && pthread_create(&rtid, NULL, reporter, &pool) != 0)
+	pool.finished = true;
+
+    nstarted = 0;
+    for (i=1; i<nthreads; i++) {
+	if (pthread_create(&tids[i], NULL, worker, &pool) != 0) {
+	    warnf("warning: started only %d of %d copy threads\n", i, nthreads);
+	    break;
+	}
+	nstarted = i;
+    }
+    worker(&pool);
+    for (i=1; i<=nstarted; i++)
+	pthread_join(tids[i], NULL);
+    if (opts->progress) {
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.finished) {
+	    pool.finished = true;
+	    pthread_cond_signal(&pool.cond);
+	    pthread_mutex_unlock(&pool.lock);
+	    pthread_join(rtid, NULL);
+	} else {
+	    pthread_mutex_unlock(&pool.lock);
+	}
+	opts->progress(opts->progress_arg, progress(&pool), total);
+    }
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    ret = pool.err ? rc(pool.err) : 0;
+    for (j=0; j<nimgs && !ret; j++) {
+	if (nimgs > 1)
+	    warnf("%s:\n", imgs[j].name);
+	for (head = imgs[j].parts, k = 0; head; head = head->next, k++) {
+	    for (i=0; i<n; i++) {
+		if (cps[i].part != head)
+		    continue;
+		report(&cps[i]);
+		if (imgs[j].stats)
+		    fill_stats(&cps[i], &imgs[j].stats[k]);
+	    }
+	}
+    }
+
+done:
+    for (i=0; i<n; i++) {
+	extmap_free(&cps[i].map);
+	if (cps[i].dsrcfd >= 0)
+	    close(cps[i].dsrcfd);
+    }
+    for (j=0; pool.ddstfds && j<nimgs; j++)
+	if (pool.ddstfds[j] >= 0)
+	    close(pool.ddstfds[j]);
+    free(pool.ddstfds);
+    free(tids);
+    free(pool.todo);
+    free(cps);
+    return ret;
+}
+
+struct writeback
+copy_writeback(const struct writeback *wb)
+{
+    struct writeback w = *wb;
+
+    if (w.dontneed && !w.dirty)
+	w.dirty = WB_DIRTY_DEFAULT;
+    return w;
+}
+
+int
+copy_parts(int dstfd, struct partinfo *parts, const struct copyopts *opts)
+{
+    struct copyimage img = {0};
+
+    img.fd = dstfd;
+    img.parts = parts;
+    img.stats = opts->stats;
+    return copy_images(&img, 1, opts);
+}
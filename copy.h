@@ -0,0 +1,123 @@
+#ifndef __COPY_H_
+#define __COPY_H_
+#include <stdbool.h>
+#include "part.h"
+
+/* copy engines */
+enum {
+    COPY_AUTO,     /* COPY_REFLINK where possible, then copy_file_range(2),
+		    * falling back to COPY_BUFFERED */
+    COPY_RANGE,    /* copy_file_range(2) only */
+    COPY_BUFFERED, /* pipelined read(2)/write(2) through userspace buffers */
+    COPY_REFLINK,  /* FICLONERANGE for whole blocks, copy_file_range(2)
+		    * for the unaligned head and tail of each extent */
+    COPY_DIRECT,   /* COPY_BUFFERED with O_DIRECT on the source and the
+		    * image where possible, bypassing the page cache */
+    COPY_URING,    /* reads and writes queued through io_uring(7), many
+		    * at once, with the writes of each job submitted in
+		    * image order; COPY_AUTO where io_uring isn't available */
+};
+
+/* what copy_parts() did for one partition */
+struct partstats {
+    long extents;      /* data extents in the source */
+    off_t data;        /* bytes in those extents */
+    off_t cloned;      /* bytes shared via FICLONERANGE */
+    off_t copied;      /* bytes copied by any other means */
+    off_t zeroed;      /* bytes of zero blocks left as holes */
+    long nlseek;       /* lseek(2) calls finding extents */
+    long nfiemap;      /* FS_IOC_FIEMAP calls finding extents */
+    long ncfr;         /* copy_file_range(2) calls */
+    long nclone;       /* FICLONERANGE calls */
+    long npread;       /* pread(2) calls */
+    long npwrite;      /* pwrite(2) calls */
+    long nretry;       /* short copies and writes that had to be continued */
+    long nsfr;         /* sync_file_range(2) calls (see struct writeback) */
+    long nfadvise;     /* posix_fadvise(2) calls */
+    double seconds;    /* from the first job starting to the last one finishing */
+    char engine[64];   /* engines used, joined by '+' */
+};
+
+/* what to do about the page cache while copying */
+struct writeback {
+    off_t dirty;     /* once a worker has written this many bytes of
+		      * the image, start writing them back with
+		      * sync_file_range(2) and wait for the batch before,
+		      * so that no more than about twice this much per
+		      * worker is ever dirty (0 = leave it to the kernel) */
+    bool dontneed;   /* drop source and image pages once they have
+		      * been copied and written back (POSIX_FADV_DONTNEED);
+		      * implies a 'dirty' of WB_DIRTY_DEFAULT if it's 0 */
+    bool sequential; /* POSIX_FADV_SEQUENTIAL on each source */
+    bool sync;       /* fdatasync(2) the image before and after writing
+		      * the partition table (up to the caller) */
+};
+
+#define WB_DIRTY_DEFAULT (64L << 20)
+
+struct copyopts {
+    int nthreads;  /* number of copy workers */
+    int engine;    /* one of the COPY_* engines */
+    bool skipzero; /* check data for all-zero blocks and leave them
+		    * as holes (this routes data through COPY_BUFFERED,
+		    * or COPY_DIRECT; it can't be combined with the
+		    * other engines) */
+    bool zerofill; /* the destination doesn't read as zeros where nothing
+		    * is written, so zero every byte of each partition that
+		    * isn't data (source holes, zero blocks, empty partitions) */
+    struct partstats *stats; /* if set, filled in for each partition
+			      * in list order (empty ones are left alone) */
+    struct writeback wb;
+    /* if set, called every PROGRESS_MSEC while copying, and once
+     * at the end, with the bytes of source data dealt with so far
+     * and in all; it is only ever called from one thread at a time */
+    void (*progress)(void *arg, off_t done, off_t total);
+    void *progress_arg;
+};
+
+#define PROGRESS_MSEC 250
+
+/* one image for copy_images() */
+struct copyimage {
+    const char *name;          /* used in messages */
+    int fd;
+    struct partinfo *parts;
+    struct partstats *stats;   /* like copyopts.stats, for this image */
+};
+
+/* copy_writeback() returns the policy that copying
+ * with 'wb' actually follows (dontneed fills in a dirty
+ * window), for reporting what was done */
+struct writeback copy_writeback(const struct writeback *wb);
+
+/* copy_engine() returns the engine named by 'name' ("auto",
+ * "cfr" or "copy_file_range", "buffered", "reflink", "direct",
+ * or "uring" or "io_uring"),
+ * or -1 if the name isn't recognized */
+int copy_engine(const char *name);
+
+/* copy_parts() copies the contents of every partition
+ * in 'parts' that has a source image (srcfd >= 0) into
+ * 'dstfd' at the byte offset of the partition's startlba
+ *
+ * up to opts->nthreads workers copy concurrently; partitions holding
+ * a large share of the data are split into several source ranges
+ * so that they are copied by more than one worker, and the largest
+ * partitions are scheduled first so that the longest copy doesn't
+ * end up running by itself at the end
+ *
+ * the engine actually used for each partition is
+ * reported on stderr once the copy is complete
+ *
+ * returns 0 on success, or -1 (with errno set)
+ * if any partition could not be copied; errno is EINVAL
+ * if opts->skipzero is set with an engine that can't honour it */
+int copy_parts(int dstfd, struct partinfo *parts, const struct copyopts *opts);
+
+/* copy_images() is copy_parts() for several images at once:
+ * the partitions of every image are scheduled on one pool of
+ * opts->nthreads workers (opts->stats is ignored in favour
+ * of each image's own) */
+int copy_images(const struct copyimage *imgs, int nimgs, const struct copyopts *opts);
+
+#endif
@@ -0,0 +1,691 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+#include "filesize.h"
+#include "source.h"
+#include "decomp.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define DECOMP_BUFSZ (1L << 20)
+#define ZSTD_MAGIC   0xfd2fb528
+#define ZSTD_SKIPPABLE 0x184d2a50 /* to 0x184d2a5f */
+#define ZFRAME_MAX   (32L << 20) /* the largest frame decoded in parallel */
+
+enum { GZIP, XZ, ZSTD };
+
+/* one zstd frame: 'inlen' bytes at 'in' decode to 'outlen'
+ * bytes (-1 if the frame doesn't say) */
+struct zframe {
+    off_t in, inlen;
+    off_t outlen;
+};
+
+/* the frames of a zstd file being decoded by several threads;
+ * frame i is decoded into slot i % nslots, at most nslots
+ * frames ahead of the one being read */
+struct zpool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const struct zframe *f;
+    size_t nf;
+    int fd;
+    size_t next;          /* the next frame to decode */
+    size_t cur;           /* the frame being read */
+    off_t curoff;         /* how much of it has been read */
+    unsigned char **slot; /* ZFRAME_MAX (at most) bytes each */
+    bool *ready;          /* slot holds its frame */
+    size_t nslots;
+    pthread_t *tids;
+    int nt;
+    int err;
+    bool stop;
+};
+
+struct dsrc {
+    struct srcreader rd;  /* must be first */
+    int fd;
+    int kind;
+    int nthreads;
+    off_t inoff;          /* next compressed byte to read */
+    off_t outoff;         /* decompressed bytes produced so far */
+    unsigned char *in;    /* DECOMP_BUFSZ bytes of input */
+    bool started;         /* the decoder has been set up */
+    bool member;          /* in the middle of a gzip member */
+    bool single;          /* the gzip size came from the trailer */
+    int members;          /* gzip members decoded */
+    bool eof;
+    z_stream z;
+    lzma_stream x;
+    ZSTD_DCtx *zd;        /* decoding in order */
+    ZSTD_inBuffer zin;
+    struct zframe *zf;    /* the frames to decode in parallel, if any */
+    size_t nzf;
+    struct zpool *zp;     /* decoding in parallel */
+};
+
+static inline uint32_t
+get_le32(const unsigned char *p)
+{
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* fill the input buffer; returns the number of bytes available */
+static ssize_t
+refill(struct dsrc *d, const unsigned char **next, size_t *avail)
+{
+    ssize_t n;
+
+    if (*avail)
+	return *avail;
+    while ((n = pread(d->fd, d->in, DECOMP_BUFSZ, d->inoff)) < 0 && errno == EINTR)
+	;
+    if (n < 0)
+	return -1;
+    d->inoff += n;
+    *next = d->in;
+    *avail = n;
+    return n;
+}
+
+static ssize_t
+gzip_read(struct dsrc *d, unsigned char *buf, size_t len)
+{
+    const unsigned char *next;
+    size_t avail;
+    ssize_t n;
+    int ret;
+
+    if (!d->started) {
+	/* 15+32: any window size, and expect a gzip header */
+	if (inflateInit2(&d->z, 15+32) != Z_OK)
+	    return rc(ENOMEM);
+	d->started = true;
+    }
+    d->z.next_out = buf;
+    d->z.avail_out = len;
+    while (d->z.avail_out && !d->eof) {
+	next = d->z.next_in;
+	avail = d->z.avail_in;
+	if ((n = refill(d, &next, &avail)) < 0)
+	    return -1;
+	if (n == 0) {
+	    if (d->member)
+		return rc(EIO); /* truncated */
+	    d->eof = true;
+	    break;
+	}
+	d->z.next_in = (unsigned char *)next;
+	d->z.avail_in = avail;
+	/* the trailer only gives the size of a lone member */
+	if (!d->member && d->single && d->members) {
+	    dprintf(2, "a gzip file with several members needs its size given as <size:file\n");
+	    return rc(EFBIG);
+	}
+	d->member = true;
+	ret = inflate(&d->z, Z_NO_FLUSH);
+	if (ret == Z_STREAM_END) {
+	    /* there may be another member after this one */
+	    inflateReset(&d->z);
+	    d->member = false;
+	    d->members++;
+	} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+	    return rc(EIO);
+	}
+    }
+    return len - d->z.avail_out;
+}
+
+static ssize_t
+xz_read(struct dsrc *d, unsigned char *buf, size_t len)
+{
+    lzma_mt mt = {0};
+    lzma_action act;
+    const unsigned char *next;
+    size_t avail;
+    ssize_t n;
+    lzma_ret ret;
+
+    if (!d->started) {
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = d->nthreads;
+	mt.memlimit_threading = lzma_physmem() / 4;
+	mt.memlimit_stop = UINT64_MAX;
+	/* multi-block streams (xz -T) decode in parallel */
+	if (lzma_stream_decoder_mt(&d->x, &mt) != LZMA_OK &&
+	    lzma_stream_decoder(&d->x, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+	    return rc(ENOMEM);
+	d->started = true;
+    }
+    d->x.next_out = buf;
+    d->x.avail_out = len;
+    act = LZMA_RUN;
+    while (d->x.avail_out && !d->eof) {
+	next = d->x.next_in;
+	avail = d->x.avail_in;
+	if (act == LZMA_RUN) {
+	    if ((n = refill(d, &next, &avail)) < 0)
+		return -1;
+	    if (n == 0)
+		act = LZMA_FINISH;
+	}
+	d->x.next_in = next;
+	d->x.avail_in = avail;
+	ret = lzma_code(&d->x, act);
+	if (ret == LZMA_STREAM_END)
+	    d->eof = true;
+	else if (ret != LZMA_OK)
+	    return rc(ret == LZMA_MEM_ERROR ? ENOMEM : EIO);
+    }
+    return len - d->x.avail_out;
+}
+
+/* decode the frames of a zstd file in order, with one thread */
+static ssize_t
+zstd_read(struct dsrc *d, unsigned char *buf, size_t len)
+{
+    ZSTD_outBuffer out = { buf, len, 0 };
+    const unsigned char *next;
+    size_t avail, ret;
+    ssize_t n;
+
+    if (!d->started) {
+	if (!(d->zd = ZSTD_createDCtx()))
+	    return rc(ENOMEM);
+	d->started = true;
+    }
+    while (out.pos < out.size && !d->eof) {
+	next = (const unsigned char *)d->zin.src + d->zin.pos;
+	avail = d->zin.size - d->zin.pos;
+	if ((n = refill(d, &next, &avail)) < 0)
+	    return -1;
+	if (n == 0) {
+	    if (d->member)
+		return rc(EIO); /* truncated */
+	    d->eof = true;
+	    break;
+	}
+	d->zin = (ZSTD_inBuffer){ next, avail, 0 };
+	ret = ZSTD_decompressStream(d->zd, &out, &d->zin);
+	if (ZSTD_isError(ret))
+	    return rc(EIO);
+	/* 0 means a frame has just ended */
+	d->member = ret != 0;
+    }
+    return out.pos;
+}
+
+static int
+pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    unsigned char *p = buf;
+    ssize_t n;
+
+    while (len) {
+	if ((n = pread(fd, p, len, off)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return n < 0 ? -1 : rc(EIO);
+	p += n;
+	len -= (size_t)n;
+	off += n;
+    }
+    return 0;
+}
+
+/* a zpool thread: decode frames into free slots until they run out */
+static void *
+zpool_worker(void *arg)
+{
+    struct zpool *p = arg;
+    ZSTD_DCtx *zd;
+    unsigned char *in;
+    size_t i, n, inmax;
+    int e;
+
+    in = NULL;
+    inmax = 0;
+    if (!(zd = ZSTD_createDCtx())) {
+	e = ENOMEM;
+	goto fail;
+    }
+    for (;;) {
+	pthread_mutex_lock(&p->lock);
+	while (!p->stop && !p->err && p->next < p->nf && p->next >= p->cur + p->nslots)
+	    pthread_cond_wait(&p->cond, &p->lock);
+	if (p->stop || p->err || p->next == p->nf) {
+	    pthread_mutex_unlock(&p->lock);
+	    break;
+	}
+	i = p->next++;
+	pthread_mutex_unlock(&p->lock);
+
+	if ((size_t)p->f[i].inlen > inmax) {
+	    free(in);
+	    inmax = p->f[i].inlen;
+	    if (!(in = malloc(inmax))) {
+		e = ENOMEM;
+		goto fail;
+	    }
+	}
+	if (pread_full(p->fd, in, p->f[i].inlen, p->f[i].in) < 0) {
+	    e = errno;
+	    goto fail;
+	}
+	n = ZSTD_decompressDCtx(zd, p->slot[i % p->nslots], p->f[i].outlen, in, p->f[i].inlen);
+	if (ZSTD_isError(n) || n != (size_t)p->f[i].outlen) {
+	    e = EIO;
+	    goto fail;
+	}
+	pthread_mutex_lock(&p->lock);
+	p->ready[i % p->nslots] = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+    }
+    ZSTD_freeDCtx(zd);
+    free(in);
+    return NULL;
+fail:
+    pthread_mutex_lock(&p->lock);
+    if (!p->err)
+	p->err = e;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    ZSTD_freeDCtx(zd);
+    free(in);
+    return NULL;
+}
+
+static void
+zpool_free(struct zpool *p)
+{
+    size_t i;
+    int t;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (t = 0; t < p->nt; t++)
+	pthread_join(p->tids[t], NULL);
+    for (i = 0; i < p->nslots; i++)
+	free(p->slot[i]);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->slot);
+    free(p->ready);
+    free(p->tids);
+    free(p);
+}
+
+/* start 'nthreads' threads decoding the frames of 'd' ahead of the
+ * reader, with a slot per thread and one more, so that the frame
+ * being read doesn't hold anyone up */
+static struct zpool *
+zpool_start(struct dsrc *d)
+{
+    struct zpool *p;
+    off_t max;
+    size_t i;
+    int e;
+
+    if (!(p = calloc(1, sizeof(*p))))
+	return NULL;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->f = d->zf;
+    p->nf = d->nzf;
+    p->fd = d->fd;
+    p->nslots = d->nthreads + 1;
+    max = 0;
+    for (i = 0; i < p->nf; i++)
+	if (p->f[i].outlen > max)
+	    max = p->f[i].outlen;
+    p->slot = calloc(p->nslots, sizeof(*p->slot));
+    p->ready = calloc(p->nslots, sizeof(*p->ready));
+    p->tids = calloc(d->nthreads, sizeof(*p->tids));
+    if (!p->slot || !p->ready || !p->tids)
+	goto fail;
+    for (i = 0; i < p->nslots; i++)
+	if (!(p->slot[i] = malloc(max ? max : 1)))
+	    goto fail;
+    for (; p->nt < d->nthreads; p->nt++) {
+	if ((e = pthread_create(&p->tids[p->nt], NULL, zpool_worker, p))) {
+	    if (p->nt)
+		break;
+	    errno = e;
+	    goto fail;
+	}
+    }
+    return p;
+fail:
+    e = errno;
+    zpool_free(p);
+    errno = e;
+    return NULL;
+}
+
+/* hand out the frames decoded by the pool, in order */
+static ssize_t
+zpool_read(struct dsrc *d, unsigned char *buf, size_t len)
+{
+    struct zpool *p;
+    const struct zframe *f;
+    size_t got, n, s;
+    int e;
+
+    if (!d->started) {
+	if (!(d->zp = zpool_start(d)))
+	    return -1;
+	d->started = true;
+    }
+    p = d->zp;
+    for (got = 0; got < len && p->cur < p->nf; got += n) {
+	s = p->cur % p->nslots;
+	f = &p->f[p->cur];
+	pthread_mutex_lock(&p->lock);
+	while (!p->ready[s] && !p->err)
+	    pthread_cond_wait(&p->cond, &p->lock);
+	e = p->err;
+	pthread_mutex_unlock(&p->lock);
+	if (e)
+	    return rc(e);
+	/* the slot is the reader's until it moves on */
+	n = len - got < (size_t)(f->outlen - p->curoff) ? len - got : (size_t)(f->outlen - p->curoff);
+	memcpy(buf + got, p->slot[s] + p->curoff, n);
+	p->curoff += n;
+	if (p->curoff == f->outlen) {
+	    pthread_mutex_lock(&p->lock);
+	    p->ready[s] = false;
+	    p->cur++;
+	    p->curoff = 0;
+	    pthread_cond_broadcast(&p->cond);
+	    pthread_mutex_unlock(&p->lock);
+	}
+    }
+    return got;
+}
+
+static ssize_t
+dsrc_read(struct srcreader *r, void *buf, size_t len, off_t off)
+{
+    struct dsrc *d = (struct dsrc *)r;
+    ssize_t n;
+
+    if (off != d->outoff)
+	return rc(ESPIPE);
+    switch (d->kind) {
+    case GZIP:
+	n = gzip_read(d, buf, len);
+	break;
+    case XZ:
+	n = xz_read(d, buf, len);
+	break;
+    default:
+	n = d->nzf ? zpool_read(d, buf, len) : zstd_read(d, buf, len);
+	break;
+    }
+    if (n > 0)
+	d->outoff += n;
+    return n;
+}
+
+static void
+dsrc_close(struct srcreader *r)
+{
+    struct dsrc *d = (struct dsrc *)r;
+
+    if (d->kind == GZIP && d->started)
+	inflateEnd(&d->z);
+    if (d->kind == XZ && d->started)
+	lzma_end(&d->x);
+    if (d->zp)
+	zpool_free(d->zp);
+    ZSTD_freeDCtx(d->zd);
+    free(d->zf);
+    free(d->in);
+    free(d);
+}
+
+/* a gzip member records its size, modulo 2^32, in its trailer,
+ * but a file may hold several members, and only the last one's
+ * trailer is at the end; deflate grows data by only a few bytes
+ * per 64K, so a file much bigger than its trailer says is either,
+ * and dsrc.single has the decoder check the rest */
+static off_t
+gzip_size(int fd)
+{
+    unsigned char t[4];
+    off_t csize, isize;
+
+    if ((csize = fdsize(fd)) < 0)
+	return -1;
+    if (csize < 18 || pread_full(fd, t, sizeof(t), csize - 4) < 0)
+	return -1;
+    isize = get_le32(t);
+    if (csize > isize + isize/1024 + 65536)
+	return -1;
+    return isize;
+}
+
+/* xz records the uncompressed size of every block in its index */
+static off_t
+xz_size(int fd)
+{
+    lzma_stream x = LZMA_STREAM_INIT;
+    lzma_index *idx = NULL;
+    unsigned char *buf;
+    off_t csize, pos, ret;
+    ssize_t n;
+    lzma_ret lr;
+
+    if ((csize = fdsize(fd)) < 0)
+	return -1;
+    if (!(buf = malloc(DECOMP_BUFSZ)))
+	return -1;
+    ret = -1;
+    if (lzma_file_info_decoder(&x, &idx, UINT64_MAX, csize) != LZMA_OK)
+	goto out;
+    pos = 0;
+    for (;;) {
+	if (!x.avail_in) {
+	    if ((n = pread(fd, buf, DECOMP_BUFSZ, pos)) < 0)
+		goto out;
+	    pos += n;
+	    x.next_in = buf;
+	    x.avail_in = n;
+	}
+	lr = lzma_code(&x, LZMA_RUN);
+	if (lr == LZMA_SEEK_NEEDED) {
+	    pos = x.seek_pos;
+	    x.avail_in = 0;
+	    continue;
+	}
+	if (lr == LZMA_STREAM_END)
+	    break;
+	if (lr != LZMA_OK)
+	    goto out;
+    }
+    ret = lzma_index_uncompressed_size(idx);
+out:
+    if (idx)
+	lzma_index_end(idx, NULL);
+    lzma_end(&x);
+    free(buf);
+    return ret;
+}
+
+/* the size of a zstd frame header, and the content size it
+ * gives (or -1), from the first 18 bytes of the frame 'h' */
+static size_t
+zstd_header(const unsigned char *h, off_t *outlen)
+{
+    static const int didlen[4] = { 0, 1, 2, 4 };
+    int fcs, single, fcslen;
+    size_t len;
+    uint64_t v;
+    int i;
+
+    fcs = h[4] >> 6;
+    single = (h[4] >> 5) & 1;
+    fcslen = fcs ? 1 << fcs : single;
+    len = 5 + !single + didlen[h[4] & 3];
+    v = 0;
+    for (i = fcslen; i > 0; i--)
+	v = v << 8 | h[len + i - 1];
+    if (fcslen == 2)
+	v += 256;
+    *outlen = fcslen ? (off_t)v : -1;
+    if (*outlen < -1)
+	*outlen = -1;
+    return len + fcslen;
+}
+
+/* find the frames of the zstd file 'fd' by walking their headers and
+ * the headers of their blocks (which give their lengths), without
+ * decoding anything; skippable frames are left out
+ *
+ * *size is the total content size, or -1 if a frame doesn't give it */
+static int
+zstd_frames(int fd, struct zframe **zf, size_t *nzf, off_t *size)
+{
+    unsigned char h[18];
+    struct zframe *f;
+    off_t csize, pos, outlen;
+    uint32_t magic, b;
+    size_t n;
+    bool ck;
+
+    *zf = NULL;
+    *nzf = 0;
+    *size = 0;
+    if ((csize = fdsize(fd)) < 0)
+	return -1;
+    for (pos = 0; pos < csize; ) {
+	n = csize - pos < (off_t)sizeof(h) ? (size_t)(csize - pos) : sizeof(h);
+	memset(h, 0, sizeof(h));
+	if (n < 8 || pread_full(fd, h, n, pos) < 0)
+	    goto bad;
+	magic = get_le32(h);
+	if ((magic & 0xfffffff0) == ZSTD_SKIPPABLE) {
+	    pos += 8 + (off_t)get_le32(h + 4);
+	    continue;
+	}
+	if (magic != ZSTD_MAGIC)
+	    goto bad;
+	if (*nzf % 64 == 0) {
+	    if (!(f = realloc(*zf, (*nzf + 64) * sizeof(*f))))
+		goto fail;
+	    *zf = f;
+	}
+	f = &(*zf)[(*nzf)++];
+	f->in = pos;
+	ck = h[4] & 4;
+	pos += zstd_header(h, &outlen);
+	f->outlen = outlen;
+	if (outlen < 0 || *size < 0)
+	    *size = -1;
+	else
+	    *size += outlen;
+	/* blocks: 1 bit last, 2 bits type, 21 bits size */
+	do {
+	    if (pos + 3 > csize || pread_full(fd, h, 3, pos) < 0)
+		goto bad;
+	    b = h[0] | (uint32_t)h[1] << 8 | (uint32_t)h[2] << 16;
+	    if (((b >> 1) & 3) == 3)
+		goto bad;
+	    pos += 3 + (((b >> 1) & 3) == 1 ? 1 : b >> 3);
+	} while (!(b & 1));
+	if (ck)
+	    pos += 4; /* the content checksum */
+	if (pos > csize)
+	    goto bad;
+	f->inlen = pos - f->in;
+    }
+    return 0;
+bad:
+    errno = EIO;
+fail:
+    free(*zf);
+    *zf = NULL;
+    *nzf = 0;
+    return -1;
+}
+
+struct srcreader *
+decomp_source(int fd, off_t *size, int nthreads)
+{
+    static const unsigned char xzmagic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
+    unsigned char m[6];
+    struct zframe *zf;
+    struct dsrc *d;
+    size_t nzf, i;
+    off_t zsize;
+    int kind;
+
+    if (pread(fd, m, sizeof(m), 0) != sizeof(m)) {
+	errno = EINVAL;
+	return NULL;
+    }
+    zf = NULL;
+    nzf = 0;
+    if (nthreads < 1)
+	nthreads = 1;
+    if (m[0] == 0x1f && m[1] == 0x8b) {
+	kind = GZIP;
+	if (size)
+	    *size = gzip_size(fd);
+    } else if (memcmp(m, xzmagic, sizeof(xzmagic)) == 0) {
+	kind = XZ;
+	if (size)
+	    *size = xz_size(fd);
+    } else if (get_le32(m) == ZSTD_MAGIC || (get_le32(m) & 0xfffffff0) == ZSTD_SKIPPABLE) {
+	kind = ZSTD;
+	if (zstd_frames(fd, &zf, &nzf, &zsize) < 0)
+	    return NULL;
+	if (size)
+	    *size = zsize;
+	/* frames that say how big they are can be decoded
+	 * side by side, if they aren't too big to hold */
+	for (i = 0; i < nzf && zf[i].outlen >= 0 && zf[i].outlen <= ZFRAME_MAX; i++)
+	    ;
+	if (nthreads == 1 || nzf < 2 || i < nzf) {
+	    free(zf);
+	    zf = NULL;
+	    nzf = 0;
+	}
+    } else {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!(d = calloc(1, sizeof(*d))))
+	goto fail;
+    if (!(d->in = malloc(DECOMP_BUFSZ))) {
+	free(d);
+	goto fail;
+    }
+    d->rd.read = dsrc_read;
+    d->rd.close = dsrc_close;
+    d->fd = fd;
+    d->kind = kind;
+    d->nthreads = nthreads;
+    d->single = kind == GZIP && size && *size >= 0;
+    d->x = (lzma_stream)LZMA_STREAM_INIT;
+    d->zf = zf;
+    d->nzf = nzf;
+    return &d->rd;
+fail:
+    free(zf);
+    return NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef __DECOMP_H_
+#define __DECOMP_H_
+#include <sys/types.h>
+#include "source.h"
+
+/* decomp_source() checks 'fd' for a gzip, xz or zstd header, and
+ * if it finds one, returns a reader for the decompressed contents,
+ * which must be read in order (see partinfo.pipe)
+ *
+ * unless 'size' is NULL, *size is set to the decompressed size, or
+ * to -1 if it can't be known in advance: xz records it in its index,
+ * and zstd in each frame header (unless the frame was written through
+ * a pipe); a gzip file only records the size of its last member, modulo
+ * 2^32, so that is used only if the file isn't far bigger than that,
+ * and reading fails with EFBIG if a second member turns up
+ *
+ * xz is decoded with up to 'nthreads' threads, and so are zstd files
+ * of several frames (as written by pzstd or by concatenating files)
+ * that each give their size and are no bigger than 32MB
+ *
+ * returns NULL with errno set to EINVAL if 'fd' isn't compressed,
+ * or EIO if the frames of a zstd file don't add up to the file */
+struct srcreader *decomp_source(int fd, off_t *size, int nthreads);
+
+#endif
@@ -14,7 +14,7 @@ static_assert(sizeof(loff_t)==sizeof(off_t));
 static void
 usage(void)
 {
-    dprintf(2, "usage: dosextend [-n part] disk\n");
+    dprintf(2, "usage: dosextend [-n part] [-k] [-l sectsize] disk\n");
     exit(1);
 }
 
@@ -26,12 +26,13 @@ main(int argc, char **argv)
     const char *disk;
     bool tellkernel;
     off_t disksize;
-    int fd, part;
+    int fd, part, ss;
     char c;
 
     tellkernel = false;
     part = -1;
-    while ((c = getopt(argc, argv, "+n:k")) != -1) {
+    ss = 0;
+    while ((c = getopt(argc, argv, "+n:kl:")) != -1) {
 	switch (c) {
 	case 'n':
 	    part = atoi(optarg);
@@ -39,6 +40,11 @@ main(int argc, char **argv)
 	case 'k':
 	    tellkernel = true;
 	    break;
+	case 'l':
+	    /* for files; devices report their own */
+	    if (!sector_size_ok(ss = atoi(optarg)))
+		usage();
+	    break;
 	default:
 	    usage();
 	}
@@ -52,10 +58,11 @@ main(int argc, char **argv)
     if (fd < 0)
 	err(1, "open %s", disk);
     disksize = fgetsize(fd);
+    ss = fgetsectsize(fd, ss);
     if (pread(fd, mbr, 512, 0) != 512)
 	err(1, "pread(%s)", disk);
 
-    if ((part = mbr_add_lastpart(mbr, part, disksize >> 9, &start, &length)) < 0)
+    if ((part = mbr_add_lastpart(mbr, part, disksize >> 9, ss, &start, &length)) < 0)
 	err(1, "adding partition");
 
     if (pwrite(fd, mbr, 512, 0) != 512)
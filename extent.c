@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "extent.h"
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+
+#ifndef SEEK_HOLE
+#define SEEK_HOLE 4
+#endif
+
+/* number of extents fetched per FS_IOC_FIEMAP call */
+#define FIEMAP_BATCH 1024
+
+int
+extmap_add(struct extmap *m, off_t off, off_t len)
+{
+    struct extent *e;
+    size_t ncap;
+
+    if (len <= 0)
+	return 0;
+    if (m->len) {
+	e = &m->ext[m->len-1];
+	if (e->off + e->len == off) {
+	    e->len += len;
+	    return 0;
+	}
+    }
+    if (m->len == m->cap) {
+	ncap = m->cap ? m->cap*2 : 16;
+	e = realloc(m->ext, ncap*sizeof(struct extent));
+	if (!e)
+	    return -1;
+	m->ext = e;
+	m->cap = ncap;
+    }
+    m->ext[m->len].off = off;
+    m->ext[m->len].len = len;
+    m->len++;
+    return 0;
+}
+
+/* find extents with FS_IOC_FIEMAP, which returns
+ * up to FIEMAP_BATCH extents per call rather than
+ * the two lseek(2) calls per extent that seek_scan() needs */
+static int
+fiemap_scan(struct extmap *m, int fd, off_t size)
+{
+    struct fiemap_extent *fe;
+    struct fiemap *fm;
+    off_t off, start, end;
+    unsigned i;
+    bool last;
+    int ret;
+
+    fm = malloc(sizeof(*fm) + FIEMAP_BATCH*sizeof(struct fiemap_extent));
+    if (!fm)
+	return -1;
+
+    ret = 0;
+    off = 0;
+    last = false;
+    while (!last && off < size) {
+	memset(fm, 0, sizeof(*fm));
+	fm->fm_start = off;
+	fm->fm_length = size - off;
+	/* flush delayed allocations the first time around,
+	 * so that dirty data shows up as an extent */
+	fm->fm_flags = off ? 0 : FIEMAP_FLAG_SYNC;
+	fm->fm_extent_count = FIEMAP_BATCH;
+	m->nfiemap++;
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+	    ret = -1;
+	    break;
+	}
+	if (fm->fm_mapped_extents == 0)
+	    break;
+	for (i=0; i<fm->fm_mapped_extents; i++) {
+	    fe = &fm->fm_extents[i];
+	    if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+		last = true;
+	    start = fe->fe_logical;
+	    end = fe->fe_logical + fe->fe_length;
+	    if (end > off)
+		off = end;
+	    /* preallocated but unwritten extents read as zeros */
+	    if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+		continue;
+	    if (m->len && start < m->ext[m->len-1].off + m->ext[m->len-1].len)
+		start = m->ext[m->len-1].off + m->ext[m->len-1].len;
+	    if (end > size)
+		end = size;
+	    if (start < end && (ret = extmap_add(m, start, end - start)) < 0)
+		break;
+	}
+	if (ret < 0)
+	    break;
+    }
+    free(fm);
+    return ret;
+}
+
+/* find extents by alternating lseek(SEEK_DATA) and lseek(SEEK_HOLE) */
+static int
+seek_scan(struct extmap *m, int fd, off_t size)
+{
+    off_t off, end;
+
+    off = 0;
+    while (off < size) {
+	off = lseek(fd, off, SEEK_DATA);
+	m->nlseek++;
+	if (off < 0) {
+	    if (errno == ENXIO)
+		break; /* inside a hole at the end of the file */
+	    if (m->len == 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+		return extmap_add(m, 0, size); /* no hole information */
+	    return -1;
+	}
+	if (off >= size)
+	    break;
+	m->nlseek++;
+	if ((end = lseek(fd, off, SEEK_HOLE)) < 0)
+	    return -1;
+	if (end > size)
+	    end = size;
+	if (extmap_add(m, off, end - off) < 0)
+	    return -1;
+	off = end;
+    }
+    return 0;
+}
+
+int
+extmap_scan(struct extmap *m, int fd, off_t size)
+{
+    m->len = 0;
+    m->size = size;
+    if (fiemap_scan(m, fd, size) == 0)
+	return 0;
+    /* tmpfs, network filesystems, block devices, etc. */
+    if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EINVAL && errno != EBADR)
+	return -1;
+    m->len = 0;
+    return seek_scan(m, fd, size);
+}
+
+size_t
+extmap_find(const struct extmap *m, off_t off)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = m->len;
+    while (lo < hi) {
+	mid = lo + (hi-lo)/2;
+	if (m->ext[mid].off + m->ext[mid].len <= off)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+off_t
+extmap_bytes(const struct extmap *m)
+{
+    off_t sum = 0;
+    size_t i;
+
+    for (i=0; i<m->len; i++)
+	sum += m->ext[i].len;
+    return sum;
+}
+
+int
+extmap_copy(struct extmap *dst, const struct extmap *src)
+{
+    struct extent *e;
+
+    if (dst->cap < src->len) {
+	if (!(e = realloc(dst->ext, src->len*sizeof(struct extent))))
+	    return -1;
+	dst->ext = e;
+	dst->cap = src->len;
+    }
+    if (src->len)
+	memcpy(dst->ext, src->ext, src->len*sizeof(struct extent));
+    dst->len = src->len;
+    dst->size = src->size;
+    return 0;
+}
+
+void
+extmap_free(struct extmap *m)
+{
+    free(m->ext);
+    m->ext = NULL;
+    m->len = m->cap = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __EXTENT_H_
+#define __EXTENT_H_
+#include <stddef.h>
+#include <sys/types.h>
+
+/* an extent is a range of a file that
+ * (may) contain data; everything between
+ * extents is a hole that reads as zeros */
+struct extent {
+    off_t off; /* byte offset of the start of the extent */
+    off_t len; /* length of the extent in bytes */
+};
+
+/* an extmap is the list of data extents
+ * of a file, sorted by offset and non-overlapping */
+struct extmap {
+    struct extent *ext; /* extents */
+    size_t len;         /* number of extents */
+    size_t cap;         /* allocated capacity of ext */
+    off_t size;         /* logical size of the file */
+    long nfiemap;       /* FS_IOC_FIEMAP calls made by extmap_scan() */
+    long nlseek;        /* lseek(2) calls made by extmap_scan() */
+};
+
+/* extmap_scan() fills 'm' with the data extents
+ * of the first 'size' bytes of 'fd', using FS_IOC_FIEMAP
+ * where the filesystem supports it and SEEK_DATA/SEEK_HOLE
+ * otherwise; adjacent extents are merged
+ *
+ * returns 0 on success or -1 with errno set */
+int extmap_scan(struct extmap *m, int fd, off_t size);
+
+/* extmap_add() appends the extent [off, off+len) to 'm',
+ * merging it with the last extent if they are adjacent */
+int extmap_add(struct extmap *m, off_t off, off_t len);
+
+/* extmap_find() returns the index of the first
+ * extent that ends after 'off' (or m->len if there is none) */
+size_t extmap_find(const struct extmap *m, off_t off);
+
+/* extmap_bytes() returns the number of data bytes in 'm' */
+off_t extmap_bytes(const struct extmap *m);
+
+/* extmap_copy() replaces the extents in 'dst' with those of 'src' */
+int extmap_copy(struct extmap *dst, const struct extmap *src);
+
+void extmap_free(struct extmap *m);
+
+#endif
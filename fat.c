@@ -0,0 +1,932 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "mbr.h"
+#include "extent.h"
+#include "source.h"
+#include "fat.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define RESERVED    32 /* reserved sectors, as mkfs.fat(8) does it */
+#define BACKUP_BOOT 6  /* sector of the backup boot sector */
+#define DIRENT      32
+#define LFN_CHARS   13 /* UTF-16 units in a long name entry */
+#define MAX_NAME    255
+#define MAX_CLUSTERS 0x0ffffff5U
+#define MAX_FILE    0xffffffffLL
+
+#define ATTR_LFN  0x0f
+#define ATTR_DIR  0x10
+#define ATTR_ARCH 0x20
+#define FAT_EOC   0x0fffffff
+#define MEDIA     0xf8
+
+/* a file or directory in the tree */
+struct fnode {
+    char *name;
+    unsigned char sname[11]; /* 8.3 name, space padded */
+    int nlfn;                /* long name entries in front of it */
+    bool dir;
+    int fd;                  /* files: open while 'users' isn't 0, or -1 */
+    int users;
+    off_t size;              /* files: bytes; directories: bytes of entries */
+    struct timespec mtime;
+    uint32_t clus;           /* first cluster, or 0 if there are none */
+    uint32_t nclus;
+    struct fnode *parent;
+    struct fnode **kids;     /* directories: contents, sorted by name */
+    size_t nkids;
+};
+
+/* part of the filesystem that isn't zeros: from memory, or a file */
+struct fregion {
+    off_t off, len;
+    const unsigned char *mem;
+    struct fnode *file;
+};
+
+struct fsrc {
+    struct srcreader rd; /* must be first */
+    off_t size;
+    struct fnode *root;
+    int dirfd;            /* the top of the tree, which names are relative to */
+    pthread_mutex_t lock; /* for opening and closing files */
+    unsigned char *boot; /* the reserved sectors */
+    unsigned char *fat;  /* the used part of the FAT (both copies) */
+    unsigned char *dirs; /* every directory cluster, from cluster 2 on */
+    struct fregion *reg; /* in order of offset */
+    size_t nreg;
+};
+
+struct geom {
+    int ss;
+    uint32_t spc;       /* sectors per cluster */
+    uint32_t fatsz;     /* sectors per FAT */
+    uint32_t clusters;
+    uint64_t sectors;
+};
+
+static inline void
+put_le16(unsigned char *dst, uint16_t u)
+{
+    dst[0] = u & 0xff;
+    dst[1] = u >> 8;
+}
+
+static void
+free_node(struct fnode *n)
+{
+    size_t i;
+
+    for (i = 0; i < n->nkids; i++)
+	free_node(n->kids[i]);
+    if (n->fd >= 0)
+	close(n->fd);
+    free(n->kids);
+    free(n->name);
+    free(n);
+}
+
+static int
+byname(const void *a, const void *b)
+{
+    return strcmp((*(struct fnode *const *)a)->name, (*(struct fnode *const *)b)->name);
+}
+
+/* decode the UTF-8 'name' into UTF-16; returns the
+ * number of units, or -1 if there are more than MAX_NAME */
+static int
+utf16(const char *name, uint16_t *out)
+{
+    const unsigned char *p = (const unsigned char *)name;
+    uint32_t c;
+    int n, more;
+
+    for (n = 0; *p; ) {
+	c = *p++;
+	more = 0;
+	if (c >= 0xc0 && c < 0xe0) {
+	    more = 1;
+	    c &= 0x1f;
+	} else if (c >= 0xe0 && c < 0xf0) {
+	    more = 2;
+	    c &= 0x0f;
+	} else if (c >= 0xf0 && c < 0xf8) {
+	    more = 3;
+	    c &= 0x07;
+	} else if (c >= 0x80) {
+	    c = 0xfffd;
+	}
+	while (more-- > 0) {
+	    if ((*p & 0xc0) != 0x80) {
+		c = 0xfffd;
+		break;
+	    }
+	    c = (c << 6) | (*p++ & 0x3f);
+	}
+	if (c >= 0x10000) {
+	    if (n + 2 > MAX_NAME)
+		return -1;
+	    c -= 0x10000;
+	    out[n++] = 0xd800 | (c >> 10);
+	    out[n++] = 0xdc00 | (c & 0x3ff);
+	} else {
+	    if (n + 1 > MAX_NAME)
+		return -1;
+	    out[n++] = c;
+	}
+    }
+    return n;
+}
+
+/* characters allowed in 8.3 names besides letters and digits */
+static bool
+short_char(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+	(c && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/* the 8.3 form of 'name' if it is already an 8.3 name in upper case */
+static bool
+exact_short(const char *name, unsigned char *out)
+{
+    const char *dot;
+    size_t nb, ne, i;
+
+    dot = strchr(name, '.');
+    nb = dot ? (size_t)(dot - name) : strlen(name);
+    ne = dot ? strlen(dot + 1) : 0;
+    if (nb < 1 || nb > 8 || ne > 3 || (dot && (ne == 0 || strchr(dot + 1, '.'))))
+	return false;
+    for (i = 0; i < nb; i++)
+	if (!short_char(name[i]))
+	    return false;
+    for (i = 0; i < ne; i++)
+	if (!short_char(dot[1 + i]))
+	    return false;
+    memset(out, ' ', 11);
+    memcpy(out, name, nb);
+    if (dot)
+	memcpy(out + 8, dot + 1, ne);
+    return true;
+}
+
+/* copy up to 'max' characters of [s, end) into 'out' the way
+ * Windows makes a short name: upper case, spaces and dots
+ * dropped, and '_' for anything else that can't be in one */
+static size_t
+short_part(const char *s, const char *end, unsigned char *out, size_t max)
+{
+    const unsigned char *p;
+    unsigned char c;
+    size_t n = 0;
+
+    for (p = (const unsigned char *)s; p < (const unsigned char *)end && n < max; p++) {
+	c = *p;
+	if (c == ' ' || c == '.' || (c >= 0x80 && c < 0xc0))
+	    continue;
+	if (c >= 'a' && c <= 'z')
+	    c -= 'a' - 'A';
+	out[n++] = short_char(c) ? c : '_';
+    }
+    return n;
+}
+
+/* the short name "BASIS~N.EXT" for the long name 'name' */
+static void
+generated_short(const char *name, int num, unsigned char *out)
+{
+    char tail[12];
+    const char *s, *dot;
+    size_t nb, nt;
+
+    s = name + strspn(name, ".");
+    dot = strrchr(s, '.');
+    nt = (size_t)snprintf(tail, sizeof(tail), "~%d", num);
+    memset(out, ' ', 11);
+    if (!(nb = short_part(s, dot ? dot : s + strlen(s), out, 8 - nt))) {
+	out[0] = '_';
+	nb = 1;
+    }
+    memcpy(out + nb, tail, nt);
+    if (dot)
+	short_part(dot + 1, dot + strlen(dot), out + 8, 3);
+}
+
+static bool
+short_taken(const struct fnode *d, const unsigned char *sname)
+{
+    size_t i;
+
+    for (i = 0; i < d->nkids; i++)
+	if (d->kids[i]->nlfn >= 0 && !memcmp(d->kids[i]->sname, sname, 11))
+	    return true;
+    return false;
+}
+
+/* give the contents of 'd' their short names, and work out the size of 'd' */
+static int
+name_kids(struct fnode *d)
+{
+    uint16_t u[MAX_NAME];
+    char upper[13];
+    struct fnode *k;
+    size_t i, j, nent;
+    int n, num;
+
+    for (i = 0; i < d->nkids; i++)
+	for (j = i + 1; j < d->nkids; j++)
+	    if (!strcasecmp(d->kids[i]->name, d->kids[j]->name))
+		return rc(EEXIST);
+    /* names that are already short take precedence */
+    for (i = 0; i < d->nkids; i++) {
+	k = d->kids[i];
+	k->nlfn = exact_short(k->name, k->sname) ? 0 : -1;
+    }
+    nent = d->parent ? 2 : 0;
+    for (i = 0; i < d->nkids; i++) {
+	k = d->kids[i];
+	if (k->nlfn < 0) {
+	    if ((n = utf16(k->name, u)) < 0)
+		return rc(ENAMETOOLONG);
+	    /* a name that's only short but for its case keeps it, if it's free */
+	    for (j = 0; j < sizeof(upper) && (upper[j] = toupper((unsigned char)k->name[j])); j++)
+		;
+	    if (j == sizeof(upper) || !exact_short(upper, k->sname) || short_taken(d, k->sname)) {
+		for (num = 1; ; num++) {
+		    generated_short(k->name, num, k->sname);
+		    if (!short_taken(d, k->sname))
+			break;
+		}
+	    }
+	    k->nlfn = (n + LFN_CHARS - 1) / LFN_CHARS;
+	}
+	nent += 1 + k->nlfn;
+    }
+    if (nent > 65536)
+	return rc(ENOSPC);
+    d->size = (off_t)nent * DIRENT;
+    return 0;
+}
+
+/* read the directory 'dfd' (which is closed) into 'd' */
+static int
+scan(struct fnode *d, int dfd)
+{
+    struct fnode *k, **kids;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int fd, e;
+
+    if (!(dir = fdopendir(dfd))) {
+	e = errno;
+	close(dfd);
+	return rc(e);
+    }
+    while ((errno = 0, de = readdir(dir))) {
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	if (fstatat(dirfd(dir), de->d_name, &st, 0) < 0)
+	    goto fail;
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+	    errno = EINVAL;
+	    goto fail;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > MAX_FILE) {
+	    errno = EFBIG;
+	    goto fail;
+	}
+	if (d->nkids % 16 == 0) {
+	    if (!(kids = realloc(d->kids, (d->nkids + 16) * sizeof(*kids))))
+		goto fail;
+	    d->kids = kids;
+	}
+	if (!(k = calloc(1, sizeof(*k))))
+	    goto fail;
+	k->fd = -1;
+	k->parent = d;
+	k->dir = S_ISDIR(st.st_mode);
+	k->mtime = st.st_mtim;
+	d->kids[d->nkids++] = k;
+	if (!(k->name = strdup(de->d_name)))
+	    goto fail;
+	if (k->dir) {
+	    if ((fd = openat(dirfd(dir), de->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0 ||
+		scan(k, fd) < 0)
+		goto fail;
+	} else {
+	    k->size = st.st_size;
+	}
+    }
+    if (errno)
+	goto fail;
+    closedir(dir);
+    qsort(d->kids, d->nkids, sizeof(*d->kids), byname);
+    return name_kids(d);
+fail:
+    e = errno;
+    closedir(dir);
+    return rc(e);
+}
+
+static uint64_t
+nclusters(off_t size, off_t csz)
+{
+    return (uint64_t)((size + csz - 1) / csz);
+}
+
+/* the clusters the tree takes up with clusters of 'csz' bytes */
+static uint64_t
+tree_clusters(const struct fnode *n, off_t csz)
+{
+    uint64_t c;
+    size_t i;
+
+    /* even an empty root directory has a cluster */
+    c = nclusters(n->dir && n->size == 0 ? 1 : n->size, csz);
+    for (i = 0; i < n->nkids; i++)
+	c += tree_clusters(n->kids[i], csz);
+    return c;
+}
+
+/* the cluster size Windows picks for a FAT32 volume of 'size' bytes */
+static off_t
+cluster_size(off_t size, int ss)
+{
+    off_t c;
+
+    if (size <= (260L << 20))
+	c = 512;
+    else if (size <= (8L << 30))
+	c = 4096;
+    else if (size <= (16L << 30))
+	c = 8192;
+    else if (size <= (32L << 30))
+	c = 16384;
+    else
+	c = 32768;
+    return c < ss ? ss : c;
+}
+
+/* fit two FATs and the clusters into 'sectors' */
+static int
+geometry(struct geom *g, uint64_t sectors, int ss, off_t csz)
+{
+    uint64_t clusters, per;
+
+    g->ss = ss;
+    g->spc = csz / ss;
+    g->sectors = sectors;
+    if (sectors > 0xffffffffULL || sectors < RESERVED)
+	return rc(ENOSPC);
+    /* the smallest FAT with an entry for every cluster (and
+     * the two reserved ones) in what's left next to two of it */
+    per = (uint64_t)ss / 4 * g->spc + 2;
+    g->fatsz = (sectors - RESERVED + 2*(uint64_t)g->spc + per - 1) / per;
+    if (sectors < RESERVED + 2*(uint64_t)g->fatsz)
+	return rc(ENOSPC);
+    clusters = (sectors - RESERVED - 2*(uint64_t)g->fatsz) / g->spc;
+    if (clusters < FAT32_MIN_CLUSTERS || clusters > MAX_CLUSTERS)
+	return rc(ENOSPC);
+    g->clusters = clusters;
+    return 0;
+}
+
+/* the smallest filesystem that holds 'root' */
+static int
+fit(struct geom *g, const struct fnode *root, int ss)
+{
+    uint64_t need, fatsz, sectors;
+    off_t csz, next;
+    int i;
+
+    csz = cluster_size(0, ss);
+    sectors = 0;
+    /* the cluster size depends on the size, and vice versa */
+    for (i = 0; i < 8; i++) {
+	need = tree_clusters(root, csz);
+	if (need < FAT32_MIN_CLUSTERS)
+	    need = FAT32_MIN_CLUSTERS;
+	fatsz = ((need + 2) * 4 + ss - 1) / ss;
+	sectors = RESERVED + 2*fatsz + need * (csz / ss);
+	if ((next = cluster_size((off_t)(sectors * ss), ss)) == csz)
+	    break;
+	csz = next;
+    }
+    return geometry(g, sectors, ss, csz);
+}
+
+static void
+alloc_dirs(struct fnode *d, uint32_t *next, off_t csz)
+{
+    size_t i;
+
+    d->clus = *next;
+    d->nclus = nclusters(d->size ? d->size : 1, csz);
+    *next += d->nclus;
+    for (i = 0; i < d->nkids; i++)
+	if (d->kids[i]->dir)
+	    alloc_dirs(d->kids[i], next, csz);
+}
+
+static void
+alloc_files(struct fnode *d, uint32_t *next, off_t csz)
+{
+    struct fnode *k;
+    size_t i;
+
+    for (i = 0; i < d->nkids; i++) {
+	k = d->kids[i];
+	if (k->dir) {
+	    alloc_files(k, next, csz);
+	} else if (k->size) {
+	    k->clus = *next;
+	    k->nclus = nclusters(k->size, csz);
+	    *next += k->nclus;
+	}
+    }
+}
+
+/* chain the clusters of everything in the tree */
+static void
+chain(unsigned char *fat, const struct fnode *n)
+{
+    uint32_t c;
+    size_t i;
+
+    for (c = n->clus; c < n->clus + n->nclus; c++)
+	put_le32(fat + 4*c, c + 1 < n->clus + n->nclus ? c + 1 : FAT_EOC);
+    for (i = 0; i < n->nkids; i++)
+	chain(fat, n->kids[i]);
+}
+
+static void
+dos_time(const struct timespec *ts, unsigned char *time, unsigned char *date)
+{
+    struct tm tm;
+    time_t t;
+
+    t = ts->tv_sec;
+    if (!gmtime_r(&t, &tm) || tm.tm_year < 80) {
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = 80;
+	tm.tm_mday = 1;
+    } else if (tm.tm_year > 207) {
+	tm.tm_year = 207;
+	tm.tm_mon = 11;
+	tm.tm_mday = 31;
+	tm.tm_hour = 23;
+	tm.tm_min = 59;
+	tm.tm_sec = 58;
+    }
+    put_le16(time, (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    put_le16(date, ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+static void
+short_entry(unsigned char *e, const unsigned char *sname, bool dir,
+	    uint32_t clus, off_t size, const struct timespec *mtime)
+{
+    memcpy(e, sname, 11);
+    e[11] = dir ? ATTR_DIR : ATTR_ARCH;
+    dos_time(mtime, e + 14, e + 16);
+    memcpy(e + 18, e + 16, 2);
+    put_le16(e + 20, clus >> 16);
+    dos_time(mtime, e + 22, e + 24);
+    put_le16(e + 26, clus & 0xffff);
+    put_le32(e + 28, dir ? 0 : (uint32_t)size);
+}
+
+static unsigned char
+lfn_sum(const unsigned char *sname)
+{
+    unsigned char sum = 0;
+    int i;
+
+    for (i = 0; i < 11; i++)
+	sum = ((sum & 1) << 7) + (sum >> 1) + sname[i];
+    return sum;
+}
+
+/* the long name entries of 'k', last part first; returns the next entry */
+static unsigned char *
+lfn_entries(unsigned char *e, const struct fnode *k)
+{
+    static const int at[LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    uint16_t u[MAX_NAME];
+    unsigned char sum;
+    int n, seq, i, c;
+
+    n = utf16(k->name, u);
+    sum = lfn_sum(k->sname);
+    for (seq = k->nlfn; seq >= 1; seq--, e += DIRENT) {
+	e[0] = seq | (seq == k->nlfn ? 0x40 : 0);
+	e[11] = ATTR_LFN;
+	e[13] = sum;
+	for (i = 0; i < LFN_CHARS; i++) {
+	    c = (seq - 1) * LFN_CHARS + i;
+	    put_le16(e + at[i], c < n ? u[c] : c == n ? 0 : 0xffff);
+	}
+    }
+    return e;
+}
+
+static void
+fill_dir(unsigned char *dirs, off_t csz, const struct fnode *d)
+{
+    static const unsigned char dot[12] = ".          ", dotdot[12] = "..         ";
+    const struct fnode *k;
+    unsigned char *e;
+    size_t i;
+
+    e = dirs + (off_t)(d->clus - 2) * csz;
+    if (d->parent) {
+	short_entry(e, dot, true, d->clus, 0, &d->mtime);
+	e += DIRENT;
+	/* the root directory is cluster 0 here */
+	short_entry(e, dotdot, true, d->parent->parent ? d->parent->clus : 0, 0, &d->parent->mtime);
+	e += DIRENT;
+    }
+    for (i = 0; i < d->nkids; i++) {
+	k = d->kids[i];
+	e = lfn_entries(e, k);
+	short_entry(e, k->sname, k->dir, k->clus, k->size, &k->mtime);
+	e += DIRENT;
+    }
+    for (i = 0; i < d->nkids; i++)
+	if (d->kids[i]->dir)
+	    fill_dir(dirs, csz, d->kids[i]);
+}
+
+/* a volume ID that depends only on the tree */
+static uint32_t
+volume_id(const struct fnode *n, uint32_t h)
+{
+    const unsigned char *p;
+    size_t i;
+
+    for (p = (const unsigned char *)n->name; p && *p; p++)
+	h = (h ^ *p) * 16777619U;
+    for (i = 0; i < 8; i++)
+	h = (h ^ ((uint64_t)n->size >> (8*i) & 0xff)) * 16777619U;
+    for (i = 0; i < n->nkids; i++)
+	h = volume_id(n->kids[i], h);
+    return h;
+}
+
+static void
+fill_boot(unsigned char *b, const struct geom *g, uint32_t id, uint32_t freec, uint32_t next)
+{
+    unsigned char *info;
+    int ss = g->ss;
+
+    memcpy(b, "\xeb\x58\x90" "imgtools", 11);
+    put_le16(b + 11, ss);
+    b[13] = g->spc;
+    put_le16(b + 14, RESERVED);
+    b[16] = 2;                            /* number of FATs */
+    b[21] = MEDIA;
+    put_le16(b + 24, 63);                 /* sectors per track */
+    put_le16(b + 26, 255);                /* heads */
+    put_le32(b + 32, (uint32_t)g->sectors);
+    put_le32(b + 36, g->fatsz);
+    put_le32(b + 44, 2);                  /* root directory cluster */
+    put_le16(b + 48, 1);                  /* FSInfo sector */
+    put_le16(b + 50, BACKUP_BOOT);
+    b[64] = 0x80;                         /* drive number */
+    b[66] = 0x29;                         /* extended boot signature */
+    put_le32(b + 67, id);
+    memcpy(b + 71, "NO NAME    " "FAT32   ", 19);
+    b[510] = 0x55;
+    b[511] = 0xaa;
+
+    info = b + ss;
+    put_le32(info, 0x41615252);
+    put_le32(info + 484, 0x61417272);
+    put_le32(info + 488, freec);
+    put_le32(info + 492, next);
+    put_le32(info + 508, 0xaa550000);
+
+    memcpy(b + BACKUP_BOOT*ss, b, 2*ss);
+}
+
+static int
+add_region(struct fsrc *f, off_t off, off_t len, const unsigned char *mem, struct fnode *file)
+{
+    struct fregion *reg;
+
+    if (!len)
+	return 0;
+    if (f->nreg % 64 == 0) {
+	if (!(reg = realloc(f->reg, (f->nreg + 64) * sizeof(*reg))))
+	    return -1;
+	f->reg = reg;
+    }
+    f->reg[f->nreg++] = (struct fregion){off, len, mem, file};
+    return 0;
+}
+
+/* add the contents of the files under 'd', in the order they were allocated */
+static int
+add_files(struct fsrc *f, const struct fnode *d, off_t data, off_t csz)
+{
+    struct fnode *k;
+    size_t i;
+
+    for (i = 0; i < d->nkids; i++) {
+	k = d->kids[i];
+	if (k->dir ? add_files(f, k, data, csz) < 0 :
+	    add_region(f, data + (off_t)(k->clus - 2) * csz, k->size, NULL, k) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/* the first region that ends after 'off' */
+static size_t
+find_region(const struct fsrc *f, off_t off)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = f->nreg;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (f->reg[mid].off + f->reg[mid].len <= off)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static int
+fsrc_extents(struct srcreader *r, struct extmap *m)
+{
+    struct fsrc *f = (struct fsrc *)r;
+    size_t i;
+
+    m->len = 0;
+    m->size = f->size;
+    for (i = 0; i < f->nreg; i++)
+	if (extmap_add(m, f->reg[i].off, f->reg[i].len) < 0)
+	    return -1;
+    return 0;
+}
+
+/* files are only open while they're being read, so that a
+ * tree can hold more of them than a process can have open */
+static int
+file_open(struct fsrc *f, struct fnode *k)
+{
+    const struct fnode *n;
+    size_t len, l;
+    char *path, *p;
+    int fd;
+
+    pthread_mutex_lock(&f->lock);
+    if (k->users) {
+	k->users++;
+	pthread_mutex_unlock(&f->lock);
+	return k->fd;
+    }
+    /* the path from the top of the tree, as "/dir/.../name" */
+    len = 0;
+    for (n = k; n->parent; n = n->parent)
+	len += strlen(n->name) + 1;
+    if (!(path = malloc(len + 1))) {
+	pthread_mutex_unlock(&f->lock);
+	return -1;
+    }
+    p = path + len;
+    *p = '\0';
+    for (n = k; n->parent; n = n->parent) {
+	l = strlen(n->name);
+	p -= l;
+	memcpy(p, n->name, l);
+	*--p = '/';
+    }
+    if ((fd = openat(f->dirfd, path + 1, O_RDONLY|O_CLOEXEC)) >= 0) {
+	k->fd = fd;
+	k->users = 1;
+    }
+    pthread_mutex_unlock(&f->lock);
+    free(path);
+    return fd;
+}
+
+static void
+file_close(struct fsrc *f, struct fnode *k)
+{
+    pthread_mutex_lock(&f->lock);
+    if (--k->users == 0) {
+	close(k->fd);
+	k->fd = -1;
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* read 'len' bytes of a file at 'off'; past its end (if it shrank) is zeros */
+static int
+read_file(struct fsrc *f, struct fnode *k, unsigned char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+    int fd, e;
+
+    if ((fd = file_open(f, k)) < 0)
+	return -1;
+    while (len) {
+	if ((n = pread(fd, buf, len, off)) < 0) {
+	    e = errno;
+	    file_close(f, k);
+	    return rc(e);
+	}
+	if (n == 0) {
+	    memset(buf, 0, len);
+	    break;
+	}
+	buf += n;
+	len -= (size_t)n;
+	off += n;
+    }
+    file_close(f, k);
+    return 0;
+}
+
+static ssize_t
+fsrc_read(struct srcreader *r, void *buf, size_t len, off_t off)
+{
+    struct fsrc *f = (struct fsrc *)r;
+    const struct fregion *g;
+    unsigned char *out = buf;
+    size_t i, n, done;
+
+    if (off >= f->size)
+	return 0;
+    if ((off_t)len > f->size - off)
+	len = f->size - off;
+    i = find_region(f, off);
+    for (done = 0; done < len; done += n, off += n) {
+	n = len - done;
+	g = i < f->nreg ? &f->reg[i] : NULL;
+	if (!g || off < g->off) {
+	    if (g && g->off - off < (off_t)n)
+		n = g->off - off;
+	    memset(out + done, 0, n);
+	    continue;
+	}
+	if (g->off + g->len - off < (off_t)n)
+	    n = g->off + g->len - off;
+	if (g->mem)
+	    memcpy(out + done, g->mem + (off - g->off), n);
+	else if (read_file(f, g->file, out + done, n, off - g->off) < 0)
+	    return -1;
+	if (off + (off_t)n == g->off + g->len)
+	    i++;
+    }
+    return done;
+}
+
+static off_t
+fsrc_backing(struct srcreader *r, off_t off, int *fd, off_t *fdoff)
+{
+    struct fsrc *f = (struct fsrc *)r;
+    const struct fregion *g;
+    off_t end;
+    size_t i;
+
+    *fd = -1;
+    *fdoff = 0;
+    if (off >= f->size)
+	return 0;
+    i = find_region(f, off);
+    if (i == f->nreg)
+	return f->size - off;
+    g = &f->reg[i];
+    if (off < g->off)
+	return g->off - off;
+    if (!g->mem) {
+	if ((*fd = file_open(f, g->file)) < 0)
+	    return -1;
+	*fdoff = off - g->off;
+	return g->off + g->len - off;
+    }
+    /* everything that's in memory is read() alike */
+    for (end = g->off + g->len; ++i < f->nreg && f->reg[i].mem; )
+	end = f->reg[i].off + f->reg[i].len;
+    return end - off;
+}
+
+static void
+fsrc_release(struct srcreader *r, off_t off)
+{
+    struct fsrc *f = (struct fsrc *)r;
+
+    file_close(f, f->reg[find_region(f, off)].file);
+}
+
+static void
+fsrc_close(struct srcreader *r)
+{
+    struct fsrc *f = (struct fsrc *)r;
+
+    if (f->root)
+	free_node(f->root);
+    free(f->boot);
+    free(f->fat);
+    free(f->dirs);
+    free(f->reg);
+    if (f->dirfd >= 0)
+	close(f->dirfd);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+struct srcreader *
+fat_source(int dirfd, off_t *size, int ss)
+{
+    struct fsrc *f;
+    struct geom g;
+    uint32_t next, nfiles;
+    off_t csz, fatoff, data, fatlen, dirlen;
+    int fd, e;
+
+    if (!(f = calloc(1, sizeof(*f))))
+	return NULL;
+    f->rd.extents = fsrc_extents;
+    f->rd.read = fsrc_read;
+    f->rd.backing = fsrc_backing;
+    f->rd.release = fsrc_release;
+    f->rd.close = fsrc_close;
+    pthread_mutex_init(&f->lock, NULL);
+    if ((f->dirfd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0 ||
+	!(f->root = calloc(1, sizeof(*f->root))))
+	goto fail;
+    f->root->fd = -1;
+    f->root->dir = true;
+    /* a directory of our own, so as not to move the caller's position in it */
+    if ((fd = openat(f->dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0 ||
+	scan(f->root, fd) < 0)
+	goto fail;
+
+    if (*size) {
+	csz = cluster_size(*size, ss);
+	if (geometry(&g, (uint64_t)(*size / ss), ss, csz) < 0)
+	    goto fail;
+	if (tree_clusters(f->root, csz) > g.clusters) {
+	    errno = ENOSPC;
+	    goto fail;
+	}
+    } else if (fit(&g, f->root, ss) < 0) {
+	goto fail;
+    }
+    csz = (off_t)g.spc * ss;
+    f->size = (off_t)g.sectors * ss;
+
+    next = 2;
+    alloc_dirs(f->root, &next, csz);
+    nfiles = next;
+    alloc_files(f->root, &next, csz);
+
+    fatoff = (off_t)RESERVED * ss;
+    data = fatoff + 2*(off_t)g.fatsz * ss;
+    fatlen = ((off_t)next * 4 + ss - 1) / ss * ss;
+    dirlen = (off_t)(nfiles - 2) * csz;
+    if (!(f->boot = calloc(RESERVED, ss)) || !(f->fat = calloc(1, fatlen)) ||
+	!(f->dirs = calloc(1, dirlen)))
+	goto fail;
+    put_le32(f->fat, 0x0fffff00 | MEDIA);
+    put_le32(f->fat + 4, FAT_EOC);
+    chain(f->fat, f->root);
+    fill_dir(f->dirs, csz, f->root);
+    fill_boot(f->boot, &g, volume_id(f->root, 2166136261U), g.clusters - (next - 2), next);
+
+    if (add_region(f, 0, (off_t)RESERVED * ss, f->boot, NULL) < 0 ||
+	add_region(f, fatoff, fatlen, f->fat, NULL) < 0 ||
+	add_region(f, fatoff + (off_t)g.fatsz * ss, fatlen, f->fat, NULL) < 0 ||
+	add_region(f, data, dirlen, f->dirs, NULL) < 0 ||
+	add_files(f, f->root, data, csz) < 0)
+	goto fail;
+    *size = f->size;
+    return &f->rd;
+fail:
+    e = errno;
+    fsrc_close(&f->rd);
+    errno = e;
+    return NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef __FAT_H_
+#define __FAT_H_
+#include <sys/types.h>
+#include "source.h"
+
+/* FAT32 needs at least this many clusters */
+#define FAT32_MIN_CLUSTERS 65525
+
+/* fat_source() returns a reader for a FAT32 filesystem, in
+ * sectors of 'ss' bytes, holding the files and directories under
+ * the directory 'dirfd' (symlinks are followed); the FAT and the
+ * directories are laid out in memory, and the reader's backing()
+ * points at the files themselves for their contents
+ *
+ * *size is the size of the filesystem in bytes, or 0 for the
+ * smallest one that holds the tree, and is set to the size used;
+ * the cluster size is the one Windows would pick for that size
+ * (but at least a sector)
+ *
+ * names are taken to be UTF-8, and get a long name wherever
+ * they aren't already an 8.3 name in upper case; file times are
+ * the modification times, in UTC
+ *
+ * returns NULL with errno set to ENOSPC if the tree doesn't fit in
+ * *size or *size is too small for FAT32, EEXIST if two names in a
+ * directory differ only in case, EINVAL if there is something
+ * other than a file or a directory in the tree, EFBIG for a file
+ * of 4GiB or more, or ENAMETOOLONG for a name of more than 255
+ * UTF-16 characters; files are only opened while they're read, and
+ * the directory 'dirfd' is held on to until the reader is closed */
+struct srcreader *fat_source(int dirfd, off_t *size, int ss);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef __FILESIZE_H_
 #define __FILESIZE_H_
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
 #include <err.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -21,21 +23,92 @@ aligndown(off_t off, unsigned bits)
 	return off & ~((1ULL << bits) - 1);
 }
 
+/* fdsize(), fdmode() and fdsectsize() are for the library: they
+ * return -1 with errno set; the fget*() versions are for the tools,
+ * and exit with a message instead */
+
+/* fdsize() returns the size of the file or block device 'fd' */
 static inline off_t
-fgetsize(int fd)
+fdsize(int fd)
 {
     struct stat st;
-    off_t out = 0;
+    uint64_t sz;
 
     if (fstat(fd, &st) < 0)
-	err(1, "fstat %d", fd);
-    out = st.st_size;
-    if (!out && st.st_rdev) {
-	out = ioctl(fd, BLKGETSIZE64, &out) == 0 ? out : 0;
+	return -1;
+    if (!S_ISBLK(st.st_mode))
+	return st.st_size;
+    if (ioctl(fd, BLKGETSIZE64, &sz) < 0)
+	return -1;
+    return (off_t)sz;
+}
+
+static inline int
+fdmode(int fd, mode_t *mode)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+	return -1;
+    *mode = st.st_mode;
+    return 0;
+}
+
+/* fdsectsize() returns the logical sector size of 'fd':
+ * BLKSSZGET for block devices, or else 'ss' (the size
+ * given on the command line, or 0 for 512 bytes); it fails
+ * with EINVAL if a device doesn't have 'ss'-byte sectors */
+static inline int
+fdsectsize(int fd, int ss)
+{
+    mode_t mode;
+    int dev;
+
+    if (fdmode(fd, &mode) < 0)
+	return -1;
+    if (!S_ISBLK(mode))
+	return ss ? ss : 512;
+    if (ioctl(fd, BLKSSZGET, &dev) < 0)
+	return -1;
+    if (ss && ss != dev) {
+	errno = EINVAL;
+	return -1;
     }
+    return dev;
+}
+
+static inline off_t
+fgetsize(int fd)
+{
+    off_t out;
+
+    if ((out = fdsize(fd)) < 0)
+	err(1, "size of fd %d", fd);
     return out;
 }
-  
+
+static inline mode_t
+fgetmode(int fd)
+{
+    mode_t mode;
+
+    if (fdmode(fd, &mode) < 0)
+	err(1, "fstat %d", fd);
+    return mode;
+}
+
+static inline int
+fgetsectsize(int fd, int ss)
+{
+    int dev;
+
+    if ((dev = fdsectsize(fd, ss)) >= 0)
+	return dev;
+    if (errno != EINVAL || ioctl(fd, BLKSSZGET, &dev) < 0)
+	err(1, "BLKSSZGET");
+    errx(1, "device has %d-byte sectors, not %d", dev, ss);
+}
+
 static inline off_t
 getsize(const char *path)
 {
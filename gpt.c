@@ -129,7 +129,7 @@ encode_guid(unsigned char *dst, const char *src)
 }
 
 static int
-write_part(unsigned char *pstart, struct partinfo *part, const unsigned char *diskguid)
+write_part(unsigned char *pstart, struct partinfo *part, const unsigned char *diskguid, int ss)
 {
     const char *typeguid;
     unsigned char *base;
@@ -159,8 +159,8 @@ write_part(unsigned char *pstart, struct partinfo *part, const unsigned char *di
     put_le64(base + 16, ((uint64_t)get_le64(diskguid))^((uint64_t)get_le64(base))^seed);
     put_le64(base + 24, ((uint64_t)get_le64(diskguid+8))^((uint64_t)get_le64(base+8))^seed);
 
-    setf64(base, partfirst, part->startlba);
-    setf64(base, partlast, part->startlba + part->nsectors - 1);
+    setf64(base, partfirst, part->startlba/(ss>>9));
+    setf64(base, partlast, (part->startlba + part->nsectors)/(ss>>9) - 1);
 
     /* for now, no attribute flags or partition name */
     memset(base + 48, 0, GPT_PART_SIZE - 48);
@@ -243,8 +243,9 @@ crc32(const unsigned char *mem, size_t sz)
     return ~o;
 }
 
+/* nlbas is in logical sectors */
 static void
-protect_mbr(unsigned char *mem, int64_t nlbas)
+protect_mbr(unsigned char *mem, int64_t nlbas, int ss)
 {
     struct partinfo part = {0};
 
@@ -253,33 +254,33 @@ protect_mbr(unsigned char *mem, int64_t nlbas)
     part.num = 1;
     part.kind = "?";
     part.dc = 0xee;
-    part.startlba = 1;
-    part.nsectors = nlbas - 1;
-    if (mbr_write_parts(mem, &part))
+    part.startlba = ss>>9;
+    part.nsectors = (nlbas - 1)*(ss>>9);
+    if (mbr_write_parts(mem, &part, ss))
 	warnf("couldn't write protective mbr (sectors = %lli)\n", (long long)nlbas);
 }
 
 /* orig should point to lba 1 (an existing GPT)
- * bup should point to the last GPT_RESERVE bytes of the disk;
+ * bup should point to the last GPT_RESERVE(ss) bytes of the disk;
  * lastlba should be the lba at which the backup GPT header will land */
 static void
-backup_gpt(const unsigned char *orig, unsigned char *bup, int64_t lastlba)
+backup_gpt(const unsigned char *orig, unsigned char *bup, int64_t lastlba, int ss)
 {
     unsigned char *base;
 
     /* very last sector is backup GPT */
-    base = bup + (GPT_RESERVE - 512);
+    base = bup + GPT_TABLE_BYTES;
 
     /* copy the original gpt header verbatim */
     assert(getf64(orig, partstart) == 2);
-    memset(base, 0, 512);
+    memset(base, 0, ss);
     memcpy(base, orig, GPT_HEADER_SIZE);
 
     /* update lba pointers and re-crc */
     setf32(base, hdrcrc, 0);
     setf64(base, thislba, lastlba);
     setf64(base, otherlba, 1);
-    setf64(base, partstart, lastlba + 1 - GPT_RESERVE_LBAS);
+    setf64(base, partstart, lastlba + 1 - GPT_RESERVE(ss)/ss);
     setf32(base, hdrcrc, crc32(base, GPT_HEADER_SIZE));
 
     if (getf64(orig, otherlba) != lastlba)
@@ -287,32 +288,42 @@ backup_gpt(const unsigned char *orig, unsigned char *bup, int64_t lastlba)
 
     /* duplicate partitions */
     assert(getf32(orig, nparts) <= GPT_NUM_PARTS);
-    memcpy(bup, orig + 512, GPT_PART_SIZE * getf32(orig, nparts));
+    memcpy(bup, orig + ss, GPT_PART_SIZE * getf32(orig, nparts));
 }
 
 int
-gpt_write_parts(int fd, struct partinfo *parts, const char *diskguid, int64_t sectors)
+gpt_format(struct partinfo *parts, const char *diskguid, int64_t sectors, int ss,
+	   unsigned char *header, unsigned char *trailer)
 {
-    unsigned char header[GPT_RESERVE + 512];
-    unsigned char trailer[GPT_RESERVE];
     struct partinfo *head;
     unsigned char *base;
-    int64_t lastlba;
+    int64_t k, lastlba, reserve;
     int i;
 
-    lastlba = sectors-1;
+    if (!sector_size_ok(ss)) {
+	warnf("gpt: unsupported sector size %d\n", ss);
+	return rc(EINVAL);
+    }
+    /* the header fields are in logical sectors of k*512 bytes */
+    k = ss >> 9;
+    if (sectors & (k-1)) {
+	warnf("gpt: disk size (%lli) isn't a whole number of %d-byte sectors\n", (long long)sectors, ss);
+	return rc(EINVAL);
+    }
+    lastlba = sectors/k - 1;
+    reserve = GPT_RESERVE(ss)/ss;
 
-    /* 2048 is the first 1M-aligned lba, and we need a 34-lba trailer */
-    if (lastlba <= 2048+GPT_RESERVE_LBAS) {
+    /* 1M is the first aligned lba, and we need a trailer */
+    if (lastlba <= 2048/k + reserve) {
 	warnf("gpt: disk too small (%lli) to retain sane partition alignment\n", (long long)sectors);
 	return rc(ENOSPC);
     }
 
-    memset(header, 0, sizeof(header));
-    memset(trailer, 0, sizeof(trailer));
+    memset(header, 0, GPT_HEADER_BYTES(ss));
+    memset(trailer, 0, GPT_TRAILER_BYTES(ss));
 
     /* base is lba 1 */
-    base = header + 512;
+    base = header + ss;
     memcpy(base, "EFI PART", 8);
     base[8 + 2] = 1; /* version = 1 */ 
 
@@ -320,17 +331,17 @@ gpt_write_parts(int fd, struct partinfo *parts, const char *diskguid, int64_t se
     setf64(base, thislba, 1);
     setf64(base, otherlba, lastlba);
     /* first usable lba: aligned to no less than 1M: */
-    setf64(base, firstlba, 2048);
+    setf64(base, firstlba, 2048/k);
     /* last usable lba: location of back-up GPT minus
      * the size of the backup table */
-    setf64(base, lastlba, lastlba - GPT_RESERVE_LBAS);
+    setf64(base, lastlba, lastlba - reserve);
 
     if (encode_guid(base + 56, diskguid)) {
 	warnf("gpt: bad disk guid %s\n", diskguid);
 	return rc(EINVAL);
     }
 
-    setf64(base, partstart, 2); /* partitions are in lba 2-33*/
+    setf64(base, partstart, 2); /* partitions are in lba 2-33 (2-5 for 4K sectors) */
     setf32(base, nparts, GPT_NUM_PARTS);
     setf32(base, psize, GPT_PART_SIZE);
 
@@ -357,28 +368,52 @@ gpt_write_parts(int fd, struct partinfo *parts, const char *diskguid, int64_t se
 	 * unaligned filesystems; try to encourage 1MB+ alignment: */
 	if (head->startlba & 2047)
 	    warnf("warning: gpt part %d not aligned to 1MB boundary\n", head->num);
-	if (head->startlba + head->nsectors > sectors - GPT_RESERVE_LBAS) {
+	if ((head->startlba | head->nsectors) & (k-1)) {
+	    warnf("gpt: part %d isn't aligned to %d-byte sectors\n", head->num, ss);
+	    return rc(EINVAL);
+	}
+	if (head->startlba + head->nsectors > sectors - reserve*k) {
 	    warnf("gpt: part %d ends at LBA %lli, which overflows usable space\n",
 		  head->num, (long long)head->startlba+head->nsectors);
 	    return rc(EINVAL);
 	}
 
-	if (write_part(base + 512, head, base + 56) < 0) {
+	if (write_part(base + ss, head, base + 56, ss) < 0) {
 	    warnf("bad partition spec %d\n", head->num);
 	    return rc(EINVAL);
 	}
     }
 
     /* compute crc of partition entries, then crc of header */    
-    setf32(base, partcrc, crc32(base + 512, GPT_PART_SIZE * GPT_NUM_PARTS));
+    setf32(base, partcrc, crc32(base + ss, GPT_PART_SIZE * GPT_NUM_PARTS));
     setf32(base, hdrcrc, crc32(base, GPT_HEADER_SIZE));
 
-    protect_mbr(header, sectors);
-    backup_gpt(base, trailer, lastlba);
+    protect_mbr(header, sectors/k, ss);
+    backup_gpt(base, trailer, lastlba, ss);
+    return 0;
+}
+
+void
+gpt_crcs(const unsigned char *header, const unsigned char *trailer, int ss,
+	 uint32_t *hdrcrc, uint32_t *partcrc, uint32_t *backupcrc)
+{
+    *hdrcrc = getf32(header + ss, hdrcrc);
+    *partcrc = getf32(header + ss, partcrc);
+    *backupcrc = getf32(trailer + GPT_TABLE_BYTES, hdrcrc);
+}
+
+int
+gpt_write_parts(int fd, struct partinfo *parts, const char *diskguid, int64_t sectors, int ss)
+{
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    ssize_t headsz = GPT_HEADER_BYTES(ss), tailsz = GPT_TRAILER_BYTES(ss);
 
-    if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+    if (gpt_format(parts, diskguid, sectors, ss, header, trailer) < 0)
 	return -1;
-    if (pwrite(fd, trailer, sizeof(trailer), (sectors-GPT_RESERVE_LBAS)<<9) != sizeof(trailer))
+    if (pwrite(fd, header, headsz, 0) != headsz)
+	return -1;
+    if (pwrite(fd, trailer, tailsz, (sectors<<9) - tailsz) != tailsz)
 	return -1;
     return 0;
 }
@@ -386,23 +421,30 @@ gpt_write_parts(int fd, struct partinfo *parts, const char *diskguid, int64_t se
 static const unsigned char zeroguid[16];
 
 int
-gpt_add_lastpart(int fd, int num, int64_t disksectors, long long *start, long long *length)
+gpt_add_lastpart(int fd, int num, int64_t disksectors, int ss, long long *start, long long *length)
 {
-    unsigned char header[GPT_RESERVE + 512];
-    unsigned char trailer[GPT_RESERVE];
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    ssize_t headsz = GPT_HEADER_BYTES(ss), tailsz = GPT_TRAILER_BYTES(ss);
     unsigned char *partbase, *gpt, *p;
     struct partinfo spec = {0};
     uint32_t c, c2, np;
-    int64_t lba, blba, first, last;
+    int64_t k, nlbas, lba, blba, first, last, reserve;
     int i, pfree;
 
-    if (pread(fd, header, sizeof(header), 0) != sizeof(header))
+    if (!sector_size_ok(ss))
+	return rc(EINVAL);
+    if (pread(fd, header, headsz, 0) != headsz)
 	return -1;
 
-    memset(trailer, 0, sizeof(trailer));
-    blba = disksectors-1;
+    /* the on-disk lbas are in logical sectors of k*512 bytes */
+    k = ss >> 9;
+    nlbas = disksectors/k;
+    reserve = GPT_RESERVE(ss)/ss;
+    memset(trailer, 0, tailsz);
+    blba = nlbas-1;
 
-    gpt = header + 512;
+    gpt = header + ss;
     if (memcmp(gpt, "EFI PART", 8)) {
 	dprintf(2, "no GPT label present\n");
 	return rc(EINVAL);
@@ -442,12 +484,12 @@ gpt_add_lastpart(int fd, int num, int64_t disksectors, long long *start, long lo
 	return rc(EINVAL);
     }
     lba = getf64(gpt, firstlba) - lba;
-    if (lba < 32) {
+    if (lba < GPT_TABLE_BYTES/ss) {
 	warnf("gpt: partition table entries (%lu) bleed into first usable lba\n", np);
 	return rc(EINVAL);
     }
 
-    partbase = gpt + 512;
+    partbase = gpt + ss;
     if (crc32(partbase, np*GPT_PART_SIZE) != getf32(gpt, partcrc)) {
 	warnf("gpt: crc error (%xu) for partitions\n", getf32(gpt, partcrc));
 	return rc(EINVAL);
@@ -467,7 +509,7 @@ gpt_add_lastpart(int fd, int num, int64_t disksectors, long long *start, long lo
 	    warnf("gpt: part %d: strange bounds [%lli, %lli]\n", first, last);
 	    return rc(EINVAL);
 	}
-	if (first < lba || last+1 > disksectors) {
+	if (first < lba || last+1 > nlbas) {
 	    warnf("gpt: part %d: overlapping / not in disk order? (%lli, %lli)\n",
 		  i+1, (long long)first, (long long)last);
 	    return rc(EINVAL);
@@ -483,18 +525,19 @@ gpt_add_lastpart(int fd, int num, int64_t disksectors, long long *start, long lo
 	warnf("gpt: all partition entries (%d) already used\n", np);
 	return rc(ENXIO);
     }
-    lba = alignup(lba, 11);
-    if (disksectors-lba <= GPT_RESERVE_LBAS)
+    /* align to 1M */
+    lba = alignup(lba*k, 11)/k;
+    if (nlbas-lba <= reserve)
 	return rc(ENOSPC);
 
-    spec.startlba = lba;
-    spec.nsectors = disksectors - lba - GPT_RESERVE_LBAS;
+    spec.startlba = lba*k;
+    spec.nsectors = (nlbas - lba - reserve)*k;
     spec.kind = "L";
     spec.num = pfree+1;
     if (spec.nsectors < 2048)
 	warnf("gpt: warning: last partition is very small (%lli sectors)\n", spec.nsectors);
     if (start)
-	*start = lba << 9;
+	*start = lba * ss;
     if (length)
 	*length = spec.nsectors << 9;
 
@@ -505,19 +548,19 @@ gpt_add_lastpart(int fd, int num, int64_t disksectors, long long *start, long lo
 	warnf("gpt: note: backup GPT at LBA %lli will be overwritten\n", blba);
 
     setf64(gpt, otherlba, blba);
-    write_part(partbase, &spec, gpt + 56);
+    write_part(partbase, &spec, gpt + 56, ss);
     setf32(gpt, hdrcrc, 0);
     setf32(gpt, partcrc, crc32(partbase, GPT_PART_SIZE*np));
     setf32(gpt, hdrcrc, crc32(gpt, GPT_HEADER_SIZE));
-    backup_gpt(gpt, trailer, blba);
+    backup_gpt(gpt, trailer, blba, ss);
 
     /* only update PMBR if one is actually present */
     if (header[510] == 0x55 && header[511] == 0xaa)
-	protect_mbr(header, disksectors);
+	protect_mbr(header, nlbas, ss);
 
-    if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+    if (pwrite(fd, header, headsz, 0) != headsz)
 	return -1;
-    if (pwrite(fd, trailer, sizeof(trailer), (disksectors<<9)-sizeof(trailer)) != sizeof(trailer))
+    if (pwrite(fd, trailer, tailsz, nlbas*ss - tailsz) != tailsz)
 	return -1;
     return spec.num;
 }
@@ -2,10 +2,19 @@
 #include <sys/types.h>
 #include "part.h"
 
-/* we need to map at least this much
- * of the beginning of a disk: */
-#define GPT_RESERVE_LBAS (1L + 32L)
-#define GPT_RESERVE      (GPT_RESERVE_LBAS << 9)
+/* the partition entry array (128 entries of 128 bytes) */
+#define GPT_TABLE_BYTES 16384L
+
+/* a GPT header plus its entries take up this much
+ * of a disk with logical sectors of 'ss' bytes: */
+#define GPT_RESERVE(ss)      (GPT_TABLE_BYTES + (ss))
+
+/* sizes of the protective MBR plus the primary GPT
+ * (at the start of the disk) and of the backup GPT
+ * (at the very end of the disk); buffers for any
+ * sector size are GPT_HEADER_BYTES(SECTOR_MAX) long */
+#define GPT_HEADER_BYTES(ss)  (GPT_RESERVE(ss) + (ss))
+#define GPT_TRAILER_BYTES(ss) GPT_RESERVE(ss)
 
 static inline void
 put_le64(unsigned char *dst, int64_t s)
@@ -31,6 +40,21 @@ get_le64(const unsigned char *src)
     return s;
 }
 
-int gpt_add_lastpart(int fd, int num, int64_t numlbas, long long *start, long long *length);
+/* in each of these, 'numlbas' is the size of the disk
+ * in 512-byte sectors, and 'ss' is the size of the
+ * logical sectors that the GPT itself is written in */
+
+int gpt_add_lastpart(int fd, int num, int64_t numlbas, int ss, long long *start, long long *length);
+
+int gpt_write_parts(int fd, struct partinfo *parts, const char *diskuuid, int64_t numlbas, int ss);
+
+/* gpt_format() is gpt_write_parts() without the writing:
+ * it fills 'header' (GPT_HEADER_BYTES(ss), written at offset 0)
+ * and 'trailer' (GPT_TRAILER_BYTES(ss), written at the end of the disk) */
+int gpt_format(struct partinfo *parts, const char *diskuuid, int64_t numlbas, int ss,
+	       unsigned char *header, unsigned char *trailer);
 
-int gpt_write_parts(int fd, struct partinfo *parts, const char *diskuuid, int64_t numlbas);
+/* gpt_crcs() returns the CRCs that gpt_format() stored in the primary
+ * header, the partition entries and the backup header */
+void gpt_crcs(const unsigned char *header, const unsigned char *trailer, int ss,
+	      uint32_t *hdrcrc, uint32_t *partcrc, uint32_t *backupcrc);
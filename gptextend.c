@@ -3,9 +3,12 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <getopt.h>
 #include "filesize.h"
 #include "part.h"
 #include "gpt.h"
+#include "stats.h"
 
 #ifdef static_assert
 static_assert(sizeof(loff_t)==sizeof(off_t));
@@ -14,7 +17,7 @@ static_assert(sizeof(loff_t)==sizeof(off_t));
 static void
 usage(void)
 {
-    dprintf(2, "usage: gptextend [-n part] disk\n");
+    dprintf(2, "usage: gptextend [-n part] [-k] [-l sectsize] [--stats=json] disk\n");
     exit(1);
 }
 
@@ -25,12 +28,20 @@ main(int argc, char **argv)
     const char *disk;
     bool tellkernel;
     off_t disksize;
-    int fd, part;
-    char c;
+    int fd, part, c, ss;
+    bool stats;
+    double t0, tgpt, tkern;
+    static const struct option longopts[] = {
+	{ "stats", required_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 },
+    };
 
+    t0 = now();
     tellkernel = false;
+    stats = false;
     part = -1;
-    while ((c = getopt(argc, argv, "+n:k")) != -1) {
+    ss = 0;
+    while ((c = getopt_long(argc, argv, "+n:kl:", longopts, NULL)) != -1) {
 	switch (c) {
 	case 'k':
 	    tellkernel = true;
@@ -38,6 +49,16 @@ main(int argc, char **argv)
 	case 'n':
 	    part = atoi(optarg);
 	    break;
+	case 'l':
+	    /* for files; devices report their own */
+	    if (!sector_size_ok(ss = atoi(optarg)))
+		usage();
+	    break;
+	case 'S':
+	    if (strcmp(optarg, "json"))
+		usage();
+	    stats = true;
+	    break;
 	default:
 	    usage();
 	}
@@ -53,12 +74,24 @@ main(int argc, char **argv)
     disksize = fgetsize(fd);
     if (!disksize)
 	err(1, "computing disk size");
+    ss = fgetsectsize(fd, ss);
 
-    if ((part = gpt_add_lastpart(fd, part, disksize>>9, &start, &length)) < 0)
+    tgpt = now();
+    if ((part = gpt_add_lastpart(fd, part, disksize>>9, ss, &start, &length)) < 0)
 	err(1, "adding partition");
+    tkern = now();
+    tgpt = tkern - tgpt;
 
     if (tellkernel && kernel_add_part(fd, part, start, length) < 0)
 	err(1, "couldn't update kernel partition table");
+    tkern = now() - tkern;
     close(fd);
+    if (stats) {
+	printf("{\"tool\":\"gptextend\",\"disk\":");
+	json_str(stdout, disk);
+	printf(",\"size\":%lld,\"partition\":%d,\"start\":%lld,\"length\":%lld,"
+	       "\"metadata_seconds\":%.6f,\"kernel_seconds\":%.6f,\"total_seconds\":%.6f}\n",
+	       (long long)disksize, part, start, length, tgpt, tellkernel ? tkern : 0.0, now() - t0);
+    }
     return 0;
 }
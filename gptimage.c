@@ -11,23 +11,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <assert.h>
+#include <getopt.h>
+#include <limits.h>
 
 #include "filesize.h"
-#include "gpt.h"
-#include "mbr.h"
-#include "part.h"
-
-#ifndef SEEK_DATA
-#define SEEK_DATA 3
-#endif
-
-#ifndef SEEK_HOLE
-#define SEEK_HOLE 4
-#endif
-
-#define DEFAULT_ALIGN_BITS 20 /* 1MiB */
-#define DEFAULT_SECTOR_BITS 9 /* 512B */
+#include "imgtools.h"
+#include "qcow2.h"
+#include "decomp.h"
+#include "cache.h"
+#include "stats.h"
+#include "hash.h"
 
 #define please(expr) do { if ((expr) < 0) err(1, #expr); } while(0)
 
@@ -36,19 +29,6 @@
 static_assert(sizeof(loff_t) == sizeof(off_t));
 #endif
 
-static int verbose = 0;
-
-/* take a byte width 'w' and return
- * its width in lbas, taking care to
- * align the returned number of lbas to 'bits',
- * where bits is at least 9 (one sector) */
-static int64_t
-lba_align(off_t w, int bits)
-{
-    assert(bits >= 9);
-    return alignup((w+511)>>9, bits-9);
-}
-
 static off_t
 sectoff(int64_t lba)
 {
@@ -58,38 +38,164 @@ sectoff(int64_t lba)
     return b;
 }
 
+/* build the partition table of 'l' with disk label 'label' (see img_table()) */
 static void
-dosfmt(int fd, const char *label, struct partinfo *lst)
+mktable(const struct img_layout *l, const char *label,
+	unsigned char *header, size_t *headsz, unsigned char *trailer, size_t *tailsz)
 {
-    unsigned char mbr[512];
-    unsigned long sig;
+    if (img_table(l, label, header, headsz, trailer, tailsz) < 0)
+	err(1, l->dos ? "assembling dos parts" : "creating GPT");
+}
 
-    sig = strtoul(label, NULL, 0);
-    if (errno)
-	err(1, "strtoul(dos label)");
-    if (sig > 0xffffffff)
-	errx(1, "dos disk label id too large: %lu\n", sig);
+static void
+put_table(int fd, const char *name, bool sync, const unsigned char *header, size_t headsz,
+	  const unsigned char *trailer, size_t tailsz, int64_t sectors)
+{
+    if (img_put_table(fd, sync, header, headsz, trailer, tailsz, sectors) < 0)
+	err(1, "writing partition table of %s", name);
+}
 
-    memset(mbr, 0, sizeof(mbr));
-    put_le32(mbr + 440, sig);
-    if (mbr_write_parts(mbr, lst) < 0)
-	err(1, "assembling dos parts");
+static void
+put_counters(FILE *f, const struct partstats *st, off_t holes)
+{
+    fprintf(f, "\"extents\":%ld,\"data\":%lld,\"cloned\":%lld,\"copied\":%lld,"
+	    "\"zeros_skipped\":%lld,\"holes\":%lld,"
+	    "\"syscalls\":{\"lseek\":%ld,\"fiemap\":%ld,\"copy_file_range\":%ld,"
+	    "\"ficlonerange\":%ld,\"pread\":%ld,\"pwrite\":%ld,"
+	    "\"sync_file_range\":%ld,\"fadvise\":%ld},"
+	    "\"short_retries\":%ld,\"seconds\":%.6f,\"bytes_per_second\":%.0f",
+	    st->extents, (long long)st->data, (long long)st->cloned, (long long)st->copied,
+	    (long long)st->zeroed, (long long)holes,
+	    st->nlseek, st->nfiemap, st->ncfr, st->nclone, st->npread, st->npwrite,
+	    st->nsfr, st->nfadvise, st->nretry, st->seconds,
+	    st->seconds > 0 ? (st->cloned + st->copied) / st->seconds : 0.0);
+}
 
-    if (pwrite(fd, mbr, sizeof(mbr), 0) != 512)
-	err(1, "writing mbr");
+static void
+puthex(FILE *f, const unsigned char *p, size_t n)
+{
+    while (n--)
+	fprintf(f, "%02x", *p++);
 }
 
+/* -m: the SHA-256 of the image and of each partition's range,
+ * one per line as "sha256 <hex> <name> <offset> <length>",
+ * then the CRCs in the GPT as "crc32 <hex> <field>" */
 static void
-gptfmt(int fd, const char *uuid, struct partinfo *lst, int64_t sectors)
+manifest(const char *path, struct hasher *h, const struct partinfo *head, off_t size,
+	 const unsigned char *header, const unsigned char *trailer, bool dos, int ss)
 {
-    if (gpt_write_parts(fd, lst, uuid, sectors) < 0)
-	err(1, "creating GPT");
+    unsigned char image[SHA256_BYTES], (*sums)[SHA256_BYTES];
+    uint32_t hdrcrc, partcrc, backupcrc;
+    const struct partinfo *p;
+    FILE *f;
+    int n;
+
+    for (n = 0, p = head; p; p = p->next)
+	n++;
+    if (!(sums = calloc(n + 1, SHA256_BYTES)))
+	err(1, "calloc");
+    if (hash_finish(h, image, sums) < 0)
+	err(1, "hashing image");
+    if (!(f = fopen(path, "we")))
+	err(1, "%s", path);
+    fprintf(f, "sha256 ");
+    puthex(f, image, SHA256_BYTES);
+    fprintf(f, " image 0 %lld\n", (long long)size);
+    for (n = 0, p = head; p; p = p->next, n++) {
+	fprintf(f, "sha256 ");
+	puthex(f, sums[n], SHA256_BYTES);
+	fprintf(f, " p%d %lld %lld\n", p->num, (long long)sectoff(p->startlba),
+		(long long)sectoff(p->nsectors));
+    }
+    if (!dos) {
+	gpt_crcs(header, trailer, ss, &hdrcrc, &partcrc, &backupcrc);
+	fprintf(f, "crc32 %08x gpt-header\n", hdrcrc);
+	fprintf(f, "crc32 %08x gpt-entries\n", partcrc);
+	fprintf(f, "crc32 %08x gpt-backup-header\n", backupcrc);
+    }
+    if (fclose(f) != 0)
+	err(1, "%s", path);
+    free(sums);
+}
+
+/* -v: how much of the data has been copied */
+static void
+show_progress(void *arg, off_t done, off_t total)
+{
+    warnf("copied %lld of %lld bytes (%d%%)\n", (long long)done, (long long)total,
+	  total ? (int)(done * 100 / total) : 100);
+}
+
+/* --stats=json: what was done for each partition, and where the time went */
+static void
+print_stats(FILE *f, const char *diskname, const char *format, off_t size,
+	    const struct partinfo *head, const struct partstats *st,
+	    const struct writeback *wb, double meta, double copy, double sync, double total)
+{
+    struct partstats sum = {0};
+    struct writeback w = copy_writeback(wb);
+    off_t apparent, allocated, holes, allholes;
+    struct stat sb;
+    int i;
+
+    fprintf(f, "{\"tool\":\"gptimage\",\"image\":");
+    json_str(f, diskname);
+    fprintf(f, ",\"format\":\"%s\",\"size\":%lld,\"metadata_seconds\":%.6f,"
+	    "\"copy_seconds\":%.6f,\"sync_seconds\":%.6f,\"total_seconds\":%.6f,",
+	    format, (long long)size, meta, copy, sync, total);
+    fprintf(f, "\"writeback\":{\"dirty\":%lld,\"dontneed\":%s,\"sequential\":%s,\"sync\":%s},"
+	    "\"partitions\":[",
+	    (long long)w.dirty, w.dontneed ? "true" : "false",
+	    w.sequential ? "true" : "false", w.sync ? "true" : "false");
+    allholes = 0;
+    for (i = 0; head; head = head->next, i++) {
+	apparent = allocated = 0;
+	if (head->srcfd >= 0 && !(head->rd && head->rd->backing) &&
+	    fstat(head->srcfd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+	    apparent = sb.st_size;
+	    allocated = (off_t)sb.st_blocks << 9;
+	}
+	holes = head->srcfd >= 0 ? head->srcsz - st[i].data : 0;
+	fprintf(f, "%s{\"num\":%d,\"kind\":", i ? "," : "", head->num);
+	json_str(f, head->kind);
+	fprintf(f, ",\"start_lba\":%lld,\"sectors\":%lld,\"contents_size\":%lld,"
+		"\"source_apparent_size\":%lld,\"source_allocated_size\":%lld,\"engine\":",
+		(long long)head->startlba, (long long)head->nsectors, (long long)head->srcsz,
+		(long long)apparent, (long long)allocated);
+	json_str(f, st[i].engine);
+	fputc(',', f);
+	put_counters(f, &st[i], holes);
+	fputc('}', f);
+
+	sum.extents += st[i].extents;
+	sum.data += st[i].data;
+	sum.cloned += st[i].cloned;
+	sum.copied += st[i].copied;
+	sum.zeroed += st[i].zeroed;
+	sum.nlseek += st[i].nlseek;
+	sum.nfiemap += st[i].nfiemap;
+	sum.ncfr += st[i].ncfr;
+	sum.nclone += st[i].nclone;
+	sum.npread += st[i].npread;
+	sum.npwrite += st[i].npwrite;
+	sum.nretry += st[i].nretry;
+	sum.nsfr += st[i].nsfr;
+	sum.nfadvise += st[i].nfadvise;
+	allholes += holes;
+    }
+    sum.seconds = copy;
+    fprintf(f, "],\"totals\":{");
+    put_counters(f, &sum, allholes);
+    fprintf(f, "}}\n");
+    fflush(f);
 }
 
 const char *usagestr = \
-    "usage: gptimage [-a alignbits] [-b base] [-s size] [-u uuid] disk { contents kind ... } prog ...\n" \
+    "usage: gptimage [-a alignbits] [-b base] [-s size] [-u uuid] [-l sectsize] [-j jobs] [-e engine] [-z] [-v] [-w] [-f format] [-c] [-C cachedir] [-m manifest] [-B batchfile] [-n clones] [--stats=json[:path]] [--writeback=policy] disk { contents kind ... } prog ...\n" \
     "    for example:\n" \
-    "    $ gptimage -s 8G { efi.img U rootfs.img L } echo done\n";
+    "    $ gptimage -s 8G { efi.img U rootfs.img L } echo done\n" \
+    "    a disk of - writes the image to stdout\n";
 
 static void
 usage(void)
@@ -126,6 +232,7 @@ parse_size(const char *text)
     char *end;
     off_t up;
 
+    errno = 0;
     out = strtoll(text, &end, 0);
     if (errno)
 	err(1, "strtoull(%s)", text);
@@ -142,78 +249,517 @@ parse_size(const char *text)
     errx(1, "couldn't parse %s", text);
 }
 
-/* copy srcfd into dstfd starting at offset 'dstoff'
- * for dstfd, not copying more than 'width' bytes */
+/* writeback_opt() parses --writeback: a comma-separated
+ * list of dirty=SIZE, dontneed, sequential and sync */
 static void
-setpart(int dstfd, int srcfd, off_t dstoff, off_t width)
+writeback_opt(struct writeback *wb, char *arg)
 {
-    loff_t srcoff, srcend, shift;
-
-    /* find a section of data within srcfd
-     * and copy just that section via copy_file_range(2) */
-    srcoff = 0;
-    shift = dstoff;
-    while (srcoff < width) {	
-	srcoff = lseek(srcfd, (off_t)srcoff, SEEK_DATA);
-	if (srcoff < 0) {
-	    if (errno == ENXIO)
-		return; /* inside a hole at the end of the file */
-	    err(1, "lseek(SEEK_DATA)");
+    char *tok, *save;
+
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+	if (strncmp(tok, "dirty=", 6) == 0)
+	    wb->dirty = parse_size(tok + 6);
+	else if (strcmp(tok, "dontneed") == 0)
+	    wb->dontneed = true;
+	else if (strcmp(tok, "sequential") == 0)
+	    wb->sequential = true;
+	else if (strcmp(tok, "sync") == 0)
+	    wb->sync = true;
+	else
+	    errx(1, "unknown writeback policy %s (expected dirty=SIZE, dontneed, sequential or sync)", tok);
+    }
+}
+
+/* -n: make 'count' clones of the finished image 'diskname',
+ * named diskname.1 and so on (see img_clone()) */
+static void
+clone_image(const char *diskname, int count, const struct img_layout *l, const struct copyopts *copts)
+{
+    struct copyimage *imgs;
+    char name[PATH_MAX], label[40];
+    int i, srcfd;
+
+    please(srcfd = open(diskname, O_RDONLY|O_CLOEXEC));
+    if (!(imgs = calloc(count, sizeof(*imgs))))
+	err(1, "calloc");
+    for (i = 0; i < count; i++) {
+	if (snprintf(name, sizeof(name), "%s.%d", diskname, i + 1) >= (int)sizeof(name))
+	    errx(1, "%s: name too long", diskname);
+	if (!(imgs[i].name = strdup(name)))
+	    err(1, "strdup");
+	please(imgs[i].fd = open(name, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0644));
+    }
+    if (img_clone(l, srcfd, imgs, count, copts) < 0)
+	err(1, "cloning %s", diskname);
+    for (i = 0; i < count; i++) {
+	img_clone_label(l, i + 1, label, sizeof(label));
+	warnf("%s: label %s\n", imgs[i].name, label);
+	close(imgs[i].fd);
+	free((char *)imgs[i].name);
+    }
+    close(srcfd);
+    free(imgs);
+}
+
+/* a source shared by every image in a batch that uses it */
+struct source {
+    struct source *next;
+    const char *path;
+    int fd;
+    off_t size;
+    struct srcreader *rd;
+    int ss;                /* sector size a directory's filesystem was laid out for */
+    struct extmap map;     /* found once, for every image */
+};
+
+/* layout_opt() applies one of -d, -a, -s, -b, -u or -l
+ * to 'l', and returns false for any other option
+ *
+ * -a = minimum partition alignment (in bits)
+ * -s = force output size (in bytes or human-readable form)
+ * -b = base address for first partition (in bytes or human-readable form)
+ * -l = logical sector size of the disk (512 or 4096) */
+static bool
+layout_opt(struct img_layout *l, int c, const char *arg)
+{
+    switch (c) {
+    case 'd':
+	l->dos = true;
+	break;
+    case 'a':
+	if (img_set_align(l, atoi(arg)) < 0)
+	    errx(1, "alignment %d below minimum alignment %d\n", atoi(arg), 9);
+	if (l->align < 20)
+	    warnf("warning: alignment %d below recommended of %d\n", l->align, 20);
+	break;
+    case 's':
+	img_set_size(l, parse_size(arg));
+	break;
+    case 'b':
+	img_set_base(l, parse_size(arg));
+	break;
+    case 'u':
+	l->uuid = arg;
+	break;
+    case 'l':
+	if (img_set_sectsize(l, atoi(arg)) < 0)
+	    errx(1, "bad sector size %s", arg);
+	break;
+    default:
+	return false;
+    }
+    return true;
+}
+
+/* tar archives that partitions come from, each opened and indexed once */
+struct archive {
+    struct archive *next;
+    char *path;
+    int fd;
+    struct tarindex *idx;
+};
+
+static struct archive *archives;
+
+/* open_member() adds a partition with the contents of the
+ * file in a tar archive named by 'path', as 'archive:name' */
+static struct partinfo *
+open_member(struct img_layout *l, const char *kind, const char *path)
+{
+    struct partinfo *part;
+    struct archive *a;
+    const char *name;
+    size_t len;
+
+    name = strchr(path, ':') + 1;
+    len = (size_t)(name - 1 - path);
+    for (a = archives; a; a = a->next)
+	if (strlen(a->path) == len && strncmp(a->path, path, len) == 0)
+	    break;
+    if (!a) {
+	if (!(a = calloc(1, sizeof(*a))) || !(a->path = strndup(path, len)))
+	    err(1, "calloc");
+	please(a->fd = open(a->path, O_RDONLY|O_CLOEXEC));
+	if (!(a->idx = tar_index(a->fd))) {
+	    if (errno == EINVAL)
+		errx(1, "%s isn't a tar archive", a->path);
+	    err(1, "reading %s", a->path);
 	}
-	if (srcoff == width)
+	a->next = archives;
+	archives = a;
+    }
+    if (!(part = img_add_member(l, kind, a->idx, name))) {
+	if (errno == ENOENT)
+	    errx(1, "%s has no file %s", a->path, name);
+	err(1, "reading %s", path);
+    }
+    /* the partition's fd is its own to close, as with any other source */
+    please(part->srcfd = dup(part->srcfd));
+    return part;
+}
+
+/* report why the directory 'path' can't be made into a FAT32 filesystem */
+static void
+fat_fail(const char *path)
+{
+    if (errno == ENOSPC)
+	errx(1, "%s doesn't fit in a FAT32 filesystem of that size", path);
+    if (errno == EEXIST)
+	errx(1, "%s holds names that differ only in case", path);
+    if (errno == EINVAL)
+	errx(1, "%s holds something other than files and directories", path);
+    err(1, "reading %s", path);
+}
+
+/* open_file() adds a partition with the contents of the file at
+ * 'path', or of a file in a tar archive if 'path' is 'archive:name'
+ * and there is no such file */
+static struct partinfo *
+open_file(struct img_layout *l, const char *kind, const char *path, int nthreads)
+{
+    struct partinfo *part;
+    struct stat st;
+    int fd;
+
+    if (strchr(path, ':') && access(path, F_OK) < 0 && errno == ENOENT)
+	return open_member(l, kind, path);
+    please(fd = open(path, O_RDONLY|O_CLOEXEC));
+    if (!(part = img_add_fd(l, kind, fd, nthreads))) {
+	if (errno == ENODATA)
+	    errx(1, "can't tell the uncompressed size of %s; give it as <size:%s", path, path);
+	if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+	    fat_fail(path);
+	err(1, "reading %s", path);
+    }
+    return part;
+}
+
+/* open_shared() is open_file() for batches: each source is opened,
+ * and its extents found, only once (a directory once per sector
+ * size); compressed sources can only be read once, though, so
+ * every partition gets its own */
+static struct partinfo *
+open_shared(struct source **tab, struct img_layout *l, const char *kind, const char *path, int nthreads)
+{
+    struct partinfo *part;
+    struct source *s;
+    struct stat st;
+
+    for (s = *tab; s; s = s->next)
+	if (strcmp(s->path, path) == 0 && (!s->ss || s->ss == img_sectsize(l)))
 	    break;
-	assert(srcoff < width);
-	please(srcend = lseek(srcfd, (off_t)srcoff, SEEK_HOLE));
-	dstoff = srcoff + shift;
-	please(copy_file_range(srcfd, &srcoff, dstfd, &dstoff, (size_t)(srcend - srcoff), 0));
+    if (!s) {
+	part = open_file(l, kind, path, nthreads);
+	if (part->pipe)
+	    return part;
+	if (!(s = calloc(1, sizeof(*s))))
+	    err(1, "calloc");
+	s->path = path;
+	s->fd = part->srcfd;
+	s->size = part->srcsz;
+	s->rd = part->rd;
+	if (s->rd && s->rd->backing && fstat(s->fd, &st) == 0 && S_ISDIR(st.st_mode))
+	    s->ss = img_sectsize(l);
+	if (s->rd ? s->rd->extents(s->rd, &s->map) < 0 : extmap_scan(&s->map, s->fd, s->size) < 0)
+	    err(1, "finding data extents of %s", path);
+	s->next = *tab;
+	*tab = s;
+    } else if (!(part = img_add_empty(l, kind, s->size))) {
+	err(1, "calloc");
+    }
+    part->srcfd = s->fd;
+    part->rd = s->rd;
+    part->map = &s->map;
+    return part;
+}
+
+/* layout_add() lays out the next partition of 'l': its
+ * contents are a file or directory, '+size', '+size:dir', '*',
+ * or '<size:path', and
+ * 'tab' is the table of shared sources in batch mode */
+static void
+layout_add(struct img_layout *l, char *contents, const char *kind, int nthreads, struct source **tab)
+{
+    struct partinfo *part;
+    char *path;
+    off_t size;
+    int fd;
+
+    if (strcmp(contents, "*") == 0) {
+	/* empty partiton; wildcard size */
+	if (!(part = img_add_rest(l, kind))) {
+	    if (errno == EINVAL)
+		errx(1, "cannot use wildcard part size without -s <size> flag");
+	    if (errno == ENOSPC)
+		errx(1, "no space remaining for wildcard partition");
+	    err(1, "calloc");
+	}
+    } else if (contents[0] == '+' && (path = strchr(contents, ':'))) {
+	/* FAT32 filesystem of a fixed size holding a directory: +size:dir */
+	*path++ = 0;
+	please(fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+	if (!(part = img_add_fat(l, kind, fd, parse_size(contents + 1))))
+	    fat_fail(path);
+    } else if (contents[0] == '+') {
+	/* empty partition; fixed size */
+	if (!(part = img_add_empty(l, kind, parse_size(++contents))))
+	    err(1, "calloc");
+    } else if (contents[0] == '<') {
+	/* pipe or FIFO of at most 'size' bytes: <size:path */
+	if (tab)
+	    errx(1, "pipes can't be used in batch mode");
+	if (!(path = strchr(++contents, ':')))
+	    errx(1, "expected <size:path, got <%s", contents);
+	*path++ = 0;
+	size = parse_size(contents);
+	if (strcmp(path, "-") == 0)
+	    fd = 0;
+	else
+	    please(fd = open(path, O_RDONLY|O_CLOEXEC));
+	if (!(part = img_add_pipe(l, kind, fd, size, nthreads)))
+	    err(1, "reading %s", path);
+    } else if (tab) {
+	part = open_shared(tab, l, kind, contents, nthreads);
+    } else {
+	part = open_file(l, kind, contents, nthreads);
     }
+    warnf("p%d %lli %lli\n", part->num, part->startlba, part->nsectors);
+}
+
+/* layout_done() settles the size and label of the disk */
+static void
+layout_done(struct img_layout *l)
+{
+    if (img_done(l) == 0)
+	return;
+    if (errno == EINVAL)
+	errx(1, "alignment %d below the %d-byte sector size", l->align, img_sectsize(l));
+    if (errno == ENOSPC)
+	errx(1, "images (%lli sectors) do not fit in %lli sectors",
+	     (long long)(l->lba + img_trailer_sectors(l)), (long long)l->disksectors);
+    errx(1, "lba %lli (overflow somewhere?)", (long long)(l->lba + img_trailer_sectors(l)));
+}
+
+/* -B: build every disk described in the file 'path' in one go,
+ * copying on one pool of workers; the file has a line
+ *
+ *     disk <name> [-d] [-a bits] [-s size] [-b base] [-u label] [-l sectsize]
+ *
+ * for each disk, followed by a "<contents> <kind>" line for each of
+ * its partitions ('#' starts a comment), and 'defaults' holds the
+ * layout options given on the command line */
+static void
+batch(const char *path, const struct img_layout *defaults, const struct copyopts *copts)
+{
+    size_t cap;
+    struct copyimage *imgs;
+    struct img_layout *lays, *l;
+    struct source *tab, *s;
+    struct partinfo *p;
+    char *line, *tok[64], *save, *arg;
+    int i, n, ntok, lineno;
+    FILE *f;
+
+    if (!(f = fopen(path, "re")))
+	err(1, "%s", path);
+    imgs = NULL;
+    lays = NULL;
+    tab = NULL;
+    line = NULL;
+    cap = 0;
+    n = 0;
+    for (lineno = 1; getline(&line, &cap, f) > 0; lineno++) {
+	if ((arg = strchr(line, '#')))
+	    *arg = 0;
+	/* kinds and names are kept, so the tokens have to outlive 'line' */
+	if (!(arg = strdup(line)))
+	    err(1, "strdup");
+	ntok = 0;
+	for (tok[0] = strtok_r(arg, " \t\n", &save); tok[ntok] && ntok < 63; tok[++ntok] = strtok_r(NULL, " \t\n", &save))
+	    ;
+	if (!ntok)
+	    continue;
+	if (strcmp(tok[0], "disk") == 0) {
+	    if (ntok < 2)
+		errx(1, "%s:%d: expected disk <name> [options]", path, lineno);
+	    if (!(imgs = realloc(imgs, (n+1)*sizeof(*imgs))) || !(lays = realloc(lays, (n+1)*sizeof(*lays))))
+		err(1, "realloc");
+	    memset(&imgs[n], 0, sizeof(*imgs));
+	    imgs[n].name = tok[1];
+	    l = &lays[n++];
+	    *l = *defaults;
+	    for (i = 2; i < ntok; i++) {
+		if (tok[i][0] != '-' || !tok[i][1] || tok[i][2])
+		    errx(1, "%s:%d: unexpected %s", path, lineno, tok[i]);
+		arg = NULL;
+		if (strchr("asbul", tok[i][1]) && !(arg = tok[++i]))
+		    errx(1, "%s:%d: %s needs an argument", path, lineno, tok[i-1]);
+		if (!layout_opt(l, tok[i - !!arg][1], arg))
+		    errx(1, "%s:%d: unknown disk option %s", path, lineno, tok[i - !!arg]);
+	    }
+	    continue;
+	}
+	if (!n)
+	    errx(1, "%s:%d: partitions before the first disk", path, lineno);
+	if (ntok != 2)
+	    errx(1, "%s:%d: expected <contents> <kind>", path, lineno);
+	layout_add(&lays[n-1], tok[0], tok[1], copts->nthreads, &tab);
+    }
+    if (ferror(f))
+	err(1, "%s", path);
+    fclose(f);
+    free(line);
+    if (!n)
+	errx(1, "%s: no disks", path);
+
+    for (i = 0; i < n; i++) {
+	layout_done(&lays[i]);
+	please(imgs[i].fd = open(imgs[i].name, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0644));
+    }
+    if (img_write_all(lays, imgs, n, copts) < 0)
+	err(1, "writing the images");
+
+    for (i = 0; i < n; i++) {
+	close(imgs[i].fd);
+	/* shared sources are closed below */
+	for (p = lays[i].head; p; p = p->next)
+	    if (p->map)
+		p->rd = NULL;
+	img_free(&lays[i]);
+    }
+    while ((s = tab)) {
+	tab = s->next;
+	if (s->rd)
+	    s->rd->close(s->rd);
+	close(s->fd);
+	extmap_free(&s->map);
+	free(s);
+    }
+    free(imgs);
+    free(lays);
 }
 
 int
 main(int argc, char * const* argv)
 {
-    int64_t lba, nsectors, disksectors, trailersectors;
-    char *diskname, *contents, *kind, *uuid;
-    struct partinfo *head, *tail, *part;
-    int srcfd, dstfd, partnum;
-    off_t srcsz, align;
-    char optc;
-    bool dos;
-
-    /* the output ought to be deterministic, so pick a uuid: */
-    dos = false;
-    uuid = NULL;
-    disksectors = 0;
-    align = DEFAULT_ALIGN_BITS;
-    lba = lba_align(1, DEFAULT_ALIGN_BITS);
-    /* -a = minimum partition alignment (in bits)
-     * -s = force output size (in bytes or human-readable form)
-     * -b = base address for first partition (in bytes or human-readable form) */
-    while ((optc = getopt(argc, argv, "+a:s:b:u:vdh")) != -1) {
+    int64_t disksectors;
+    char *diskname, *contents, *kind;
+    const char *batchpath;
+    int nclones, ss;
+    struct partinfo *head;
+    struct img_layout layout;
+    struct copyopts copts = {0};
+    struct qcow2opts qopts = {0};
+    char (*keys)[CACHE_KEY_MAX];
+    char *cachedir;
+    int cachefd;
+    int dstfd, partnum;
+    int optc;
+    bool dos, inplace, streaming, qcow2;
+    struct partstats *stats;
+    const char *statspath, *manifestpath, *engine;
+    struct hasher *hasher;
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    size_t headsz, tailsz;
+    FILE *statsf;
+    double t0, tmeta, tcopy, tsync;
+    static const struct option longopts[] = {
+	{ "stats", required_argument, NULL, 'S' },
+	{ "writeback", required_argument, NULL, 'W' },
+	{ NULL, 0, NULL, 0 },
+    };
+
+    img_init(&layout);
+    inplace = false;
+    qcow2 = false;
+    cachedir = NULL;
+    statspath = NULL;
+    manifestpath = NULL;
+    batchpath = NULL;
+    nclones = 0;
+    stats = NULL;
+    statsf = NULL;
+    copts.nthreads = 1;
+    copts.engine = COPY_AUTO;
+    engine = "auto";
+    /* -d, -a, -s, -b, -u, -l = see layout_opt()
+     * -j = number of copy threads (0 = one per cpu)
+     * -e = copy engine
+     * -z = leave blocks of zeros in the sources as holes
+     * -w = write over an existing disk (or file)
+     * -f = output format (raw or qcow2)
+     * -c = compress qcow2 clusters
+     * -C = partition cache directory
+     * -m = write image and partition hashes here
+     * -B = build the disks listed in a batch file
+     * -n = also make this many clones of the image
+     * --stats=json[:path] = report what was done as JSON
+     * --writeback=policy = see writeback_opt()
+     * -v = report copy progress on stderr */
+    t0 = now();
+    while ((optc = getopt_long(argc, argv, "+a:s:b:u:l:j:e:zwf:cC:m:B:n:vdh", longopts, NULL)) != -1) {
 	switch (optc) {
 	case 'd':
-	    dos = true;
-	    break;
 	case 'a':
-	    align = atoi(optarg);
-	    if (align < 9)
-		errx(1, "alignment %d below minimum alignment %d\n", align, 9);
-	    if (align < 20)
-		warnf("warning: alignment %d below recommended of %d\n", align, 20);
-	    lba = alignup(lba, align-9);
-	    disksectors = alignup(disksectors, align-9);
-	    break;
 	case 's':
-	    disksectors = lba_align(parse_size(optarg), align);
-	    break;
 	case 'b':
-	    lba = lba_align(parse_size(optarg), align);
-	    break;
 	case 'u':
-	    uuid = optarg;
+	case 'l':
+	    layout_opt(&layout, optc, optarg);
+	    break;
+	case 'j':
+	    copts.nthreads = atoi(optarg);
+	    if (copts.nthreads < 0)
+		errx(1, "negative thread count %d", copts.nthreads);
+	    if (!copts.nthreads)
+		copts.nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	    break;
+	case 'e':
+	    engine = optarg;
+	    if ((copts.engine = copy_engine(optarg)) < 0)
+		errx(1, "unknown copy engine %s", optarg);
+	    break;
+	case 'z':
+	    copts.skipzero = true;
+	    break;
+	case 'w':
+	    inplace = true;
+	    break;
+	case 'f':
+	    if (strcmp(optarg, "qcow2") == 0)
+		qcow2 = true;
+	    else if (strcmp(optarg, "raw") == 0)
+		qcow2 = false;
+	    else
+		errx(1, "unknown image format %s", optarg);
+	    break;
+	case 'c':
+	    qopts.compress = true;
+	    break;
+	case 'C':
+	    cachedir = optarg;
+	    break;
+	case 'm':
+	    manifestpath = optarg;
+	    break;
+	case 'B':
+	    batchpath = optarg;
+	    break;
+	case 'n':
+	    if ((nclones = atoi(optarg)) < 1)
+		errx(1, "bad clone count %s", optarg);
+	    break;
+	case 'S':
+	    if (strncmp(optarg, "json", 4) || (optarg[4] && optarg[4] != ':'))
+		errx(1, "unknown stats format %s (expected json or json:path)", optarg);
+	    statspath = optarg[4] ? optarg + 5 : "";
+	    break;
+	case 'W':
+	    writeback_opt(&copts.wb, optarg);
 	    break;
 	case 'v':
-	    verbose = 1;
+	    copts.progress = show_progress;
 	    break;
 	case 'h':
 	    usage();
@@ -222,22 +768,66 @@ main(int argc, char * const* argv)
 	    errx(1, "unrecognized option %c", optc);
 	}
     }
-    if (!uuid)
-	uuid = dos ? "0x77777777" : "3782C3EE-1C16-F042-82A8-D6A40FB7CFAD";
-
-    /* we may need to reserve space at the end of the disk */
-    trailersectors = dos ? 0 : GPT_RESERVE_LBAS;
+    if (qopts.compress && !qcow2)
+	errx(1, "-c requires -f qcow2");
+    if (qcow2 && inplace)
+	errx(1, "-w cannot be used with -f qcow2");
+    if (nclones && (qcow2 || inplace))
+	errx(1, "-n only clones raw images written to a new file");
+    /* qcow2 and streamed images copy the partitions themselves */
+    if (statspath && qcow2)
+	errx(1, "--stats cannot be used with -f qcow2");
+    /* -z has to look at the data, so only engines that read it will do */
+    if (copts.skipzero && copts.engine != COPY_AUTO && copts.engine != COPY_BUFFERED &&
+	copts.engine != COPY_DIRECT)
+	errx(1, "-z cannot be used with -e %s", engine);
+    if ((copts.engine == COPY_REFLINK || copts.engine == COPY_RANGE) && qcow2)
+	errx(1, "-e %s cannot be used with -f qcow2", engine);
+    qopts.nthreads = copts.nthreads;
 
     argc -= optind;
     argv += optind;
+    if (batchpath) {
+	if (inplace || qcow2 || cachedir || manifestpath || statspath || nclones)
+	    errx(1, "-B cannot be combined with -w, -f qcow2, -C, -m, -n or --stats");
+	batch(batchpath, &layout, &copts);
+	goto done;
+    }
     if (argc < 2) usage();
     diskname = argv[0];
     argc--; argv++;
 
-    please(dstfd = open(diskname, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, 0644));
+    streaming = strcmp(diskname, "-") == 0;
+    if (streaming) {
+	/* the image is written front-to-back to stdout */
+	if (inplace)
+	    errx(1, "-w cannot be used when streaming to stdout");
+	if (qcow2)
+	    errx(1, "qcow2 images cannot be streamed to stdout");
+	if (nclones)
+	    errx(1, "-n cannot be used when streaming to stdout");
+	if (statspath)
+	    errx(1, "--stats cannot be used when streaming to stdout");
+	if (copts.engine == COPY_REFLINK || copts.engine == COPY_RANGE)
+	    errx(1, "-e %s cannot be used when streaming to stdout", engine);
+	dstfd = 1;
+    } else if (inplace) {
+	/* the existing contents don't read as zeros, so
+	 * everything that isn't data will need to be zeroed */
+	please(dstfd = open(diskname, O_RDWR|O_CLOEXEC));
+	/* devices have a sector size of their own */
+	ss = layout.ssize;
+	if (img_use_disk(&layout, dstfd) < 0) {
+	    if (errno == EINVAL)
+		errx(1, "%s doesn't have %d-byte sectors", diskname, ss);
+	    err(1, "%s", diskname);
+	}
+	copts.zerofill = true;
+    } else {
+	/* the cache and the manifest may read partitions back */
+	please(dstfd = open(diskname, O_CREAT|O_EXCL|(cachedir || manifestpath ? O_RDWR : O_WRONLY)|O_CLOEXEC, 0644));
+    }
 
-    head = tail = NULL;
-    partnum = 1;
     while (argc && strcmp(argv[0], "")) {
 	if (argc < 2)
 	    usage();
@@ -246,72 +836,109 @@ main(int argc, char * const* argv)
 	argc -= 2;
 	if (*contents++ != ' ' || *kind++ != ' ')
 	    usage();
-
-	if (strcmp(contents, "*") == 0) {
-	    /* empty partiton; wildcard size */
-	    srcfd = -1;
-	    if (!disksectors)
-		errx(1, "cannot use wildcard part size without -s <size> flag");
-	    if (lba >= disksectors-trailersectors)
-		errx(1, "no space remaining for wildcard partition");
-	    nsectors = disksectors - trailersectors - lba;
-	    srcsz = sectoff(disksectors - trailersectors - lba);
-	} else if (contents[0] == '+') {
-	    /* empty partition; fixed size */
-	    srcfd = -1;
-	    srcsz = parse_size(++contents);
-	    nsectors = lba_align(srcsz, align);
-	} else {
-	    please(srcfd = open(contents, O_RDONLY|O_CLOEXEC));
-	    srcsz = fgetsize(srcfd);
-	    nsectors = lba_align(srcsz, align);
-	}
-
-	part = calloc(1, sizeof(struct partinfo));
-	part->kind = kind;
-	part->srcfd = srcfd;
-	part->srcsz = srcsz;
-	part->startlba = lba;
-	part->nsectors = nsectors;
-	part->num = partnum++;
-	lba += nsectors;
-	warnf("p%d %lli %lli\n", part->num, part->startlba, part->nsectors);
-	if (tail)
-	    tail->next = part;
-	else
-	    head = part;
-	tail = part;
+	layout_add(&layout, contents, kind, copts.nthreads, NULL);
     }
     if (!argc-- || strcmp(*argv++, ""))
 	usage();
 
-    /* now we know the full size of the image: */
-    lba += trailersectors;
-    lba = alignup(lba, align-9);
+    layout_done(&layout);
+    dos = layout.dos;
+    disksectors = layout.disksectors;
+    ss = img_sectsize(&layout);
+    head = layout.head;
+    partnum = layout.partnum;
+
+    keys = NULL;
+    cachefd = -1;
+    if (cachedir) {
+	please(cachefd = open(cachedir, O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+	if (!(keys = calloc(partnum, CACHE_KEY_MAX)))
+	    err(1, "calloc");
+	cache_fetch(cachefd, head, keys);
+    }
 
-    if (lba < 0)
-	errx(1, "lba %lli (overflow somewhere?)", lba);
-    if (!disksectors)
-	disksectors = lba;
-    else if (lba > disksectors)
-	errx(1, "images (%lli sectors) do not fit in %lli sectors",
-	     (long long)lba, (long long)disksectors);
+    if (statspath) {
+	if (!*statspath)
+	    statsf = stdout;
+	else if (!(statsf = fopen(statspath, "we")))
+	    err(1, "%s", statspath);
+	if (!(stats = calloc(partnum, sizeof(struct partstats))))
+	    err(1, "calloc");
+	copts.stats = stats;
+    }
+
+    tmeta = now();
+    mktable(&layout, NULL, header, &headsz, trailer, &tailsz);
+    hasher = NULL;
+    /* partitions that can't be read twice are hashed
+     * by reading them back from a raw image */
+    if (manifestpath && !(hasher = hash_start(header, headsz, trailer, tailsz, head,
+					      sectoff(disksectors), qcow2 || streaming ? -1 : dstfd))) {
+	if (errno == EINVAL)
+	    errx(1, "-m can only hash pipe, qcow2 and compressed sources when writing a raw image to a file or disk");
+	err(1, "starting to hash the image");
+    }
 
-    please(ftruncate(dstfd, sectoff(disksectors)));
+    if (qcow2 || streaming) {
+	/* the partitions are copied as the image is written out,
+	 * so there is no separate metadata or copy phase */
+	if (img_stream(&layout, dstfd, qcow2 ? &qopts : NULL) < 0)
+	    err(1, qcow2 ? "writing qcow2 image" : "streaming image");
+	/* stdout may be a pipe, which can't be synced */
+	if (copts.wb.sync && fdatasync(dstfd) < 0 && errno != EINVAL)
+	    err(1, "syncing %s", diskname);
+	if (hasher)
+	    manifest(manifestpath, hasher, head, sectoff(disksectors), header, trailer, dos, ss);
+	img_free(&layout);
+	if (qcow2) {
+	    close(dstfd);
+	    goto done;
+	}
+	/* let the reader see EOF even though prog inherits stdout */
+	please(dstfd = open("/dev/null", O_WRONLY|O_CLOEXEC));
+	please(dup2(dstfd, 1));
+	close(dstfd);
+	goto done;
+    }
+
+    if (img_prepare(&layout, dstfd, inplace) < 0) {
+	if (errno == ENOSPC)
+	    errx(1, "%s is too small (%lli bytes) for %lli sectors",
+		 diskname, (long long)fgetsize(dstfd), (long long)disksectors);
+	err(1, inplace ? "zeroing %s outside the partitions" : "extending %s", diskname);
+    }
 
     /* ... finally, do the actual work: */
-    if (dos)
-	dosfmt(dstfd, uuid, head);
-    else
-	gptfmt(dstfd, uuid, head, disksectors);
-    while (head) {
-	if (head->srcfd >= 0)
-	    setpart(dstfd, head->srcfd, sectoff(head->startlba), head->srcsz);
-	head = head->next;
+    if (!copts.wb.sync)
+	put_table(dstfd, diskname, false, header, headsz, trailer, tailsz, disksectors);
+    tcopy = now();
+    tmeta = tcopy - tmeta;
+    if (copy_parts(dstfd, head, &copts) < 0)
+	err(1, "copying partition contents");
+    tsync = now();
+    tcopy = tsync - tcopy;
+    /* with sync, the table goes last */
+    if (copts.wb.sync)
+	put_table(dstfd, diskname, true, header, headsz, trailer, tailsz, disksectors);
+    tsync = now() - tsync;
+    if (hasher) {
+	hash_copied(hasher);
+	manifest(manifestpath, hasher, head, sectoff(disksectors), header, trailer, dos, ss);
     }
-    free_parts(&head);
+    if (cachedir)
+	cache_save(cachefd, dstfd, head, keys);
+    if (statsf)
+	print_stats(statsf, diskname, "raw", sectoff(disksectors),
+		    head, stats, &copts.wb, tmeta, tcopy, tsync, now() - t0);
+    if (nclones)
+	clone_image(diskname, nclones, &layout, &copts);
+    img_free(&layout);
     close(dstfd);
 
+done:
+    if (statsf && statsf != stdout)
+	fclose(statsf);
+    free(stats);
     if (!argc)
 	return 0;
     execvp(argv[0], argv);
@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "part.h"
+#include "extent.h"
+#include "source.h"
+#include "stream.h"
+#include "hash.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define HASH_SLOTS 8
+#define HASH_BUFSZ (1L << 20)
+
+/* a run of the image handed from the reader to the
+ * image hasher: 'len' bytes of 'buf', or 'len' zeros */
+struct slot {
+    unsigned char *buf;
+    off_t len;
+    bool zero;
+};
+
+/* the range of the image a partition was copied into,
+ * standing in for a source that can't be read twice */
+struct window {
+    struct srcreader r;
+    struct hasher *h;
+    int fd;
+    off_t base;
+    off_t len;
+};
+
+/* the reader thread runs stream_sink() into 'sink', hashing each
+ * partition as it goes by, and hands everything on to the image
+ * thread through 'ring' */
+struct hasher {
+    struct sink sink;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t reader, imager;
+    struct slot ring[HASH_SLOTS];
+    unsigned long put, got;    /* slots filled and consumed */
+    bool eof;                  /* the reader is done */
+    bool copied;               /* hash_copied() was called */
+    int err;                   /* errno of the first failure */
+
+    const unsigned char *head, *tail;
+    size_t headsz, tailsz;
+    off_t size;
+    struct partinfo *parts;    /* copies of the caller's partitions */
+    int nparts;
+
+    /* only touched by the reader: */
+    off_t off;                 /* bytes of the image seen so far */
+    struct partinfo *cur;      /* the next partition to finish */
+    int curidx;
+    struct sha256 part;
+    unsigned char (*sums)[SHA256_BYTES];
+
+    /* only touched by the image thread: */
+    struct sha256 image;
+};
+
+static void
+wait_copied(struct hasher *h)
+{
+    pthread_mutex_lock(&h->lock);
+    while (!h->copied)
+	pthread_cond_wait(&h->cond, &h->lock);
+    pthread_mutex_unlock(&h->lock);
+}
+
+static int
+window_extents(struct srcreader *r, struct extmap *m)
+{
+    struct window *w = (struct window *)r;
+    off_t off, data, end;
+
+    wait_copied(w->h);
+    m->len = 0;
+    m->size = w->len;
+    for (off = 0; off < w->len; off = end) {
+	data = lseek(w->fd, w->base + off, SEEK_DATA);
+	m->nlseek++;
+	if (data < 0 && errno == ENXIO)
+	    break;
+	if (data < 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+	    return extmap_add(m, off, w->len - off); /* no hole information */
+	if (data < 0)
+	    return -1;
+	if ((data -= w->base) >= w->len)
+	    break;
+	m->nlseek++;
+	if ((end = lseek(w->fd, w->base + data, SEEK_HOLE)) < 0)
+	    return -1;
+	end -= w->base;
+	if (end > w->len)
+	    end = w->len;
+	if (extmap_add(m, data, end - data) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+static ssize_t
+window_read(struct srcreader *r, void *buf, size_t len, off_t off)
+{
+    struct window *w = (struct window *)r;
+
+    if (off >= w->len)
+	return 0;
+    if ((off_t)len > w->len - off)
+	len = w->len - off;
+    return pread(w->fd, buf, len, w->base + off);
+}
+
+static void
+window_close(struct srcreader *r)
+{
+    free(r);
+}
+
+/* hash_parts() feeds the next 'len' bytes of the image
+ * (or zeros, if 'buf' is NULL) to the partition hashes */
+static void
+hash_parts(struct hasher *h, const unsigned char *buf, off_t len)
+{
+    off_t start, end, n;
+
+    for (;;) {
+	/* finish every partition that ends here */
+	while (h->cur && h->off >= (h->cur->startlba + h->cur->nsectors) << 9) {
+	    sha256_final(&h->part, h->sums[h->curidx++]);
+	    sha256_init(&h->part);
+	    h->cur = h->cur->next;
+	}
+	if (!len)
+	    break;
+	n = len;
+	if (h->cur) {
+	    start = h->cur->startlba << 9;
+	    end = start + (h->cur->nsectors << 9);
+	    if (h->off < start) {
+		if (n > start - h->off)
+		    n = start - h->off;
+	    } else {
+		if (n > end - h->off)
+		    n = end - h->off;
+		if (buf)
+		    sha256_update(&h->part, buf, n);
+		else
+		    sha256_zeros(&h->part, n);
+	    }
+	}
+	if (buf)
+	    buf += n;
+	h->off += n;
+	len -= n;
+    }
+}
+
+/* queue() hands a run of the image to the image thread */
+static int
+queue(struct hasher *h, const unsigned char *buf, off_t len)
+{
+    struct slot *s;
+
+    pthread_mutex_lock(&h->lock);
+    while (h->put - h->got == HASH_SLOTS)
+	pthread_cond_wait(&h->cond, &h->lock);
+    pthread_mutex_unlock(&h->lock);
+
+    s = &h->ring[h->put % HASH_SLOTS];
+    s->zero = !buf;
+    s->len = len;
+    if (buf)
+	memcpy(s->buf, buf, len);
+
+    pthread_mutex_lock(&h->lock);
+    h->put++;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    return 0;
+}
+
+static int
+sink_put(struct sink *sink, const unsigned char *buf, size_t len)
+{
+    struct hasher *h = (struct hasher *)sink;
+    size_t n;
+
+    hash_parts(h, buf, len);
+    for (; len; buf += n, len -= n) {
+	n = len < HASH_BUFSZ ? len : HASH_BUFSZ;
+	queue(h, buf, n);
+    }
+    return 0;
+}
+
+static int
+sink_skip(struct sink *sink, off_t len)
+{
+    struct hasher *h = (struct hasher *)sink;
+
+    hash_parts(h, NULL, len);
+    return queue(h, NULL, len);
+}
+
+static void *
+reader(void *arg)
+{
+    struct hasher *h = arg;
+    int ret;
+
+    ret = stream_sink(&h->sink, h->head, h->headsz, h->tail, h->tailsz, h->parts, h->size);
+    hash_parts(h, NULL, 0);
+    pthread_mutex_lock(&h->lock);
+    if (ret < 0)
+	h->err = errno ? errno : EIO;
+    h->eof = true;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
+}
+
+static void *
+imager(void *arg)
+{
+    struct hasher *h = arg;
+    struct slot *s;
+
+    pthread_mutex_lock(&h->lock);
+    for (;;) {
+	while (h->got == h->put && !h->eof)
+	    pthread_cond_wait(&h->cond, &h->lock);
+	if (h->got == h->put)
+	    break;
+	s = &h->ring[h->got % HASH_SLOTS];
+	pthread_mutex_unlock(&h->lock);
+	if (s->zero)
+	    sha256_zeros(&h->image, s->len);
+	else
+	    sha256_update(&h->image, s->buf, s->len);
+	pthread_mutex_lock(&h->lock);
+	h->got++;
+	pthread_cond_broadcast(&h->cond);
+    }
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
+}
+
+static void
+hash_free(struct hasher *h)
+{
+    int i;
+
+    for (i = 0; i < h->nparts; i++)
+	if (h->parts[i].rd)
+	    h->parts[i].rd->close(h->parts[i].rd);
+    for (i = 0; i < HASH_SLOTS; i++)
+	free(h->ring[i].buf);
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->cond);
+    free(h->parts);
+    free(h->sums);
+    free(h);
+}
+
+struct hasher *
+hash_start(const unsigned char *head, size_t headsz,
+	   const unsigned char *tail, size_t tailsz,
+	   const struct partinfo *parts, off_t size, int imgfd)
+{
+    const struct partinfo *p;
+    struct hasher *h;
+    struct window *w;
+    int i, err;
+
+    if (!(h = calloc(1, sizeof(*h))))
+	return NULL;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, NULL);
+    h->sink.put = sink_put;
+    h->sink.skip = sink_skip;
+    h->head = head;
+    h->headsz = headsz;
+    h->tail = tail;
+    h->tailsz = tailsz;
+    h->size = size;
+    for (p = parts; p; p = p->next)
+	h->nparts++;
+    if (!(h->parts = calloc(h->nparts + 1, sizeof(struct partinfo))) ||
+	!(h->sums = calloc(h->nparts + 1, SHA256_BYTES)))
+	goto fail;
+    for (i = 0; i < HASH_SLOTS; i++)
+	if (!(h->ring[i].buf = malloc(HASH_BUFSZ)))
+	    goto fail;
+
+    /* sources that can only be read once are
+     * read back from the image once they are copied */
+    for (i = 0, p = parts; p; p = p->next, i++) {
+	h->parts[i] = *p;
+	h->parts[i].next = p->next ? &h->parts[i+1] : NULL;
+	h->parts[i].rd = NULL;
+	if (p->srcfd < 0 || (!p->pipe && !p->rd))
+	    continue;
+	if (imgfd < 0) {
+	    errno = EINVAL;
+	    goto fail;
+	}
+	if (!(w = calloc(1, sizeof(*w))))
+	    goto fail;
+	w->r.extents = window_extents;
+	w->r.read = window_read;
+	w->r.close = window_close;
+	w->h = h;
+	w->fd = imgfd;
+	w->base = p->startlba << 9;
+	w->len = p->srcsz;
+	h->parts[i].rd = &w->r;
+	h->parts[i].srcfd = imgfd;
+	h->parts[i].pipe = false;
+    }
+    h->cur = h->nparts ? h->parts : NULL;
+    sha256_init(&h->part);
+    sha256_init(&h->image);
+
+    if ((err = pthread_create(&h->imager, NULL, imager, h)) != 0) {
+	errno = err;
+	goto fail;
+    }
+    if ((err = pthread_create(&h->reader, NULL, reader, h)) != 0) {
+	pthread_mutex_lock(&h->lock);
+	h->eof = true;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+	pthread_join(h->imager, NULL);
+	errno = err;
+	goto fail;
+    }
+    return h;
+fail:
+    err = errno;
+    hash_free(h);
+    errno = err;
+    return NULL;
+}
+
+void
+hash_copied(struct hasher *h)
+{
+    pthread_mutex_lock(&h->lock);
+    h->copied = true;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->lock);
+}
+
+int
+hash_finish(struct hasher *h, unsigned char image[SHA256_BYTES],
+	    unsigned char (*parts)[SHA256_BYTES])
+{
+    int err;
+
+    pthread_join(h->reader, NULL);
+    pthread_join(h->imager, NULL);
+    err = h->err;
+    if (!err) {
+	sha256_final(&h->image, image);
+	memcpy(parts, h->sums, h->nparts * SHA256_BYTES);
+    }
+    hash_free(h);
+    return err ? rc(err) : 0;
+}
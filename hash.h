@@ -0,0 +1,38 @@
+#ifndef __HASH_H_
+#define __HASH_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "part.h"
+#include "sha256.h"
+
+struct hasher;
+
+/* hash_start() starts computing the SHA-256 of each partition
+ * (over its whole range, nsectors << 9 bytes) and of the whole
+ * 'size'-byte raw image laid out as in stream_image(), on two
+ * threads of its own, so that hashing overlaps the copy
+ *
+ * partitions with a plain source are hashed by reading the source,
+ * and holes are hashed as zeros without being read; partitions that
+ * can only be read once (pipes, and qcow2 or compressed sources) are
+ * read back from 'imgfd' after hash_copied() is called, or fail to
+ * hash with EINVAL if 'imgfd' is -1
+ *
+ * returns NULL with errno set on failure */
+struct hasher *hash_start(const unsigned char *head, size_t headsz,
+			  const unsigned char *tail, size_t tailsz,
+			  const struct partinfo *parts, off_t size, int imgfd);
+
+/* hash_copied() tells the hasher that every
+ * partition has been copied into the image */
+void hash_copied(struct hasher *h);
+
+/* hash_finish() waits for the hashes and stores the image
+ * hash in 'image' and the hash of each partition in list order
+ * in 'parts', then frees 'h'
+ *
+ * returns 0 on success or -1 with errno set */
+int hash_finish(struct hasher *h, unsigned char image[SHA256_BYTES],
+		unsigned char (*parts)[SHA256_BYTES]);
+
+#endif
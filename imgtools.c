@@ -0,0 +1,542 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "filesize.h"
+#include "imgtools.h"
+#include "blkdev.h"
+#include "qcow2.h"
+#include "stream.h"
+#include "sha256.h"
+#include "decomp.h"
+#include "fat.h"
+#include "tar.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define DEFAULT_DOS_LABEL "0x77777777"
+#define DEFAULT_GPT_LABEL "3782C3EE-1C16-F042-82A8-D6A40FB7CFAD"
+
+/* take a byte width 'w' and return its width
+ * in lbas, aligned to 'bits' (at least 9) */
+static int64_t
+lba_align(off_t w, int bits)
+{
+    return alignup((w+511)>>9, bits-9);
+}
+
+void
+img_init(struct img_layout *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->align = IMG_ALIGN_BITS;
+    l->lba = lba_align(1, IMG_ALIGN_BITS);
+    l->partnum = 1;
+}
+
+void
+img_free(struct img_layout *l)
+{
+    free_parts(&l->head);
+    l->tail = NULL;
+}
+
+int
+img_set_align(struct img_layout *l, int bits)
+{
+    if (bits < 9 || bits > 62)
+	return rc(EINVAL);
+    l->align = bits;
+    l->lba = alignup(l->lba, bits-9);
+    l->disksectors = alignup(l->disksectors, bits-9);
+    return 0;
+}
+
+int
+img_set_sectsize(struct img_layout *l, int ss)
+{
+    if (!sector_size_ok(ss))
+	return rc(EINVAL);
+    l->ssize = ss;
+    return 0;
+}
+
+void
+img_set_size(struct img_layout *l, off_t size)
+{
+    l->disksectors = lba_align(size, l->align);
+}
+
+void
+img_set_base(struct img_layout *l, off_t base)
+{
+    l->lba = lba_align(base, l->align);
+}
+
+int
+img_sectsize(const struct img_layout *l)
+{
+    return l->ssize ? l->ssize : 512;
+}
+
+int64_t
+img_trailer_sectors(const struct img_layout *l)
+{
+    return l->dos ? 0 : GPT_TRAILER_BYTES(img_sectsize(l)) >> 9;
+}
+
+/* append a partition of 'nsectors' sectors; the caller fills in its contents */
+static struct partinfo *
+add(struct img_layout *l, const char *kind, int64_t nsectors)
+{
+    struct partinfo *part;
+
+    if (!(part = calloc(1, sizeof(struct partinfo))))
+	return NULL;
+    part->srcfd = -1;
+    part->kind = kind;
+    part->startlba = l->lba;
+    part->nsectors = nsectors;
+    part->num = l->partnum++;
+    l->lba += nsectors;
+    if (l->tail)
+	l->tail->next = part;
+    else
+	l->head = part;
+    l->tail = part;
+    return part;
+}
+
+struct partinfo *
+img_add_empty(struct img_layout *l, const char *kind, off_t size)
+{
+    struct partinfo *part;
+
+    if (size < 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if ((part = add(l, kind, lba_align(size, l->align))))
+	part->srcsz = size;
+    return part;
+}
+
+struct partinfo *
+img_add_rest(struct img_layout *l, const char *kind)
+{
+    struct partinfo *part;
+    int64_t end;
+
+    end = l->disksectors - img_trailer_sectors(l);
+    if (!l->disksectors || l->lba >= end) {
+	errno = l->disksectors ? ENOSPC : EINVAL;
+	return NULL;
+    }
+    if ((part = add(l, kind, end - l->lba)))
+	part->srcsz = part->nsectors << 9;
+    return part;
+}
+
+struct partinfo *
+img_add_fat(struct img_layout *l, const char *kind, int dirfd, off_t size)
+{
+    struct partinfo *part;
+    struct srcreader *rd;
+    int e;
+
+    if (size < 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!(rd = fat_source(dirfd, &size, img_sectsize(l))))
+	return NULL;
+    if (!(part = add(l, kind, lba_align(size, l->align)))) {
+	e = errno;
+	rd->close(rd);
+	errno = e;
+	return NULL;
+    }
+    part->srcfd = dirfd;
+    part->srcsz = size;
+    part->rd = rd;
+    return part;
+}
+
+struct partinfo *
+img_add_fd(struct img_layout *l, const char *kind, int fd, int nthreads)
+{
+    struct partinfo *part;
+    struct srcreader *rd;
+    struct stat st;
+    bool pipe;
+    off_t size;
+    int e;
+
+    /* a directory becomes the smallest FAT32 filesystem that holds it */
+    if (fstat(fd, &st) < 0)
+	return NULL;
+    if (S_ISDIR(st.st_mode))
+	return img_add_fat(l, kind, fd, 0);
+    pipe = false;
+    /* qcow2 images are read through their cluster tables */
+    if (!(rd = qcow2_source(fd, &size)) && errno != EINVAL)
+	return NULL;
+    /* compressed files are decompressed as they are copied */
+    if (!rd && (rd = decomp_source(fd, &size, nthreads))) {
+	if (size < 0) {
+	    rd->close(rd);
+	    errno = ENODATA;
+	    return NULL;
+	}
+	pipe = true;
+    } else if (!rd && errno != EINVAL) {
+	return NULL;
+    }
+    if (!rd && (size = fdsize(fd)) < 0)
+	return NULL;
+    if (!(part = add(l, kind, lba_align(size, l->align)))) {
+	e = errno;
+	if (rd)
+	    rd->close(rd);
+	errno = e;
+	return NULL;
+    }
+    part->srcfd = fd;
+    part->srcsz = size;
+    part->rd = rd;
+    part->pipe = pipe;
+    return part;
+}
+
+struct partinfo *
+img_add_member(struct img_layout *l, const char *kind, struct tarindex *t, const char *name)
+{
+    struct partinfo *part;
+    struct srcreader *rd;
+    off_t size;
+    int e;
+
+    if (!(rd = tar_source(t, name, &size)))
+	return NULL;
+    if (!(part = add(l, kind, lba_align(size, l->align)))) {
+	e = errno;
+	rd->close(rd);
+	errno = e;
+	return NULL;
+    }
+    part->srcfd = tar_fd(t);
+    part->srcsz = size;
+    part->rd = rd;
+    return part;
+}
+
+struct partinfo *
+img_add_pipe(struct img_layout *l, const char *kind, int fd, off_t size, int nthreads)
+{
+    struct srcreader *rd;
+    struct partinfo *part;
+    struct stat st;
+    int e;
+
+    if (size < 0 || fstat(fd, &st) < 0) {
+	if (size < 0)
+	    errno = EINVAL;
+	return NULL;
+    }
+    /* a compressed file with an explicit size */
+    rd = NULL;
+    if (S_ISREG(st.st_mode) && !(rd = decomp_source(fd, NULL, nthreads)) && errno != EINVAL)
+	return NULL;
+    if (!(part = add(l, kind, lba_align(size, l->align)))) {
+	e = errno;
+	if (rd)
+	    rd->close(rd);
+	errno = e;
+	return NULL;
+    }
+    part->srcfd = fd;
+    part->srcsz = size;
+    part->rd = rd;
+    part->pipe = true;
+    return part;
+}
+
+int
+img_done(struct img_layout *l)
+{
+    int64_t lba;
+
+    /* partitions have to start and end on logical sectors */
+    if (1L << l->align < img_sectsize(l))
+	return rc(EINVAL);
+    /* now we know the full size of the image: */
+    lba = l->lba + img_trailer_sectors(l);
+    if (lba < 0)
+	return rc(EOVERFLOW);
+    if (!l->disksectors)
+	l->disksectors = alignup(lba, l->align-9);
+    else if (lba > l->disksectors)
+	return rc(ENOSPC);
+    /* the output ought to be deterministic, so pick a uuid: */
+    if (!l->uuid)
+	l->uuid = l->dos ? DEFAULT_DOS_LABEL : DEFAULT_GPT_LABEL;
+    return 0;
+}
+
+/* the MBR of a DOS disk with signature 'label' */
+static int
+dosmbr(unsigned char *mbr, const char *label, struct partinfo *lst, int ss)
+{
+    unsigned long sig;
+
+    errno = 0;
+    sig = strtoul(label, NULL, 0);
+    if (errno || sig > 0xffffffff)
+	return rc(errno ? errno : EINVAL);
+    memset(mbr, 0, 512);
+    put_le32(mbr + 440, (uint32_t)sig);
+    return mbr_write_parts(mbr, lst, ss);
+}
+
+int
+img_table(const struct img_layout *l, const char *label,
+	  unsigned char *header, size_t *headsz, unsigned char *trailer, size_t *tailsz)
+{
+    int ss = img_sectsize(l);
+
+    if (!label)
+	label = l->uuid;
+    if (l->dos) {
+	if (dosmbr(header, label, l->head, ss) < 0)
+	    return -1;
+	*headsz = 512;
+	*tailsz = 0;
+	return 0;
+    }
+    if (gpt_format(l->head, label, l->disksectors, ss, header, trailer) < 0)
+	return -1;
+    *headsz = GPT_HEADER_BYTES(ss);
+    *tailsz = GPT_TRAILER_BYTES(ss);
+    return 0;
+}
+
+static int
+put(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len) {
+	if ((n = pwrite(fd, buf, len, off)) <= 0)
+	    return n < 0 ? -1 : rc(EIO);
+	buf += n;
+	len -= (size_t)n;
+	off += n;
+    }
+    return 0;
+}
+
+int
+img_put_table(int fd, bool sync, const unsigned char *header, size_t headsz,
+	      const unsigned char *trailer, size_t tailsz, int64_t sectors)
+{
+    if (sync && fdatasync(fd) < 0)
+	return -1;
+    if (put(fd, header, headsz, 0) < 0 ||
+	put(fd, trailer, tailsz, (sectors << 9) - (off_t)tailsz) < 0)
+	return -1;
+    if (sync && fdatasync(fd) < 0)
+	return -1;
+    return 0;
+}
+
+int
+img_zero_gaps(int fd, const struct img_layout *l, off_t devsize)
+{
+    const struct partinfo *p;
+    off_t off, end;
+    int ss;
+
+    ss = img_sectsize(l);
+    off = l->dos ? 512 : GPT_HEADER_BYTES(ss);
+    end = (l->disksectors - img_trailer_sectors(l)) << 9;
+    for (p = l->head; p; p = p->next) {
+	if ((p->startlba << 9) > off && blk_zero(fd, off, (p->startlba << 9) - off) < 0)
+	    return -1;
+	off = (p->startlba + p->nsectors) << 9;
+    }
+    if (end > off && blk_zero(fd, off, end - off) < 0)
+	return -1;
+
+    /* an old backup GPT may overlap the end of the image */
+    off = devsize - GPT_RESERVE(ss);
+    if (off < end)
+	off = end;
+    if (devsize <= off)
+	return 0;
+    return blk_zero(fd, off, devsize - off);
+}
+
+int
+img_use_disk(struct img_layout *l, int fd)
+{
+    off_t size;
+    int ss;
+
+    if ((size = fdsize(fd)) < 0 || (ss = fdsectsize(fd, l->ssize)) < 0)
+	return -1;
+    l->ssize = ss;
+    if (!l->disksectors)
+	l->disksectors = size / ss * (ss >> 9);
+    return 0;
+}
+
+int
+img_prepare(const struct img_layout *l, int fd, bool over)
+{
+    struct stat st;
+    off_t size, devsize;
+
+    size = l->disksectors << 9;
+    if (fstat(fd, &st) < 0 || (devsize = fdsize(fd)) < 0)
+	return -1;
+    if (devsize < size) {
+	if (!S_ISREG(st.st_mode))
+	    return rc(ENOSPC);
+	if (ftruncate(fd, size) < 0)
+	    return -1;
+    }
+    return over ? img_zero_gaps(fd, l, devsize) : 0;
+}
+
+int
+img_write(const struct img_layout *l, int fd, const struct copyopts *opts)
+{
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    size_t headsz, tailsz;
+
+    if (img_prepare(l, fd, false) < 0 ||
+	img_table(l, NULL, header, &headsz, trailer, &tailsz) < 0)
+	return -1;
+    /* with sync, the table goes last */
+    if (!opts->wb.sync && img_put_table(fd, false, header, headsz, trailer, tailsz, l->disksectors) < 0)
+	return -1;
+    if (copy_parts(fd, l->head, opts) < 0)
+	return -1;
+    if (opts->wb.sync && img_put_table(fd, true, header, headsz, trailer, tailsz, l->disksectors) < 0)
+	return -1;
+    return 0;
+}
+
+int
+img_write_all(struct img_layout *ls, struct copyimage *imgs, int n, const struct copyopts *opts)
+{
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    size_t headsz, tailsz;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if (img_prepare(&ls[i], imgs[i].fd, false) < 0)
+	    return -1;
+	imgs[i].parts = ls[i].head;
+    }
+    if (copy_images(imgs, n, opts) < 0)
+	return -1;
+    for (i = 0; i < n; i++)
+	if (img_table(&ls[i], NULL, header, &headsz, trailer, &tailsz) < 0 ||
+	    img_put_table(imgs[i].fd, opts->wb.sync, header, headsz, trailer, tailsz, ls[i].disksectors) < 0)
+	    return -1;
+    return 0;
+}
+
+int
+img_stream(const struct img_layout *l, int fd, const struct qcow2opts *qopts)
+{
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    size_t headsz, tailsz;
+    off_t size;
+
+    size = l->disksectors << 9;
+    if (img_table(l, NULL, header, &headsz, trailer, &tailsz) < 0)
+	return -1;
+    if (qopts)
+	return qcow2_image(fd, header, headsz, trailer, tailsz, l->head, size, qopts);
+    return stream_image(fd, header, headsz, trailer, tailsz, l->head, size);
+}
+
+void
+img_clone_label(const struct img_layout *l, int n, char *out, size_t len)
+{
+    unsigned char h[SHA256_BYTES];
+    struct sha256 s;
+    char num[16];
+
+    snprintf(num, sizeof(num), ":%d", n);
+    sha256_init(&s);
+    sha256_update(&s, l->uuid, strlen(l->uuid));
+    sha256_update(&s, num, strlen(num));
+    sha256_final(&s, h);
+    if (l->dos) {
+	snprintf(out, len, "0x%02x%02x%02x%02x", h[0], h[1], h[2], h[3]);
+	return;
+    }
+    h[6] = (h[6] & 0x0f) | 0x40;
+    h[8] = (h[8] & 0x3f) | 0x80;
+    snprintf(out, len, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+	     h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+	     h[8], h[9], h[10], h[11], h[12], h[13], h[14], h[15]);
+}
+
+int
+img_clone(const struct img_layout *l, int srcfd, struct copyimage *imgs, int count,
+	  const struct copyopts *copts)
+{
+    unsigned char header[GPT_HEADER_BYTES(SECTOR_MAX)];
+    unsigned char trailer[GPT_TRAILER_BYTES(SECTOR_MAX)];
+    struct copyopts opts = *copts;
+    struct partinfo *whole;
+    size_t headsz, tailsz;
+    char label[40];
+    int i, ret, e;
+
+    if (!(whole = calloc(count, sizeof(*whole))))
+	return -1;
+    ret = -1;
+    for (i = 0; i < count; i++) {
+	/* the whole image is the one 'partition' of each clone */
+	whole[i].kind = "";
+	whole[i].srcfd = srcfd;
+	whole[i].srcsz = l->disksectors << 9;
+	whole[i].nsectors = l->disksectors;
+	whole[i].hidden = true;
+	imgs[i].parts = &whole[i];
+	if (ftruncate(imgs[i].fd, l->disksectors << 9) < 0)
+	    goto out;
+    }
+    opts.stats = NULL;
+    opts.zerofill = false;
+    if (copy_images(imgs, count, &opts) < 0)
+	goto out;
+    for (i = 0; i < count; i++) {
+	img_clone_label(l, i + 1, label, sizeof(label));
+	if (img_table(l, label, header, &headsz, trailer, &tailsz) < 0 ||
+	    img_put_table(imgs[i].fd, copts->wb.sync, header, headsz, trailer, tailsz, l->disksectors) < 0)
+	    goto out;
+    }
+    ret = 0;
+out:
+    e = errno;
+    for (i = 0; i < count; i++)
+	imgs[i].parts = NULL;
+    free(whole);
+    errno = e;
+    return ret;
+}
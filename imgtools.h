@@ -0,0 +1,155 @@
+#ifndef __IMGTOOLS_H_
+#define __IMGTOOLS_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "part.h"
+#include "gpt.h"
+#include "mbr.h"
+#include "copy.h"
+#include "tar.h"
+#include "qcow2.h"
+
+/* libimgtools lays out and writes GPT and DOS disk
+ * images in-process, the way gptimage(1) does
+ *
+ * functions return -1 (or NULL) with errno set on failure, and
+ * nothing here exits; copy_parts() still reports the engines it
+ * used, and anything that went wrong, on stderr
+ *
+ * sources are passed as file descriptors (files, memfds, block
+ * devices, pipes), which remain the caller's to close */
+
+#define IMG_ALIGN_BITS 20 /* 1MiB */
+
+/* the layout of one disk */
+struct img_layout {
+    bool dos;              /* DOS partition table instead of GPT */
+    int align;             /* partition alignment, in bits */
+    int ssize;             /* logical sector size, or 0 if not given */
+    int64_t lba;           /* where the next partition goes */
+    int64_t disksectors;   /* size of the disk, or 0 to fit the partitions */
+    const char *uuid;      /* disk GUID (or DOS signature), or NULL */
+    struct partinfo *head, *tail;
+    int partnum;           /* number of the next partition */
+};
+
+/* img_init() starts an empty GPT layout aligned to IMG_ALIGN_BITS */
+void img_init(struct img_layout *l);
+
+/* img_free() frees the partitions of 'l' (but doesn't close their sources) */
+void img_free(struct img_layout *l);
+
+/* the setters apply to partitions added afterwards, as the
+ * options of gptimage(1) do: img_set_align() fails with EINVAL
+ * below 9 bits, and img_set_sectsize() for anything other than a
+ * power of two from 512 to SECTOR_MAX; sizes are in bytes, rounded
+ * up to the alignment */
+int img_set_align(struct img_layout *l, int bits);
+int img_set_sectsize(struct img_layout *l, int ss);
+void img_set_size(struct img_layout *l, off_t size);
+void img_set_base(struct img_layout *l, off_t base);
+
+/* the logical sector size of the disk, and the
+ * 512-byte sectors at its end taken up by the backup GPT */
+int img_sectsize(const struct img_layout *l);
+int64_t img_trailer_sectors(const struct img_layout *l);
+
+/* the img_add functions append a partition of type 'kind' (which
+ * must outlive 'l') and return it:
+ *
+ *  - img_add_empty(): 'size' bytes with no contents
+ *  - img_add_rest(): no contents, up to the end of the disk,
+ *    whose size must have been set (EINVAL) and not yet be
+ *    used up (ENOSPC)
+ *  - img_add_fd(): the contents of 'fd'; qcow2 images and gzip,
+ *    xz and zstd files are read as the image they hold, and a
+ *    compressed file whose size can't be told fails with ENODATA;
+ *    a directory is img_add_fat() with a 'size' of 0
+ *  - img_add_fat(): a FAT32 filesystem of 'size' bytes (0 for
+ *    as small as possible) holding the tree under the directory
+ *    'dirfd', with errors as for fat_source() in fat.h
+ *  - img_add_member(): the file 'name' in the tar archive indexed
+ *    by 't' (see tar.h), copied straight from the archive; its
+ *    srcfd is the archive's
+ *  - img_add_pipe(): up to 'size' bytes read in order from 'fd'
+ *    (which is decompressed if it is a compressed file)
+ *
+ * 'nthreads' is how many threads may decompress xz */
+struct partinfo *img_add_empty(struct img_layout *l, const char *kind, off_t size);
+struct partinfo *img_add_rest(struct img_layout *l, const char *kind);
+struct partinfo *img_add_fd(struct img_layout *l, const char *kind, int fd, int nthreads);
+struct partinfo *img_add_fat(struct img_layout *l, const char *kind, int dirfd, off_t size);
+struct partinfo *img_add_member(struct img_layout *l, const char *kind, struct tarindex *t, const char *name);
+struct partinfo *img_add_pipe(struct img_layout *l, const char *kind, int fd, off_t size, int nthreads);
+
+/* img_done() settles the size and label of the disk once every
+ * partition has been added; it fails with EINVAL if the alignment
+ * is below the sector size, and ENOSPC if the partitions don't
+ * fit in the size that was set */
+int img_done(struct img_layout *l);
+
+/* img_table() builds the partition table of a finished layout,
+ * with disk label 'label' (or l->uuid if NULL): the first 'headsz'
+ * bytes of 'header' (GPT_HEADER_BYTES(SECTOR_MAX)) go at the start
+ * of the disk, and the first 'tailsz' bytes of 'trailer'
+ * (GPT_TRAILER_BYTES(SECTOR_MAX)) at the end */
+int img_table(const struct img_layout *l, const char *label,
+	      unsigned char *header, size_t *headsz, unsigned char *trailer, size_t *tailsz);
+
+/* img_put_table() writes a table from img_table() into the disk
+ * 'fd' of 'sectors' 512-byte sectors; with 'sync' it is written
+ * between two fdatasync()s, so that it never reaches the disk
+ * ahead of the data it points at */
+int img_put_table(int fd, bool sync, const unsigned char *header, size_t headsz,
+		  const unsigned char *trailer, size_t tailsz, int64_t sectors);
+
+/* img_zero_gaps() makes everything in the existing disk 'fd'
+ * of 'devsize' bytes that isn't part of a partition or the
+ * partition table of 'l' read as zeros, including any old
+ * backup GPT at the end of a disk larger than the image */
+int img_zero_gaps(int fd, const struct img_layout *l, off_t devsize);
+
+/* img_use_disk() is for writing over the existing disk 'fd':
+ * 'l' takes the disk's logical sector size, failing with EINVAL
+ * if a different one was set, and unless a size was set, the size
+ * of the disk in whole sectors */
+int img_use_disk(struct img_layout *l, int fd);
+
+/* img_prepare() gets the disk 'fd' ready for the finished layout
+ * 'l': a regular file smaller than the image is extended, and a
+ * device that is too small fails with ENOSPC; with 'over', whatever
+ * the disk held outside the partitions is zeroed (img_zero_gaps()),
+ * and the partitions must be copied with copyopts.zerofill set */
+int img_prepare(const struct img_layout *l, int fd, bool over);
+
+/* img_write() writes the finished layout 'l' into 'fd' as a raw
+ * image: the partition table and the contents of every partition,
+ * copied as opts says; a regular file is extended to the size of
+ * the image, but its existing contents are assumed to be zeros */
+int img_write(const struct img_layout *l, int fd, const struct copyopts *opts);
+
+/* img_write_all() is img_write() for the 'n' finished layouts
+ * 'ls' at once, into the fd of each of 'imgs' (whose parts it
+ * sets), copied on one pool of workers as copy_images() does */
+int img_write_all(struct img_layout *ls, struct copyimage *imgs, int n, const struct copyopts *opts);
+
+/* img_stream() writes the finished layout 'l' into 'fd' front
+ * to back as stream_image() does, so 'fd' may be a pipe, or as a
+ * qcow2 image (see qcow2_image()) if 'qopts' isn't NULL */
+int img_stream(const struct img_layout *l, int fd, const struct qcow2opts *qopts);
+
+/* img_clone_label() writes the label of clone 'n' (from 1) of 'l'
+ * to 'out': a hash of l->uuid and 'n', formatted as a version 4
+ * GUID or a DOS signature, so that the clones differ from each
+ * other but rebuilding produces the same ones */
+void img_clone_label(const struct img_layout *l, int n, char *out, size_t len);
+
+/* img_clone() copies the raw image of 'l' in 'srcfd' into the fd
+ * of each of the 'count' images 'imgs', sharing the data with
+ * FICLONERANGE where the filesystem can, and gives clone i a table
+ * of its own labelled img_clone_label(l, i+1) */
+int img_clone(const struct img_layout *l, int srcfd, struct copyimage *imgs, int count,
+	      const struct copyopts *opts);
+
+#endif
@@ -11,8 +11,9 @@
 #define rc(e) (errno=(e), -1)
 
 static int
-mbr_entry(unsigned char *desc, struct partinfo *info)
+mbr_entry(unsigned char *desc, struct partinfo *info, int ss)
 {
+    int64_t k = ss >> 9;
 
     assert(!info->hidden);
     assert(info->num > 0 && info->num <= 4);
@@ -39,23 +40,29 @@ mbr_entry(unsigned char *desc, struct partinfo *info)
     desc[6] = 0xff;
     desc[7] = 0xff;
 
-    if (info->startlba > 0xffffffff || info->startlba < 1)
+    if ((info->startlba | info->nsectors) & (k-1)) {
+	warnf("partition %d isn't aligned to %d-byte sectors\n", info->num, ss);
+	return rc(EINVAL);
+    }
+    if (info->startlba/k > 0xffffffff || info->startlba < 1)
 	return rc(ERANGE);
-    if (info->nsectors > 0xffffffff || info->nsectors < 0)
+    if (info->nsectors/k > 0xffffffff || info->nsectors < 0)
 	return rc(ERANGE);
 
-    put_le32(desc + 8, (uint32_t)info->startlba);
-    put_le32(desc + 12, (uint32_t)info->nsectors);
+    put_le32(desc + 8, (uint32_t)(info->startlba/k));
+    put_le32(desc + 12, (uint32_t)(info->nsectors/k));
     return 0;
 }
 
 int
-mbr_write_parts(unsigned char *mbr, struct partinfo *parts)
+mbr_write_parts(unsigned char *mbr, struct partinfo *parts, int ss)
 {
     unsigned char *ptable;
     struct partinfo *head;
     int nrp, err;
 
+    if (!sector_size_ok(ss))
+	return rc(EINVAL);
     nrp = 0;
     for (head = parts; head; head = head->next) {
 	if (head->hidden)
@@ -79,7 +86,7 @@ mbr_write_parts(unsigned char *mbr, struct partinfo *parts)
     nrp = 0;
     ptable = mbr + MBR_PART1_OFFSET;
     for (head = parts; head; head = head->next)
-	if (!head->hidden && (err = mbr_entry(ptable + (16 * (head->num - 1)), head)))
+	if (!head->hidden && (err = mbr_entry(ptable + (16 * (head->num - 1)), head, ss)))
 	    return err;
 
     mbr[510] = 0x55;
@@ -88,7 +95,7 @@ mbr_write_parts(unsigned char *mbr, struct partinfo *parts)
 }
 
 static struct partinfo *
-read_mbr_partitions(unsigned char *mbr, int *nparts)
+read_mbr_partitions(unsigned char *mbr, int ss, int *nparts)
 {
     struct partinfo *head, *tail, *part;
     unsigned char *desc;
@@ -123,8 +130,8 @@ read_mbr_partitions(unsigned char *mbr, int *nparts)
 	    break;
 	}
 	part = calloc(sizeof(struct partinfo), 1);
-	part->startlba = (int64_t)get_le32(desc + 8);
-	part->nsectors = (int64_t)get_le32(desc + 12);
+	part->startlba = (int64_t)get_le32(desc + 8) * (ss>>9);
+	part->nsectors = (int64_t)get_le32(desc + 12) * (ss>>9);
 	part->kind = kind;
 	part->dc = desc[4];
 	part->num = i+1;
@@ -143,13 +150,18 @@ read_mbr_partitions(unsigned char *mbr, int *nparts)
 }
 
 int
-mbr_add_lastpart(unsigned char *mbr, int num, int64_t nlbas, long long *start, long long *length)
+mbr_add_lastpart(unsigned char *mbr, int num, int64_t nlbas, int ss,
+		 long long *start, long long *length)
 {
     struct partinfo *parts, *tail = NULL;
     int64_t lba, sectors;
     int err, nparts = 0;
 
-    parts = read_mbr_partitions(mbr, &nparts);
+    if (!sector_size_ok(ss))
+	return rc(EINVAL);
+    /* the disk ends at its last whole logical sector */
+    nlbas &= ~(int64_t)((ss>>9)-1);
+    parts = read_mbr_partitions(mbr, ss, &nparts);
     if (parts == NULL && errno)
 	return rc(errno);
     if (nparts == 4) {
@@ -163,7 +175,7 @@ mbr_add_lastpart(unsigned char *mbr, int num, int64_t nlbas, long long *start, l
     }
     num = nparts+1;
 
-    if ((err = check_parts(parts, nlbas)))
+    if ((err = check_parts(parts, nlbas, ss)))
 	goto done;
 
     if (parts) {
@@ -191,7 +203,7 @@ mbr_add_lastpart(unsigned char *mbr, int num, int64_t nlbas, long long *start, l
     tail->dc = 0x83;
     tail->num = num;
     err = 0;
-    if (mbr_write_parts(mbr, parts) < 0) {
+    if (mbr_write_parts(mbr, parts, ss) < 0) {
 	err = errno;
     } else {
 	if (start)
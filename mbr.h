@@ -25,20 +25,23 @@ get_le32(const unsigned char *src)
 }
 
 /* mbr_add_lastpart() appends a partition to 'mbr'
- * that consumes all remaining diskspace
+ * that consumes all remaining diskspace; 'numlbas'
+ * is the size of the disk in 512-byte sectors and
+ * 'ss' is its logical sector size
  *
  * the mbr must have at least one and no more than three
  * partitions already active 
  *
  * BUGS: currently ignores EBR parts */
-int mbr_add_lastpart(unsigned char *mbr, int part, int64_t numlbas,
+int mbr_add_lastpart(unsigned char *mbr, int part, int64_t numlbas, int ss,
 		     long long *start, long long *length);
 
 /* mbr_write_parts() writes a list of partitions
- * to mbr as a DOS partition table; it leaves all but
- * the partition table and magic bits untouched
+ * to mbr as a DOS partition table in logical sectors
+ * of 'ss' bytes; it leaves all but the partition table
+ * and magic bits untouched
  *
  * BUGS: currently can only write primary partitions */
-int mbr_write_parts(unsigned char *mbr, struct partinfo *parts);
+int mbr_write_parts(unsigned char *mbr, struct partinfo *parts, int ss);
 
 #endif
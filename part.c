@@ -66,7 +66,7 @@ dump_parts(const struct partinfo *head)
 }
 
 int
-check_parts(const struct partinfo *head, int64_t nlbas)
+check_parts(const struct partinfo *head, int64_t nlbas, int ss)
 {
     const struct partinfo *p, *n;
     int i, err = 0;
@@ -78,6 +78,10 @@ check_parts(const struct partinfo *head, int64_t nlbas)
 	    warnf("partition %d doesn't fit in %ll\n", p->num, p->num+1, (long long)nlbas);
 	    err = -EINVAL;
 	}
+	if ((p->startlba | p->nsectors) & ((ss>>9)-1)) {
+	    warnf("partition %d isn't aligned to %d-byte sectors\n", p->num, ss);
+	    err = -EINVAL;
+	}
 	if (p->next && overlap(p, p->next)) {
 	    warnf("partition %d overlaps with next parition\n", p->num);
 	    err = -EINVAL;
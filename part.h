@@ -5,21 +5,39 @@
 #include <stdint.h>    /* uint8_t */
 #include <sys/types.h> /* off_t */
 #include <stdbool.h>
+#include "source.h"
 
 #define warnf(e, ...) dprintf(2, e, __VA_ARGS__)
 
+/* partitions are always laid out in 512-byte sectors;
+ * the partition tables are written in logical sectors
+ * of 'ss' bytes, a power of two no larger than SECTOR_MAX */
+#define SECTOR_MAX 4096
+
+static inline bool
+sector_size_ok(int ss)
+{
+    return ss >= 512 && ss <= SECTOR_MAX && !(ss & (ss-1));
+}
+
 struct partinfo;
 
 struct partinfo {
     struct partinfo *next; /* next partition */    
     const char *kind;      /* type string (usually "L" or "U"); corresponds to EFI type */
     off_t   srcsz;         /* size of partition image (always <= partsz) */
-    int64_t startlba;      /* starting LBA */
-    int64_t nsectors;      /* size in sectors */
+    int64_t startlba;      /* starting LBA (in 512-byte sectors) */
+    int64_t nsectors;      /* size in 512-byte sectors */
     int   srcfd;           /* source image */
     int   num;             /* partition number (only valid if !hidden) */
     uint8_t dc;            /* dos partition type; only used for DOS partition tables */
     bool  hidden;          /* area is reserved but not an actual partition */
+    bool  pipe;            /* the contents must be read in order (srcfd is a pipe
+			    * or FIFO, or rd decompresses); srcsz is the most
+			    * they may amount to */
+    struct srcreader *rd;  /* reads the contents in place of srcfd, or NULL */
+    const struct extmap *map; /* data extents of the contents, if they are
+			       * already known (they are found otherwise) */
 };
 
 static inline struct partinfo *
@@ -37,6 +55,8 @@ free_parts(struct partinfo **head)
 	return;
     if ((*head)->next)
 	free_parts(&(*head)->next);
+    if ((*head)->rd)
+	(*head)->rd->close((*head)->rd);
     free(*head);
     *head = NULL;
 }
@@ -44,8 +64,9 @@ free_parts(struct partinfo **head)
 int kernel_add_part(int fd, int pnum, long long start, long long length);
 
 /* check_parts() checks a list of partitions
- * for sanity and returns a (negative) error
- * if something looks wrong */
-int check_parts(const struct partinfo *head, int64_t nlbas);
+ * for sanity (including alignment to logical
+ * sectors of 'ss' bytes) and returns a (negative)
+ * error if something looks wrong */
+int check_parts(const struct partinfo *head, int64_t nlbas, int ss);
 
 #endif
@@ -0,0 +1,730 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include "filesize.h"
+#include "part.h"
+#include "zero.h"
+#include "stream.h"
+#include "extent.h"
+#include "source.h"
+#include "qcow2.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define QCOW2_MAGIC   0x514649fb /* "QFI\xfb" */
+#define HEADER_LENGTH 104
+
+#define CLUSTER_BITS   16
+#define CLUSTER_SIZE   (1L << CLUSTER_BITS)
+#define L2_ENTRIES     (CLUSTER_SIZE / 8)
+#define REFS_PER_BLOCK (CLUSTER_SIZE / 2) /* refcount_order 4 */
+
+#define OFLAG_COPIED     (1ULL << 63)
+#define OFLAG_COMPRESSED (1ULL << 62)
+#define OFLAG_ZERO       (1ULL << 0)
+#define OFFSET_MASK      0x00fffffffffffe00ULL
+#define CSIZE_SHIFT      (62 - (CLUSTER_BITS - 8))
+
+/* incompatible feature bits */
+#define INCOMPAT_DIRTY    (1ULL << 0)
+#define INCOMPAT_CORRUPT  (1ULL << 1)
+#define INCOMPAT_DATAFILE (1ULL << 2)
+#define INCOMPAT_COMPTYPE (1ULL << 3)
+#define INCOMPAT_EXTL2    (1ULL << 4)
+
+/* clusters are collected (and compressed) in batches of this many */
+#define BATCH 256
+
+static const unsigned char zeros[CLUSTER_SIZE];
+
+struct qsink {
+    struct sink sink;      /* must be first */
+    int fd;
+    int nthreads;
+    bool compress;
+    unsigned char *in;     /* BATCH clusters of image data */
+    unsigned char *out;    /* compressed copy of each cluster in 'in' */
+    size_t outlen[BATCH];  /* compressed length, or 0 to store it as-is */
+    int64_t guest[BATCH];  /* image cluster number of each cluster in 'in' */
+    int nbatch;            /* number of complete clusters in 'in' */
+    size_t fill;           /* bytes in the cluster after those */
+    int64_t next;          /* image cluster number of that cluster */
+    uint64_t **l2;         /* l1size L2 tables, allocated on demand */
+    int64_t l1size;
+    off_t hoff;            /* end of the data written so far */
+    uint16_t *refs;        /* refcount of each host cluster */
+    int64_t nrefs;         /* length of refs */
+};
+
+static inline void
+put_be16(unsigned char *dst, uint16_t v)
+{
+    dst[0] = v >> 8;
+    dst[1] = v;
+}
+
+static inline void
+put_be32(unsigned char *dst, uint32_t v)
+{
+    put_be16(dst, v >> 16);
+    put_be16(dst + 2, v);
+}
+
+static inline void
+put_be64(unsigned char *dst, uint64_t v)
+{
+    put_be32(dst, v >> 32);
+    put_be32(dst + 4, v);
+}
+
+/* make room for the refcount of host cluster 'c' */
+static int
+ref_grow(struct qsink *q, int64_t c)
+{
+    uint16_t *n;
+    int64_t cap;
+
+    if (c < q->nrefs)
+	return 0;
+    for (cap = q->nrefs ? q->nrefs : 1024; cap <= c; cap *= 2)
+	;
+    if (!(n = realloc(q->refs, cap*sizeof(uint16_t))))
+	return -1;
+    memset(n + q->nrefs, 0, (cap - q->nrefs)*sizeof(uint16_t));
+    q->refs = n;
+    q->nrefs = cap;
+    return 0;
+}
+
+static inline uint32_t
+get_be32(const unsigned char *src)
+{
+    return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+	((uint32_t)src[2] << 8) | src[3];
+}
+
+static inline uint64_t
+get_be64(const unsigned char *src)
+{
+    return ((uint64_t)get_be32(src) << 32) | get_be32(src + 4);
+}
+
+/* add one reference to each host cluster in [lo, hi] */
+static int
+ref_add(struct qsink *q, int64_t lo, int64_t hi)
+{
+    if (ref_grow(q, hi) < 0)
+	return -1;
+    for (; lo <= hi; lo++)
+	q->refs[lo]++;
+    return 0;
+}
+
+static int
+l2_set(struct qsink *q, int64_t guest, uint64_t entry)
+{
+    uint64_t **t;
+
+    t = &q->l2[guest / L2_ENTRIES];
+    if (!*t && !(*t = calloc(L2_ENTRIES, sizeof(uint64_t))))
+	return -1;
+    (*t)[guest % L2_ENTRIES] = entry;
+    return 0;
+}
+
+static int
+pwritev_all(int fd, struct iovec *iov, int n, off_t off)
+{
+    ssize_t w;
+
+    while (n) {
+	w = pwritev(fd, iov, n > IOV_MAX ? IOV_MAX : n, off);
+	if (w < 0 && errno == EINTR)
+	    continue;
+	if (w <= 0)
+	    return w < 0 ? -1 : rc(EIO);
+	off += w;
+	while (n && (size_t)w >= iov->iov_len) {
+	    w -= iov->iov_len;
+	    iov++;
+	    n--;
+	}
+	if (n) {
+	    iov->iov_base = (char *)iov->iov_base + w;
+	    iov->iov_len -= w;
+	}
+    }
+    return 0;
+}
+
+struct zjob {
+    struct qsink *q;
+    int first;
+    int err;
+};
+
+/* compress every nthreads'th cluster of the batch, starting at 'first';
+ * qcow2 uses raw deflate with a 4KiB window */
+static void *
+zworker(void *arg)
+{
+    struct zjob *j = arg;
+    struct qsink *q = j->q;
+    z_stream z = {0};
+    int i;
+
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+	j->err = ENOMEM;
+	return NULL;
+    }
+    for (i = j->first; i < q->nbatch; i += q->nthreads) {
+	deflateReset(&z);
+	z.next_in = q->in + (size_t)i*CLUSTER_SIZE;
+	z.avail_in = CLUSTER_SIZE;
+	z.next_out = q->out + (size_t)i*CLUSTER_SIZE;
+	z.avail_out = CLUSTER_SIZE - 512;
+	q->outlen[i] = 0;
+	if (deflate(&z, Z_FINISH) == Z_STREAM_END)
+	    q->outlen[i] = z.total_out;
+    }
+    deflateEnd(&z);
+    return NULL;
+}
+
+static int
+compress_batch(struct qsink *q)
+{
+    struct zjob jobs[q->nthreads];
+    pthread_t tids[q->nthreads];
+    int i, n, e;
+
+    for (i=0; i<q->nthreads; i++) {
+	jobs[i].q = q;
+	jobs[i].first = i;
+	jobs[i].err = 0;
+    }
+    for (n=1; n<q->nthreads && n<q->nbatch; n++)
+	if (pthread_create(&tids[n], NULL, zworker, &jobs[n]) != 0)
+	    break;
+    /* any stride that didn't get a thread is compressed here */
+    for (i=n; i<q->nthreads && i<q->nbatch; i++)
+	zworker(&jobs[i]);
+    zworker(&jobs[0]);
+    for (i=1; i<n; i++)
+	pthread_join(tids[i], NULL);
+    for (e=0, i=0; i<q->nthreads; i++)
+	if (jobs[i].err)
+	    e = jobs[i].err;
+    return e ? rc(e) : 0;
+}
+
+/* write out the batch, packing compressed clusters
+ * back to back and storing the rest on cluster boundaries */
+static int
+flush_batch(struct qsink *q)
+{
+    struct iovec iov[2*BATCH];
+    off_t start, off, pad;
+    int i, n;
+
+    if (!q->nbatch)
+	return 0;
+    if (q->compress && compress_batch(q) < 0)
+	return -1;
+    n = 0;
+    start = off = q->hoff;
+    for (i=0; i<q->nbatch; i++) {
+	if (q->compress && q->outlen[i]) {
+	    iov[n].iov_base = q->out + (size_t)i*CLUSTER_SIZE;
+	    iov[n++].iov_len = q->outlen[i];
+	    if (l2_set(q, q->guest[i], OFLAG_COMPRESSED | (off & ((1ULL << CSIZE_SHIFT)-1)) |
+		       ((uint64_t)(((off + q->outlen[i] - 1) >> 9) - (off >> 9)) << CSIZE_SHIFT)) < 0 ||
+		ref_add(q, off >> CLUSTER_BITS, (off + q->outlen[i] - 1) >> CLUSTER_BITS) < 0)
+		return -1;
+	    off += q->outlen[i];
+	    continue;
+	}
+	pad = alignup(off, CLUSTER_BITS) - off;
+	if (pad) {
+	    iov[n].iov_base = (void *)zeros;
+	    iov[n++].iov_len = pad;
+	    off += pad;
+	}
+	iov[n].iov_base = q->in + (size_t)i*CLUSTER_SIZE;
+	iov[n++].iov_len = CLUSTER_SIZE;
+	if (l2_set(q, q->guest[i], (uint64_t)off | OFLAG_COPIED) < 0 ||
+	    ref_add(q, off >> CLUSTER_BITS, off >> CLUSTER_BITS) < 0)
+	    return -1;
+	off += CLUSTER_SIZE;
+    }
+    if (pwritev_all(q->fd, iov, n, start) < 0)
+	return -1;
+    q->hoff = off;
+    q->nbatch = 0;
+    return 0;
+}
+
+/* the cluster being filled is complete; keep it unless it's all zeros */
+static int
+end_cluster(struct qsink *q)
+{
+    if (!allzero(q->in + (size_t)q->nbatch*CLUSTER_SIZE, CLUSTER_SIZE))
+	q->guest[q->nbatch++] = q->next;
+    q->next++;
+    q->fill = 0;
+    return q->nbatch == BATCH ? flush_batch(q) : 0;
+}
+
+static int
+qput(struct sink *s, const unsigned char *buf, size_t len)
+{
+    struct qsink *q = (struct qsink *)s;
+    size_t n;
+
+    while (len) {
+	n = CLUSTER_SIZE - q->fill;
+	if (n > len)
+	    n = len;
+	memcpy(q->in + (size_t)q->nbatch*CLUSTER_SIZE + q->fill, buf, n);
+	q->fill += n;
+	buf += n;
+	len -= n;
+	if (q->fill == CLUSTER_SIZE && end_cluster(q) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+static int
+qskip(struct sink *s, off_t len)
+{
+    struct qsink *q = (struct qsink *)s;
+    unsigned char *cur;
+    size_t n;
+
+    cur = q->in + (size_t)q->nbatch*CLUSTER_SIZE;
+    if (q->fill) {
+	n = CLUSTER_SIZE - q->fill;
+	if ((off_t)n > len)
+	    n = len;
+	memset(cur + q->fill, 0, n);
+	q->fill += n;
+	len -= n;
+	if (q->fill < CLUSTER_SIZE)
+	    return 0;
+	if (end_cluster(q) < 0)
+	    return -1;
+	cur = q->in + (size_t)q->nbatch*CLUSTER_SIZE;
+    }
+    /* whole clusters of zeros are simply never allocated */
+    q->next += len >> CLUSTER_BITS;
+    q->fill = len & (CLUSTER_SIZE-1);
+    memset(cur, 0, q->fill);
+    return 0;
+}
+
+/* write the L2 tables, the L1 table, the refcounts and
+ * finally the header after all of the data */
+static int
+finish(struct qsink *q, off_t size)
+{
+    unsigned char *buf;
+    unsigned char hdr[HEADER_LENGTH+8];
+    uint64_t *l1;
+    int64_t i, k, l1off, rtoff, nblocks, ntable, total, start;
+    int ret;
+
+    if (q->fill) {
+	memset(q->in + (size_t)q->nbatch*CLUSTER_SIZE + q->fill, 0, CLUSTER_SIZE - q->fill);
+	if (end_cluster(q) < 0)
+	    return -1;
+    }
+    if (flush_batch(q) < 0)
+	return -1;
+    q->hoff = alignup(q->hoff, CLUSTER_BITS);
+
+    ret = -1;
+    buf = malloc(CLUSTER_SIZE);
+    l1 = calloc(q->l1size ? q->l1size : 1, sizeof(uint64_t));
+    if (!buf || !l1)
+	goto out;
+
+    for (i=0; i<q->l1size; i++) {
+	if (!q->l2[i])
+	    continue;
+	for (k=0; k<L2_ENTRIES; k++)
+	    put_be64(buf + k*8, q->l2[i][k]);
+	if (pwrite(q->fd, buf, CLUSTER_SIZE, q->hoff) != CLUSTER_SIZE ||
+	    ref_add(q, q->hoff >> CLUSTER_BITS, q->hoff >> CLUSTER_BITS) < 0)
+	    goto out;
+	l1[i] = q->hoff | OFLAG_COPIED;
+	q->hoff += CLUSTER_SIZE;
+    }
+    l1off = q->hoff;
+    memset(buf, 0, CLUSTER_SIZE);
+    for (i=0; i<q->l1size; i++) {
+	put_be64(buf + (i % L2_ENTRIES)*8, l1[i]);
+	if (i % L2_ENTRIES == L2_ENTRIES-1 || i == q->l1size-1) {
+	    if (pwrite(q->fd, buf, CLUSTER_SIZE, q->hoff) != CLUSTER_SIZE ||
+		ref_add(q, q->hoff >> CLUSTER_BITS, q->hoff >> CLUSTER_BITS) < 0)
+		goto out;
+	    memset(buf, 0, CLUSTER_SIZE);
+	    q->hoff += CLUSTER_SIZE;
+	}
+    }
+
+    /* the refcount table and blocks have to count themselves */
+    start = q->hoff >> CLUSTER_BITS;
+    nblocks = ntable = 0;
+    for (;;) {
+	total = start + ntable + nblocks;
+	k = (total + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+	i = (k*8 + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	if (k == nblocks && i == ntable)
+	    break;
+	nblocks = k;
+	ntable = i;
+    }
+    if (ref_add(q, start, total - 1) < 0 || ref_grow(q, nblocks*REFS_PER_BLOCK - 1) < 0)
+	goto out;
+    rtoff = q->hoff;
+    memset(buf, 0, CLUSTER_SIZE);
+    for (i=0; i<nblocks; i++) {
+	put_be64(buf + (i % L2_ENTRIES)*8, (uint64_t)(start + ntable + i) << CLUSTER_BITS);
+	if (i % L2_ENTRIES == L2_ENTRIES-1 || i == nblocks-1) {
+	    if (pwrite(q->fd, buf, CLUSTER_SIZE, q->hoff) != CLUSTER_SIZE)
+		goto out;
+	    memset(buf, 0, CLUSTER_SIZE);
+	    q->hoff += CLUSTER_SIZE;
+	}
+    }
+    for (i=0; i<nblocks; i++) {
+	for (k=0; k<REFS_PER_BLOCK; k++)
+	    put_be16(buf + k*2, q->refs[i*REFS_PER_BLOCK + k]);
+	if (pwrite(q->fd, buf, CLUSTER_SIZE, q->hoff) != CLUSTER_SIZE)
+	    goto out;
+	q->hoff += CLUSTER_SIZE;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    put_be32(hdr, QCOW2_MAGIC);
+    put_be32(hdr + 4, 3);
+    put_be32(hdr + 20, CLUSTER_BITS);
+    put_be64(hdr + 24, size);
+    put_be32(hdr + 36, q->l1size);
+    put_be64(hdr + 40, l1off);
+    put_be64(hdr + 48, rtoff);
+    put_be32(hdr + 56, ntable);
+    put_be32(hdr + 96, 4);
+    put_be32(hdr + 100, HEADER_LENGTH);
+    /* the header is followed by an empty list of extensions */
+    if (pwrite(q->fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+	goto out;
+    ret = 0;
+out:
+    free(l1);
+    free(buf);
+    return ret;
+}
+
+int
+qcow2_image(int fd, const unsigned char *head, size_t headsz,
+	    const unsigned char *tail, size_t tailsz,
+	    const struct partinfo *parts, off_t size,
+	    const struct qcow2opts *opts)
+{
+    struct qsink q = {0};
+    int64_t i;
+    int ret;
+
+    q.sink.put = qput;
+    q.sink.skip = qskip;
+    q.fd = fd;
+    q.compress = opts->compress;
+    q.nthreads = opts->nthreads > 0 ? opts->nthreads : 1;
+    q.l1size = ((size + CLUSTER_SIZE - 1) / CLUSTER_SIZE + L2_ENTRIES - 1) / L2_ENTRIES;
+    q.hoff = CLUSTER_SIZE; /* the header */
+
+    ret = -1;
+    if (!(q.in = malloc((size_t)BATCH*CLUSTER_SIZE)) ||
+	(q.compress && !(q.out = malloc((size_t)BATCH*CLUSTER_SIZE))) ||
+	!(q.l2 = calloc(q.l1size ? q.l1size : 1, sizeof(uint64_t *))) ||
+	ref_add(&q, 0, 0) < 0)
+	goto out;
+    if (stream_sink(&q.sink, head, headsz, tail, tailsz, parts, size) < 0 ||
+	finish(&q, size) < 0)
+	goto out;
+    ret = 0;
+out:
+    if (q.l2)
+	for (i=0; i<q.l1size; i++)
+	    free(q.l2[i]);
+    free(q.l2);
+    free(q.refs);
+    free(q.out);
+    free(q.in);
+    return ret;
+}
+
+/* reading qcow2 sources */
+
+struct qsrc {
+    struct srcreader rd; /* must be first */
+    int fd;
+    unsigned bits;       /* cluster_bits */
+    off_t size;          /* virtual size */
+    int64_t l1size;
+    uint64_t **l2;       /* L2 tables (host-endian), NULL where unallocated */
+};
+
+/* return the L2 entry for image cluster 'c', or 0 */
+static uint64_t
+qsrc_entry(const struct qsrc *q, int64_t c)
+{
+    int64_t n = 1L << (q->bits - 3);
+
+    if (c / n >= q->l1size || !q->l2[c / n])
+	return 0;
+    return q->l2[c / n][c % n];
+}
+
+/* is the cluster described by 'e' stored in the file? */
+static bool
+qsrc_data(uint64_t e)
+{
+    if (e & OFLAG_COMPRESSED)
+	return true;
+    return (e & OFFSET_MASK) && !(e & OFLAG_ZERO);
+}
+
+static int
+qsrc_extents(struct srcreader *r, struct extmap *m)
+{
+    struct qsrc *q = (struct qsrc *)r;
+    int64_t c, n;
+    off_t off, len;
+
+    m->size = q->size;
+    n = (q->size + (1L << q->bits) - 1) >> q->bits;
+    for (c=0; c<n; c++) {
+	if (!qsrc_data(qsrc_entry(q, c)))
+	    continue;
+	off = (off_t)c << q->bits;
+	len = 1L << q->bits;
+	if (off + len > q->size)
+	    len = q->size - off;
+	if (extmap_add(m, off, len) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+static int
+pread_all(int fd, unsigned char *buf, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len) {
+	n = pread(fd, buf, len, off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return n < 0 ? -1 : rc(EIO);
+	buf += n;
+	len -= n;
+	off += n;
+    }
+    return 0;
+}
+
+/* inflate the compressed cluster 'e' into 'out' (one cluster) */
+static int
+qsrc_inflate(const struct qsrc *q, uint64_t e, unsigned char *out)
+{
+    unsigned shift;
+    uint64_t host;
+    size_t len;
+    ssize_t n;
+    unsigned char *in;
+    z_stream z = {0};
+    int ret;
+
+    shift = 62 - (q->bits - 8);
+    host = e & ((1ULL << shift) - 1);
+    len = (((e >> shift) & ((1ULL << (62 - shift)) - 1)) + 1) * 512 - (host & 511);
+    if (!(in = malloc(len)))
+	return -1;
+    /* the last compressed cluster may end before the sectors it claims */
+    while ((n = pread(q->fd, in, len, host)) < 0 && errno == EINTR)
+	;
+    ret = -1;
+    if (n < 0)
+	goto out;
+    if (inflateInit2(&z, -12) != Z_OK) {
+	errno = ENOMEM;
+	goto out;
+    }
+    z.next_in = in;
+    z.avail_in = n;
+    z.next_out = out;
+    z.avail_out = 1L << q->bits;
+    ret = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (z.avail_out != 0 || (ret != Z_STREAM_END && ret != Z_BUF_ERROR && ret != Z_OK))
+	ret = rc(EIO);
+    else
+	ret = 0;
+out:
+    free(in);
+    return ret;
+}
+
+static ssize_t
+qsrc_read(struct srcreader *r, void *buf, size_t len, off_t off)
+{
+    struct qsrc *q = (struct qsrc *)r;
+    unsigned char *p = buf, *tmp;
+    uint64_t e, host, next;
+    off_t csize, in;
+    size_t n, total;
+    int64_t c;
+
+    tmp = NULL;
+    total = len;
+    csize = 1L << q->bits;
+    while (len) {
+	c = off >> q->bits;
+	in = off & (csize - 1);
+	n = csize - in;
+	if (n > len)
+	    n = len;
+	e = qsrc_entry(q, c);
+	if (!qsrc_data(e) || off >= q->size) {
+	    memset(p, 0, n);
+	} else if (e & OFLAG_COMPRESSED) {
+	    if (!tmp && !(tmp = malloc(csize)))
+		return -1;
+	    if (qsrc_inflate(q, e, tmp) < 0)
+		goto fail;
+	    memcpy(p, tmp + in, n);
+	} else {
+	    /* read runs of clusters that are contiguous in the file at once */
+	    host = (e & OFFSET_MASK) + in;
+	    next = (e & OFFSET_MASK) + csize;
+	    while (n < len) {
+		e = qsrc_entry(q, ++c);
+		if (!(e & OFFSET_MASK) || (e & (OFLAG_COMPRESSED|OFLAG_ZERO)) || (e & OFFSET_MASK) != next)
+		    break;
+		n = len - n > (size_t)csize ? n + csize : len;
+		next += csize;
+	    }
+	    if (pread_all(q->fd, p, n, host) < 0)
+		goto fail;
+	}
+	p += n;
+	off += n;
+	len -= n;
+    }
+    free(tmp);
+    return total;
+fail:
+    free(tmp);
+    return -1;
+}
+
+static void
+qsrc_close(struct srcreader *r)
+{
+    struct qsrc *q = (struct qsrc *)r;
+    int64_t i;
+
+    if (q->l2)
+	for (i=0; i<q->l1size; i++)
+	    free(q->l2[i]);
+    free(q->l2);
+    free(q);
+}
+
+struct srcreader *
+qcow2_source(int fd, off_t *size)
+{
+    unsigned char hdr[112], *buf;
+    struct qsrc *q;
+    uint32_t version, hlen;
+    uint64_t incompat, l1off, e;
+    int64_t i, k, n;
+
+    if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || get_be32(hdr) != QCOW2_MAGIC) {
+	errno = EINVAL;
+	return NULL;
+    }
+    version = get_be32(hdr + 4);
+    incompat = 0;
+    hlen = 72;
+    if (version >= 3) {
+	incompat = get_be64(hdr + 72);
+	hlen = get_be32(hdr + 100);
+    }
+    if ((version != 2 && version != 3) ||
+	get_be64(hdr + 8) != 0 ||  /* backing file */
+	get_be32(hdr + 32) != 0 || /* encryption */
+	(incompat & ~INCOMPAT_DIRTY) != 0 ||
+	(version >= 3 && hlen > 104 && hdr[104] != 0) || /* compression type */
+	get_be32(hdr + 20) < 9 || get_be32(hdr + 20) > 21) {
+	errno = ENOTSUP;
+	return NULL;
+    }
+    if (!(q = calloc(1, sizeof(*q))))
+	return NULL;
+    q->rd.extents = qsrc_extents;
+    q->rd.read = qsrc_read;
+    q->rd.close = qsrc_close;
+    q->fd = fd;
+    q->bits = get_be32(hdr + 20);
+    q->size = get_be64(hdr + 24);
+    q->l1size = get_be32(hdr + 36);
+    l1off = get_be64(hdr + 40);
+    n = 1L << (q->bits - 3);
+    if (q->size < 0 || q->l1size < ((q->size >> q->bits) + n - 1) / n) {
+	free(q);
+	errno = EINVAL;
+	return NULL;
+    }
+
+    /* load every L2 table up front, so that reads don't need locks */
+    buf = malloc(q->l1size*8 > (n*8) ? q->l1size*8 : n*8);
+    q->l2 = calloc(q->l1size ? q->l1size : 1, sizeof(uint64_t *));
+    if (!buf || !q->l2 || pread_all(fd, buf, q->l1size*8, l1off) < 0)
+	goto fail;
+    for (i=0; i<q->l1size; i++) {
+	if (!(e = get_be64(buf + i*8) & OFFSET_MASK))
+	    continue;
+	if (!(q->l2[i] = malloc(n*8)))
+	    goto fail;
+	q->l2[i][0] = e; /* stash the offset until the L1 table is consumed */
+    }
+    for (i=0; i<q->l1size; i++) {
+	if (!q->l2[i])
+	    continue;
+	if (pread_all(fd, buf, n*8, q->l2[i][0]) < 0)
+	    goto fail;
+	for (k=0; k<n; k++)
+	    q->l2[i][k] = get_be64(buf + k*8);
+    }
+    free(buf);
+    *size = q->size;
+    return &q->rd;
+fail:
+    free(buf);
+    qsrc_close(&q->rd);
+    return NULL;
+}
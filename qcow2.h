@@ -0,0 +1,37 @@
+#ifndef __QCOW2_H_
+#define __QCOW2_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "part.h"
+#include "source.h"
+
+struct qcow2opts {
+    int nthreads;  /* number of compression threads */
+    bool compress; /* store clusters deflate-compressed where that's smaller */
+};
+
+/* qcow2_image() writes the disk image that stream_image()
+ * would produce to 'fd' in qcow2 format (version 3, 64KiB clusters)
+ *
+ * only clusters that contain something other than zeros are
+ * allocated, so source holes, zero blocks and the gaps between
+ * partitions take no space; 'fd' must be seekable
+ *
+ * returns 0 on success or -1 with errno set */
+int qcow2_image(int fd, const unsigned char *head, size_t headsz,
+		const unsigned char *tail, size_t tailsz,
+		const struct partinfo *parts, off_t size,
+		const struct qcow2opts *opts);
+
+/* qcow2_source() returns a reader for the contents of the qcow2
+ * image in 'fd' and sets *size to its virtual size; unallocated
+ * and zero clusters are holes, and compressed clusters are inflated
+ *
+ * returns NULL with errno set to EINVAL if 'fd' isn't a qcow2 image,
+ * or to another error if it is one that can't be read here
+ * (backing files, encryption, external data files, zstd compression
+ * or extended L2 entries) */
+struct srcreader *qcow2_source(int fd, off_t *size);
+
+#endif
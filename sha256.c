@@ -0,0 +1,172 @@
+#include <string.h>
+#include "sha256.h"
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+blocks(uint32_t *h, const unsigned char *p, size_t n)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, hh, t1, t2;
+    int i;
+
+    for (; n; n--, p += 64) {
+	for (i = 0; i < 16; i++)
+	    w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 |
+		(uint32_t)p[4*i+2] << 8 | p[4*i+3];
+	for (; i < 64; i++)
+	    w[i] = w[i-16] + (ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3)) +
+		w[i-7] + (ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10));
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+	for (i = 0; i < 64; i++) {
+	    t1 = hh + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+	    t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+	    hh = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+#ifdef __x86_64__
+/* the same, with the SHA extensions: each group of
+ * four rounds takes two sha256rnds2 instructions */
+__attribute__((target("sha,sse4.1")))
+static void
+blocks_shani(uint32_t *h, const unsigned char *p, size_t n)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, w[16];
+    int g;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; n; n--, p += 64) {
+	abef = state0;
+	cdgh = state1;
+	for (g = 0; g < 16; g++) {
+	    if (g < 4)
+		w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16*g)), mask);
+	    else
+		w[g] = _mm_sha256msg2_epu32(
+		    _mm_add_epi32(_mm_sha256msg1_epu32(w[g-4], w[g-3]),
+				  _mm_alignr_epi8(w[g-1], w[g-2], 4)), w[g-1]);
+	    msg = _mm_add_epi32(w[g], _mm_loadu_si128((const __m128i *)&k[4*g]));
+	    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	    state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+	}
+	state0 = _mm_add_epi32(state0, abef);
+	state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static void (*pickblocks(void))(uint32_t *, const unsigned char *, size_t)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)) &&
+	__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1))
+	return blocks_shani;
+    return blocks;
+}
+#else
+static void (*pickblocks(void))(uint32_t *, const unsigned char *, size_t)
+{
+    return blocks;
+}
+#endif
+
+void
+sha256_init(struct sha256 *s)
+{
+    static const uint32_t iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+    s->blocks = pickblocks();
+}
+
+void
+sha256_update(struct sha256 *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used, amt;
+
+    used = s->len & 63;
+    s->len += len;
+    if (used) {
+	amt = 64 - used < len ? 64 - used : len;
+	memcpy(s->buf + used, p, amt);
+	p += amt;
+	len -= amt;
+	if (used + amt < 64)
+	    return;
+	s->blocks(s->h, s->buf, 1);
+    }
+    if (len >> 6)
+	s->blocks(s->h, p, len >> 6);
+    memcpy(s->buf, p + (len & ~(size_t)63), len & 63);
+}
+
+void
+sha256_zeros(struct sha256 *s, uint64_t len)
+{
+    static const unsigned char zero[4096];
+    size_t amt;
+
+    while (len) {
+	amt = len < sizeof(zero) ? len : sizeof(zero);
+	sha256_update(s, zero, amt);
+	len -= amt;
+    }
+}
+
+void
+sha256_final(struct sha256 *s, unsigned char out[SHA256_BYTES])
+{
+    unsigned char pad[72];
+    uint64_t bits;
+    size_t n;
+    int i;
+
+    bits = s->len << 3;
+    n = 64 - ((s->len + 8) & 63);
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+	pad[n + i] = bits >> (56 - 8*i);
+    sha256_update(s, pad, n + 8);
+    for (i = 0; i < 8; i++) {
+	out[4*i] = s->h[i] >> 24;
+	out[4*i+1] = s->h[i] >> 16;
+	out[4*i+2] = s->h[i] >> 8;
+	out[4*i+3] = s->h[i];
+    }
+}
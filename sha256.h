@@ -0,0 +1,23 @@
+#ifndef __SHA256_H_
+#define __SHA256_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BYTES 32
+
+struct sha256 {
+    uint32_t h[8];
+    uint64_t len;      /* bytes hashed so far */
+    unsigned char buf[64];
+    void (*blocks)(uint32_t *h, const unsigned char *p, size_t n);
+};
+
+void sha256_init(struct sha256 *s);
+void sha256_update(struct sha256 *s, const void *data, size_t len);
+
+/* sha256_zeros() hashes 'len' zero bytes */
+void sha256_zeros(struct sha256 *s, uint64_t len);
+
+void sha256_final(struct sha256 *s, unsigned char out[SHA256_BYTES]);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __SOURCE_H_
+#define __SOURCE_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "extent.h"
+
+/* a srcreader presents the contents of a source
+ * that isn't a plain image (say, a qcow2 file) as
+ * if it were one; see partinfo.rd
+ *
+ * readers of partitions with partinfo.pipe set are only
+ * read in order, by one thread, and never asked for extents */
+struct srcreader {
+    /* extents() fills 'm' with the data extents of the
+     * contents, just like extmap_scan() does for a file */
+    int (*extents)(struct srcreader *r, struct extmap *m);
+    /* read() reads 'len' bytes of the contents at 'off', and
+     * returns the number of bytes read, which is only short at
+     * the end of the contents, or -1 with errno set; it is called
+     * concurrently from several threads */
+    ssize_t (*read)(struct srcreader *r, void *buf, size_t len, off_t off);
+    void (*close)(struct srcreader *r);
+    /* backing(), if set, says where the contents at 'off' come
+     * from: '*fd' at '*fdoff', so that they can be copied from
+     * there with copy_file_range(2), or an '*fd' of -1 if only
+     * read() can produce them; it returns how many bytes from
+     * 'off' on come from the same place, 0 at the end, or -1
+     * with errno set */
+    off_t (*backing)(struct srcreader *r, off_t off, int *fd, off_t *fdoff);
+    /* release(), if set, is called once the '*fd' backing() gave
+     * for 'off' isn't used any more, so the reader can close it */
+    void (*release)(struct srcreader *r, off_t off);
+};
+
+#endif
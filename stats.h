@@ -0,0 +1,34 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+#include <stdio.h>
+#include <time.h>
+
+/* helpers for --stats=json */
+
+/* seconds on the monotonic clock */
+static inline double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* print 's' as a JSON string */
+static inline void
+json_str(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    fprintf(f, "\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    fprintf(f, "\\u%04x", *s);
+	else
+	    fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+#endif
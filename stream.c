@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "part.h"
+#include "extent.h"
+#include "stream.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define STREAM_BUFSZ (1L << 20)
+
+/* the output side of a stream */
+struct ostream {
+    struct sink *sink;    /* where the image goes, or NULL to write to fd */
+    int fd;
+    off_t off;            /* bytes written so far */
+    int zerofd;           /* /dev/zero for splice(2), or -1 */
+    bool nosendfile;      /* sendfile(2) doesn't work for this output */
+    unsigned char *buf;   /* STREAM_BUFSZ bytes; zeros except in emit_copy() */
+};
+
+static int
+emit(struct ostream *o, const unsigned char *p, size_t len)
+{
+    ssize_t n;
+
+    if (o->sink) {
+	o->off += len;
+	return len ? o->sink->put(o->sink, p, len) : 0;
+    }
+    while (len) {
+	n = write(o->fd, p, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += n;
+	len -= n;
+	o->off += n;
+    }
+    return 0;
+}
+
+static int
+emit_zeros(struct ostream *o, off_t len)
+{
+    ssize_t n;
+
+    if (o->sink) {
+	o->off += len;
+	return len ? o->sink->skip(o->sink, len) : 0;
+    }
+    /* when the output is a pipe, the kernel
+     * can fill it with zeros without a copy */
+    while (len && o->zerofd >= 0) {
+	n = splice(o->zerofd, NULL, o->fd, NULL, len < STREAM_BUFSZ ? len : STREAM_BUFSZ, 0);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    if (n < 0 && errno == EPIPE)
+		return -1;
+	    close(o->zerofd);
+	    o->zerofd = -1;
+	    break;
+	}
+	len -= n;
+	o->off += n;
+    }
+    while (len) {
+	n = len < STREAM_BUFSZ ? len : STREAM_BUFSZ;
+	if (emit(o, o->buf, n) < 0)
+	    return -1;
+	len -= n;
+    }
+    return 0;
+}
+
+/* emit_copy() writes [off, off+len) of the contents of 'part',
+ * where the whole range lies within the size of the source */
+static int
+emit_copy(struct ostream *o, const struct partinfo *part, off_t off, off_t len)
+{
+    int srcfd = part->srcfd;
+    ssize_t n;
+    int ret;
+
+    while (len && !o->nosendfile && !part->rd) {
+	n = sendfile(o->fd, srcfd, &off, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+	    o->nosendfile = true;
+	    break;
+	}
+	if (n < 0)
+	    return -1;
+	if (n == 0)
+	    return rc(EIO); /* source shrank underneath us */
+	len -= n;
+	o->off += n;
+    }
+
+    ret = 0;
+    while (len) {
+	n = len < STREAM_BUFSZ ? len : STREAM_BUFSZ;
+	if (part->rd)
+	    n = part->rd->read(part->rd, o->buf, n, off);
+	else
+	    n = pread(srcfd, o->buf, n, off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    ret = n < 0 ? -1 : rc(EIO);
+	    break;
+	}
+	if ((ret = emit(o, o->buf, n)) < 0)
+	    break;
+	off += n;
+	len -= n;
+    }
+    /* restore the invariant that buf holds zeros */
+    memset(o->buf, 0, STREAM_BUFSZ);
+    return ret;
+}
+
+/* emit_pipe() copies a pipe source in order; it may
+ * end early, but it may not produce more than srcsz bytes */
+static int
+emit_pipe(struct ostream *o, const struct partinfo *part)
+{
+    off_t got;
+    ssize_t n;
+    size_t want;
+    int ret;
+
+    ret = 0;
+    for (got = 0; got <= part->srcsz; got += n) {
+	/* ask for one byte too many at the end to catch overruns */
+	want = part->srcsz - got < STREAM_BUFSZ ? (size_t)(part->srcsz - got) + 1 : STREAM_BUFSZ;
+	if (part->rd)
+	    n = part->rd->read(part->rd, o->buf, want, got);
+	else
+	    n = read(part->srcfd, o->buf, want);
+	if (n < 0 && errno == EINTR) {
+	    n = 0;
+	    continue;
+	}
+	if (n <= 0) {
+	    ret = n;
+	    break;
+	}
+	if (got + n > part->srcsz) {
+	    ret = rc(EFBIG);
+	    break;
+	}
+	if ((ret = emit(o, o->buf, n)) < 0)
+	    break;
+    }
+    memset(o->buf, 0, STREAM_BUFSZ);
+    if (ret == 0)
+	ret = emit_zeros(o, (part->nsectors << 9) - got);
+    return ret;
+}
+
+static int
+emit_part(struct ostream *o, const struct partinfo *part)
+{
+    struct extmap map = {0};
+    off_t pos, end;
+    size_t i;
+    int ret;
+
+    if (part->srcfd < 0)
+	return emit_zeros(o, part->nsectors << 9);
+    if (part->pipe)
+	return emit_pipe(o, part);
+    if (part->rd ? part->rd->extents(part->rd, &map) < 0 :
+	extmap_scan(&map, part->srcfd, part->srcsz) < 0)
+	return -1;
+    posix_fadvise(part->srcfd, 0, part->srcsz, POSIX_FADV_SEQUENTIAL);
+
+    ret = 0;
+    pos = 0;
+    for (i = 0; i < map.len && ret == 0; i++) {
+	end = map.ext[i].off + map.ext[i].len;
+	if (end > part->srcsz)
+	    end = part->srcsz;
+	if (map.ext[i].off > pos)
+	    ret = emit_zeros(o, map.ext[i].off - pos);
+	if (ret == 0 && end > map.ext[i].off)
+	    ret = emit_copy(o, part, map.ext[i].off, end - map.ext[i].off);
+	pos = end;
+    }
+    if (ret == 0)
+	ret = emit_zeros(o, (part->nsectors << 9) - pos);
+    extmap_free(&map);
+    return ret;
+}
+
+static int
+stream(struct ostream *o, const unsigned char *head, size_t headsz,
+       const unsigned char *tail, size_t tailsz,
+       const struct partinfo *parts, off_t size)
+{
+    int ret;
+
+    if (!(o->buf = calloc(1, STREAM_BUFSZ)))
+	return -1;
+    ret = emit(o, head, headsz);
+    for (; parts && ret == 0; parts = parts->next) {
+	if ((parts->startlba << 9) < o->off) {
+	    ret = rc(EINVAL);
+	    break;
+	}
+	ret = emit_zeros(o, (parts->startlba << 9) - o->off);
+	if (ret == 0)
+	    ret = emit_part(o, parts);
+    }
+    if (ret == 0 && size - (off_t)tailsz < o->off)
+	ret = rc(EINVAL);
+    if (ret == 0)
+	ret = emit_zeros(o, size - (off_t)tailsz - o->off);
+    if (ret == 0)
+	ret = emit(o, tail, tailsz);
+    free(o->buf);
+    return ret;
+}
+
+int
+stream_image(int fd, const unsigned char *head, size_t headsz,
+	     const unsigned char *tail, size_t tailsz,
+	     const struct partinfo *parts, off_t size)
+{
+    struct ostream o = {0};
+    struct stat st;
+    int ret;
+
+    o.fd = fd;
+    o.zerofd = -1;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+	o.zerofd = open("/dev/zero", O_RDONLY|O_CLOEXEC);
+    ret = stream(&o, head, headsz, tail, tailsz, parts, size);
+    if (o.zerofd >= 0)
+	close(o.zerofd);
+    return ret;
+}
+
+int
+stream_sink(struct sink *sink, const unsigned char *head, size_t headsz,
+	    const unsigned char *tail, size_t tailsz,
+	    const struct partinfo *parts, off_t size)
+{
+    struct ostream o = {0};
+
+    o.sink = sink;
+    o.fd = -1;
+    o.zerofd = -1;
+    o.nosendfile = true;
+    return stream(&o, head, headsz, tail, tailsz, parts, size);
+}
@@ -0,0 +1,36 @@
+#ifndef __STREAM_H_
+#define __STREAM_H_
+#include <stddef.h>
+#include <sys/types.h>
+#include "part.h"
+
+/* stream_image() writes a complete disk image of 'size' bytes
+ * to 'fd' strictly in order of increasing offset, so that 'fd'
+ * may be a pipe, a socket or a terminal rather than a seekable file:
+ *
+ * 'head' goes at offset 0, the contents of each partition in
+ * 'parts' at its startlba, and 'tail' in the last 'tailsz' bytes;
+ * source holes and everything else in between are written as zeros
+ *
+ * the partitions must be sorted by startlba and must not overlap
+ * each other, 'head' or 'tail'
+ *
+ * returns 0 on success or -1 with errno set */
+int stream_image(int fd, const unsigned char *head, size_t headsz,
+		 const unsigned char *tail, size_t tailsz,
+		 const struct partinfo *parts, off_t size);
+
+/* a sink receives an image from stream_sink() in order:
+ * put() is called with data, and skip() with runs of zeros;
+ * both return 0 on success or -1 with errno set */
+struct sink {
+    int (*put)(struct sink *s, const unsigned char *buf, size_t len);
+    int (*skip)(struct sink *s, off_t len);
+};
+
+/* stream_sink() is stream_image() with 'sink' in place of a file */
+int stream_sink(struct sink *sink, const unsigned char *head, size_t headsz,
+		const unsigned char *tail, size_t tailsz,
+		const struct partinfo *parts, off_t size);
+
+#endif
@@ -0,0 +1,722 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "extent.h"
+#include "source.h"
+#include "tar.h"
+
+#define rc(e) (errno=(e), -1)
+
+#define BLOCK    512
+#define PAX_MAX  (64L << 20) /* the most pax or long name data we'll read */
+
+/* header fields */
+#define H_NAME     0
+#define H_SIZE     124
+#define H_CHKSUM   148
+#define H_TYPE     156
+#define H_LINKNAME 157
+#define H_MAGIC    257
+#define H_PREFIX   345
+#define H_SPARSE   386 /* old GNU: 4 (offset, numbytes) pairs */
+#define H_EXTENDED 482
+#define H_REALSIZE 483
+
+/* 'len' bytes at 'off' in a file are stored at 'at' in the archive */
+struct tarseg {
+    off_t off, len, at;
+};
+
+struct tarmember {
+    char *name;
+    char *link;         /* what a hard link links to, or NULL */
+    off_t size;
+    struct tarseg *seg; /* in order; everything else is a hole */
+    size_t nseg;
+};
+
+struct tarindex {
+    int fd;
+    int refs;               /* the caller's, and one per reader */
+    struct tarmember *mem;
+    size_t nmem;
+};
+
+struct tsrc {
+    struct srcreader rd; /* must be first */
+    struct tarindex *t;
+    const struct tarmember *m;
+};
+
+/* what the pax and GNU long name headers say about the next file */
+struct pending {
+    char *path;            /* path, or GNU long name */
+    char *linkpath;        /* linkpath, or GNU long link name */
+    char *sparsename;      /* GNU.sparse.name */
+    off_t size;            /* size, or -1 */
+    off_t realsize;        /* GNU.sparse.size or .realsize, or -1 */
+    int major;             /* GNU.sparse.major, or -1 */
+    struct tarseg *seg;    /* from GNU.sparse.map or .offset/.numbytes */
+    size_t nseg;
+    bool sparse;
+};
+
+static int
+pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    unsigned char *p = buf;
+    ssize_t n;
+
+    while (len) {
+	if ((n = pread(fd, p, len, off)) < 0)
+	    return -1;
+	if (n == 0)
+	    return rc(EIO);
+	p += n;
+	len -= (size_t)n;
+	off += n;
+    }
+    return 0;
+}
+
+/* a numeric field: octal, or base-256 if the top bit is set */
+static int
+number(const unsigned char *f, size_t len, off_t *v)
+{
+    uint64_t u = 0;
+    size_t i = 0;
+
+    if (f[0] & 0x80) {
+	/* negative numbers are no use to anyone */
+	if (f[0] & 0x40)
+	    return rc(EINVAL);
+	u = f[0] & 0x3f;
+	for (i = 1; i < len; i++) {
+	    if (u >> 55)
+		return rc(EINVAL);
+	    u = u << 8 | f[i];
+	}
+	*v = (off_t)u;
+	return 0;
+    }
+    while (i < len && (f[i] == ' ' || f[i] == 0))
+	i++;
+    for (; i < len && f[i] >= '0' && f[i] <= '7'; i++) {
+	if (u >> 60)
+	    return rc(EINVAL);
+	u = u << 3 | (f[i] - '0');
+    }
+    if (i < len && f[i] != ' ' && f[i] != 0)
+	return rc(EINVAL);
+    *v = (off_t)u;
+    return 0;
+}
+
+static bool
+checksum_ok(const unsigned char *h)
+{
+    uint32_t sum = 0;
+    int32_t ssum = 0;
+    off_t want;
+    int i;
+
+    if (number(h + H_CHKSUM, 8, &want) < 0)
+	return false;
+    for (i = 0; i < BLOCK; i++) {
+	if (i >= H_CHKSUM && i < H_CHKSUM + 8) {
+	    sum += ' ';
+	    ssum += ' ';
+	} else {
+	    sum += h[i];
+	    ssum += (signed char)h[i];
+	}
+    }
+    /* some old tars summed signed chars */
+    return want == sum || want == ssum;
+}
+
+static bool
+all_zeros(const unsigned char *h)
+{
+    int i;
+
+    for (i = 0; i < BLOCK; i++)
+	if (h[i])
+	    return false;
+    return true;
+}
+
+/* a decimal number in [*p, end), which moves past it and one separator */
+static int
+decimal(const char **p, const char *end, off_t *v)
+{
+    uint64_t u = 0;
+    const char *s = *p;
+
+    if (s == end || *s < '0' || *s > '9')
+	return rc(EINVAL);
+    for (; s < end && *s >= '0' && *s <= '9'; s++) {
+	if (u >> 58)
+	    return rc(EINVAL);
+	u = u * 10 + (*s - '0');
+    }
+    if (s < end)
+	s++;
+    *p = s;
+    *v = (off_t)u;
+    return 0;
+}
+
+static int
+add_seg(struct tarseg **seg, size_t *nseg, off_t off, off_t len)
+{
+    struct tarseg *s;
+
+    if (*nseg % 64 == 0) {
+	if (!(s = realloc(*seg, (*nseg + 64) * sizeof(*s))))
+	    return -1;
+	*seg = s;
+    }
+    (*seg)[(*nseg)++] = (struct tarseg){off, len, 0};
+    return 0;
+}
+
+static void
+clear_pending(struct pending *p)
+{
+    free(p->path);
+    free(p->linkpath);
+    free(p->sparsename);
+    free(p->seg);
+    memset(p, 0, sizeof(*p));
+    p->size = p->realsize = -1;
+    p->major = -1;
+}
+
+/* read 'len' bytes of data at 'off' into a string */
+static char *
+read_data(int fd, off_t off, off_t len)
+{
+    char *s;
+
+    if (len > PAX_MAX) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!(s = malloc(len + 1)))
+	return NULL;
+    if (pread_full(fd, s, len, off) < 0) {
+	free(s);
+	return NULL;
+    }
+    s[len] = 0;
+    return s;
+}
+
+static int
+set_string(char **dst, const char *s, size_t len)
+{
+    free(*dst);
+    return (*dst = strndup(s, len)) ? 0 : -1;
+}
+
+/* apply the pax records in 'buf' to 'p' */
+static int
+pax_records(struct pending *p, const char *buf, off_t len)
+{
+    const char *rec, *end, *key, *val, *eq, *q;
+    off_t n, v, w;
+
+    for (rec = buf; rec < buf + len; rec += n) {
+	q = rec;
+	if (decimal(&q, buf + len, &n) < 0 || n <= q - rec || rec + n > buf + len ||
+	    rec[n - 1] != '\n')
+	    return rc(EINVAL);
+	key = q;
+	end = rec + n - 1;
+	if (!(eq = memchr(key, '=', end - key)))
+	    return rc(EINVAL);
+	val = eq + 1;
+#define KEY(k) ((size_t)(eq - key) == sizeof(k) - 1 && !memcmp(key, k, sizeof(k) - 1))
+	q = val;
+	if (KEY("path")) {
+	    if (set_string(&p->path, val, end - val) < 0)
+		return -1;
+	} else if (KEY("linkpath")) {
+	    if (set_string(&p->linkpath, val, end - val) < 0)
+		return -1;
+	} else if (KEY("GNU.sparse.name")) {
+	    if (set_string(&p->sparsename, val, end - val) < 0)
+		return -1;
+	    p->sparse = true;
+	} else if (KEY("size")) {
+	    if (decimal(&q, end, &p->size) < 0)
+		return -1;
+	} else if (KEY("GNU.sparse.size") || KEY("GNU.sparse.realsize")) {
+	    if (decimal(&q, end, &p->realsize) < 0)
+		return -1;
+	    p->sparse = true;
+	} else if (KEY("GNU.sparse.major")) {
+	    if (decimal(&q, end, &v) < 0)
+		return -1;
+	    p->major = (int)v;
+	    p->sparse = true;
+	} else if (KEY("GNU.sparse.offset")) {
+	    /* 0.0: offset and numbytes records in turn */
+	    if (decimal(&q, end, &v) < 0 || add_seg(&p->seg, &p->nseg, v, -1) < 0)
+		return -1;
+	    p->sparse = true;
+	} else if (KEY("GNU.sparse.numbytes")) {
+	    if (!p->nseg || p->seg[p->nseg - 1].len >= 0 || decimal(&q, end, &v) < 0)
+		return rc(EINVAL);
+	    p->seg[p->nseg - 1].len = v;
+	} else if (KEY("GNU.sparse.map")) {
+	    /* 0.1: offset,numbytes,... */
+	    p->nseg = 0;
+	    while (q < end) {
+		if (decimal(&q, end, &v) < 0 || decimal(&q, end, &w) < 0 ||
+		    add_seg(&p->seg, &p->nseg, v, w) < 0)
+		    return -1;
+	    }
+	    p->sparse = true;
+	}
+#undef KEY
+    }
+    return 0;
+}
+
+/* read the 1.0 sparse map at the start of the data at 'off';
+ * returns the length of the map, rounded up to a block */
+static off_t
+map_1_0(int fd, off_t off, off_t size, struct pending *p)
+{
+    char *buf;
+    const char *q, *end;
+    off_t len, count, v, n, i;
+
+    /* the map is as long as it is; read more until it's all there */
+    for (len = BLOCK; ; len *= 2) {
+	if (len > size)
+	    len = size;
+	if (!(buf = read_data(fd, off, len)))
+	    return -1;
+	q = buf;
+	end = buf + len;
+	p->nseg = 0;
+	if (decimal(&q, end, &count) < 0)
+	    goto more;
+	for (i = 0; i < count; i++) {
+	    if (q >= end || decimal(&q, end, &v) < 0 || q >= end || decimal(&q, end, &n) < 0)
+		goto more;
+	    if (q[-1] != '\n')
+		goto more;
+	    if (add_seg(&p->seg, &p->nseg, v, n) < 0) {
+		free(buf);
+		return -1;
+	    }
+	}
+	n = (q - buf + BLOCK - 1) / BLOCK * BLOCK;
+	free(buf);
+	return n;
+    more:
+	free(buf);
+	if (len == size)
+	    return rc(EINVAL);
+    }
+}
+
+/* read the old GNU sparse map in the header 'h' and the extension
+ * blocks after it at 'off'; returns the offset of the data */
+static off_t
+map_old_gnu(int fd, const unsigned char *h, off_t off, struct pending *p)
+{
+    unsigned char ext[BLOCK];
+    const unsigned char *e;
+    off_t v, n;
+    int i, count;
+    bool more;
+
+    e = h + H_SPARSE;
+    count = 4;
+    more = h[H_EXTENDED];
+    for (;;) {
+	for (i = 0; i < count; i++, e += 24) {
+	    if (!e[0])
+		break;
+	    if (number(e, 12, &v) < 0 || number(e + 12, 12, &n) < 0 ||
+		add_seg(&p->seg, &p->nseg, v, n) < 0)
+		return -1;
+	}
+	if (!more)
+	    return off;
+	if (pread_full(fd, ext, BLOCK, off) < 0)
+	    return -1;
+	off += BLOCK;
+	e = ext;
+	count = 21;
+	more = ext[504];
+    }
+}
+
+/* record the file whose data is 'size' bytes at 'data' */
+static int
+add_member(struct tarindex *t, const unsigned char *h, off_t data, off_t size, struct pending *p)
+{
+    struct tarmember *m;
+    struct tarseg *s;
+    const char *name;
+    char ustar[256];
+    off_t at, end;
+    size_t i;
+
+    if (p->sparse && p->sparsename)
+	name = p->sparsename;
+    else if (p->path)
+	name = p->path;
+    else {
+	ustar[0] = 0;
+	if (!memcmp(h + H_MAGIC, "ustar", 5) && h[H_PREFIX])
+	    snprintf(ustar, sizeof(ustar), "%.155s/", (const char *)h + H_PREFIX);
+	snprintf(ustar + strlen(ustar), sizeof(ustar) - strlen(ustar), "%.100s", (const char *)h + H_NAME);
+	name = ustar;
+    }
+    if (t->nmem % 64 == 0) {
+	if (!(m = realloc(t->mem, (t->nmem + 64) * sizeof(*m))))
+	    return -1;
+	t->mem = m;
+    }
+    m = &t->mem[t->nmem];
+    memset(m, 0, sizeof(*m));
+    if (!(m->name = strdup(name)))
+	return -1;
+    t->nmem++;
+
+    if (!p->sparse) {
+	m->size = size;
+	if (size && add_seg(&m->seg, &m->nseg, 0, size) < 0)
+	    return -1;
+	if (size)
+	    m->seg[0].at = data;
+	return 0;
+    }
+    /* the pieces of a sparse file are stored one after the other */
+    m->size = p->realsize;
+    at = data;
+    end = 0;
+    for (i = 0; i < p->nseg; i++) {
+	s = &p->seg[i];
+	if (s->len < 0 || s->off < end || s->off > m->size - s->len ||
+	    at - data > size - s->len)
+	    return rc(EINVAL);
+	if (s->len && add_seg(&m->seg, &m->nseg, s->off, s->len) < 0)
+	    return -1;
+	if (s->len)
+	    m->seg[m->nseg - 1].at = at;
+	at += s->len;
+	end = s->off + s->len;
+    }
+    return 0;
+}
+
+/* record a hard link to a file earlier in the archive */
+static int
+add_link(struct tarindex *t, const unsigned char *h, struct pending *p)
+{
+    struct tarmember *m;
+
+    p->sparse = false;
+    if (add_member(t, h, 0, 0, p) < 0)
+	return -1;
+    m = &t->mem[t->nmem - 1];
+    if (p->linkpath)
+	m->link = strdup(p->linkpath);
+    else
+	m->link = strndup((const char *)h + H_LINKNAME, 100);
+    return m->link ? 0 : -1;
+}
+
+static void
+free_index(struct tarindex *t)
+{
+    size_t i;
+
+    for (i = 0; i < t->nmem; i++) {
+	free(t->mem[i].name);
+	free(t->mem[i].link);
+	free(t->mem[i].seg);
+    }
+    free(t->mem);
+    free(t);
+}
+
+struct tarindex *
+tar_index(int fd)
+{
+    unsigned char h[BLOCK];
+    struct tarindex *t;
+    struct pending p = {0};
+    off_t off, data, size, next, skip;
+    char *buf;
+    int e;
+
+    if (!(t = calloc(1, sizeof(*t))))
+	return NULL;
+    t->fd = fd;
+    t->refs = 1;
+    clear_pending(&p);
+    for (off = 0; ; off = next) {
+	if (pread_full(fd, h, BLOCK, off) < 0) {
+	    /* an archive may end without its two blocks of zeros */
+	    if (errno != EIO)
+		goto fail;
+	    if (!off)
+		goto bad;
+	    break;
+	}
+	if (all_zeros(h)) {
+	    if (!off)
+		goto bad;
+	    break;
+	}
+	if (!checksum_ok(h) || number(h + H_SIZE, 12, &size) < 0)
+	    goto bad;
+	data = off + BLOCK;
+	/* a pax size is that of the file after it */
+	if (p.size >= 0 && !(h[H_TYPE] && strchr("LxgK", h[H_TYPE])))
+	    size = p.size;
+	switch (h[H_TYPE]) {
+	case 'L':
+	    if (!(buf = read_data(fd, data, size)))
+		goto fail;
+	    free(p.path);
+	    p.path = buf;
+	    break;
+	case 'K':
+	    if (!(buf = read_data(fd, data, size)))
+		goto fail;
+	    free(p.linkpath);
+	    p.linkpath = buf;
+	    break;
+	case 'x':
+	    if (!(buf = read_data(fd, data, size)))
+		goto fail;
+	    e = pax_records(&p, buf, size);
+	    free(buf);
+	    if (e < 0)
+		goto fail;
+	    break;
+	case 'S':
+	    if (number(h + H_REALSIZE, 12, &p.realsize) < 0)
+		goto bad;
+	    p.sparse = true;
+	    p.nseg = 0;
+	    if ((data = map_old_gnu(fd, h, data, &p)) < 0 ||
+		add_member(t, h, data, size, &p) < 0)
+		goto fail;
+	    clear_pending(&p);
+	    break;
+	case '0':
+	case 0:
+	case '7':
+	    skip = 0;
+	    if (p.sparse && p.major == 1 && (skip = map_1_0(fd, data, size, &p)) < 0)
+		goto fail;
+	    if (p.sparse && p.realsize < 0)
+		goto bad;
+	    if (add_member(t, h, data + skip, size - skip, &p) < 0)
+		goto fail;
+	    clear_pending(&p);
+	    break;
+	case '1':
+	    if (add_link(t, h, &p) < 0)
+		goto fail;
+	    clear_pending(&p);
+	    break;
+	case 'g':
+	    break;
+	default:
+	    /* directories, symlinks and the like only take up space */
+	    clear_pending(&p);
+	    break;
+	}
+	next = data + (size + BLOCK - 1) / BLOCK * BLOCK;
+    }
+    clear_pending(&p);
+    return t;
+bad:
+    errno = EINVAL;
+fail:
+    e = errno;
+    clear_pending(&p);
+    free_index(t);
+    errno = e;
+    return NULL;
+}
+
+void
+tar_free(struct tarindex *t)
+{
+    if (--t->refs == 0)
+	free_index(t);
+}
+
+int
+tar_fd(const struct tarindex *t)
+{
+    return t->fd;
+}
+
+/* the first segment that ends after 'off' */
+static size_t
+find_seg(const struct tarmember *m, off_t off)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = m->nseg;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (m->seg[mid].off + m->seg[mid].len <= off)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static int
+tsrc_extents(struct srcreader *r, struct extmap *m)
+{
+    struct tsrc *s = (struct tsrc *)r;
+    size_t i;
+
+    m->len = 0;
+    m->size = s->m->size;
+    for (i = 0; i < s->m->nseg; i++)
+	if (extmap_add(m, s->m->seg[i].off, s->m->seg[i].len) < 0)
+	    return -1;
+    return 0;
+}
+
+static ssize_t
+tsrc_read(struct srcreader *r, void *buf, size_t len, off_t off)
+{
+    struct tsrc *s = (struct tsrc *)r;
+    const struct tarmember *m = s->m;
+    const struct tarseg *g;
+    unsigned char *out = buf;
+    size_t i, n, done;
+
+    if (off >= m->size)
+	return 0;
+    if ((off_t)len > m->size - off)
+	len = m->size - off;
+    i = find_seg(m, off);
+    for (done = 0; done < len; done += n, off += n) {
+	n = len - done;
+	g = i < m->nseg ? &m->seg[i] : NULL;
+	if (!g || off < g->off) {
+	    if (g && g->off - off < (off_t)n)
+		n = g->off - off;
+	    memset(out + done, 0, n);
+	    continue;
+	}
+	if (g->off + g->len - off < (off_t)n)
+	    n = g->off + g->len - off;
+	if (pread_full(s->t->fd, out + done, n, g->at + (off - g->off)) < 0)
+	    return -1;
+	if (off + (off_t)n == g->off + g->len)
+	    i++;
+    }
+    return done;
+}
+
+static off_t
+tsrc_backing(struct srcreader *r, off_t off, int *fd, off_t *fdoff)
+{
+    struct tsrc *s = (struct tsrc *)r;
+    const struct tarmember *m = s->m;
+    const struct tarseg *g;
+    size_t i;
+
+    *fd = -1;
+    *fdoff = 0;
+    if (off >= m->size)
+	return 0;
+    if ((i = find_seg(m, off)) == m->nseg)
+	return m->size - off;
+    g = &m->seg[i];
+    if (off < g->off)
+	return g->off - off;
+    *fd = s->t->fd;
+    *fdoff = g->at + (off - g->off);
+    return g->off + g->len - off;
+}
+
+static void
+tsrc_close(struct srcreader *r)
+{
+    struct tsrc *s = (struct tsrc *)r;
+
+    tar_free(s->t);
+    free(s);
+}
+
+/* 'name' without any leading "./" or "/" */
+static const char *
+plain_name(const char *name)
+{
+    for (;;) {
+	if (name[0] == '/')
+	    name++;
+	else if (name[0] == '.' && name[1] == '/')
+	    name += 2;
+	else
+	    return name;
+    }
+}
+
+/* the last member called 'name' before the i'th, plus one, or 0 */
+static size_t
+find_member(const struct tarindex *t, const char *name, size_t i)
+{
+    name = plain_name(name);
+    for (; i > 0; i--)
+	if (!strcmp(plain_name(t->mem[i - 1].name), name))
+	    break;
+    return i;
+}
+
+struct srcreader *
+tar_source(struct tarindex *t, const char *name, off_t *size)
+{
+    struct tsrc *s;
+    size_t i;
+
+    i = find_member(t, name, t->nmem);
+    /* a hard link is the file it links to, as it was when the link
+     * was archived; that is always further back, so this ends */
+    while (i && t->mem[i - 1].link)
+	i = find_member(t, t->mem[i - 1].link, i - 1);
+    if (!i) {
+	errno = ENOENT;
+	return NULL;
+    }
+    if (!(s = calloc(1, sizeof(*s))))
+	return NULL;
+    s->rd.extents = tsrc_extents;
+    s->rd.read = tsrc_read;
+    s->rd.backing = tsrc_backing;
+    s->rd.close = tsrc_close;
+    s->t = t;
+    s->m = &t->mem[i - 1];
+    t->refs++;
+    *size = s->m->size;
+    return &s->rd;
+}
@@ -0,0 +1,36 @@
+#ifndef __TAR_H_
+#define __TAR_H_
+#include <sys/types.h>
+#include "source.h"
+
+/* a tarindex lists the files in an uncompressed tar archive
+ * (ustar, pax or GNU), found by reading its headers once */
+struct tarindex;
+
+/* tar_index() reads the headers of the archive 'fd', which
+ * must stay open until the index and every reader taken from it
+ * are gone; returns NULL with errno set to EINVAL if 'fd' isn't
+ * a tar archive (or one it can't make sense of) */
+struct tarindex *tar_index(int fd);
+
+/* tar_free() lets go of 't'; it is freed once the
+ * readers taken from it have been closed, too */
+void tar_free(struct tarindex *t);
+
+/* tar_fd() returns the archive 't' was read from */
+int tar_fd(const struct tarindex *t);
+
+/* tar_source() returns a reader for the regular file 'name'
+ * (with or without a leading "./") in the archive, setting
+ * *size to its size; the holes of GNU sparse files (old GNU,
+ * or pax 0.0, 0.1 and 1.0) are left out of its extents, and its
+ * data is backed by the archive itself (see srcreader.backing)
+ *
+ * a hard link is the file it links to, as it was when the link
+ * was archived; symbolic links aren't followed
+ *
+ * returns NULL with errno set to ENOENT if there is no such
+ * file (the last one wins if there are several) */
+struct srcreader *tar_source(struct tarindex *t, const char *name, off_t *size);
+
+#endif
@@ -0,0 +1,40 @@
+# sources and checks shared by the gptimage tests, read with
+# '. test/fixture.sh' from the top directory:
+#
+#   $esp, $rfs  a 3M source with 1M of data at the start, and
+#               a 5M one with 1M of data 1M in (the rest holes)
+#   $img1       the image 'reference' builds, to compare against
+#   $img2       a name for the image under test
+#
+# everything named here is removed when the test exits
+img1=$(mktemp -u img.XXXXXX)
+img2=$(mktemp -u img.XXXXXX)
+esp=$(mktemp -u esp.XXXXXX)
+rfs=$(mktemp -u rfs.XXXXXX)
+trap 'rm -f $img1 $img2 $esp $rfs' EXIT
+
+truncate -s 3M $esp
+truncate -s 5M $rfs
+dd if=/dev/urandom of=$esp bs=1M count=1 conv=notrunc 2>/dev/null
+dd if=/dev/urandom of=$rfs bs=1M count=1 seek=1 conv=notrunc 2>/dev/null
+
+# reference [partitions]: build $img1 with the default options
+# from 'partitions' ("$esp U $rfs L * L" if none are given)
+reference() {
+    rm -f $img1
+    execlineb -Pc "./gptimage -s 32M $img1 { ${1:-$esp U $rfs L * L} }"
+}
+
+# same image what: fail unless 'image' matches $img1
+same() {
+    cmp -s $img1 $1 || {
+	echo "$2 differs from the reference image" >&2
+	exit 1
+    }
+}
+
+# total name file: the number "name" has in the totals
+# of the --stats=json output in 'file'
+total() {
+    sed -n 's/.*"totals":{[^}]*"'$1'":\([0-9]*\).*/\1/p' $2
+}
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# qcow2 fixtures for the tests, written from the qcow2 spec
+# (docs/interop/qcow2.txt in qemu) rather than with gptimage's
+# own writer, so that its reader and writer are checked against
+# something other than each other
+#
+#   qcow2.py make cluster_bits out.qcow2 out.raw
+#       writes a v3 image laid out the way qemu-img leaves one
+#       after some use: data clusters out of order, compressed
+#       clusters packed at odd offsets at the end of the file,
+#       zero clusters with and without space allocated for them,
+#       unallocated clusters and L2 tables, and a partial last
+#       cluster; out.raw gets the contents it should read as
+#
+#   qcow2.py raw in.qcow2 out.raw
+#       writes the contents of a (v2 or v3) image as a raw file
+import random
+import struct
+import sys
+import zlib
+
+MAGIC = 0x514649fb
+COPIED = 1 << 63
+COMPRESSED = 1 << 62
+ZERO = 1
+OFFSET_MASK = 0x00fffffffffffe00
+
+
+def deflate(data):
+    z = zlib.compressobj(zlib.Z_DEFAULT_COMPRESSION, zlib.DEFLATED, -12)
+    return z.compress(data) + z.flush()
+
+
+def make(bits, qpath, rawpath):
+    csize = 1 << bits
+    l2n = csize // 8
+    rng = random.Random(bits)
+    # 6M plus a partial cluster (but whole sectors)
+    size = 6 * 1024 * 1024 + csize // 2 + 512
+    nclusters = (size + csize - 1) // csize
+    raw = bytearray(size)
+    kinds = {}
+    text = b''.join(b'%d\n' % i for i in range(csize))
+    for c in range(nclusters):
+        off = c * csize
+        if 2 * 1024 * 1024 <= off < 4 * 1024 * 1024:
+            continue  # a stretch that is never written
+        kind = ('data', 'compressed', 'zero', 'zero-alloc', 'none')[c % 5]
+        if kind in ('data', 'compressed'):
+            if kind == 'data':
+                chunk = rng.randbytes(csize)
+            else:
+                chunk = text[c * 7:c * 7 + csize]
+            raw[off:off + csize] = chunk[:size - off]
+        kinds[c] = kind
+
+    l1size = (nclusters + l2n - 1) // l2n
+    l2used = sorted({c // l2n for c in kinds})
+    # header, refcount table, refcount block, L1, L2s, then data
+    host = 4 + len(l2used)
+    l1off = 3 * csize
+    l2off = {t: (4 + i) * csize for i, t in enumerate(l2used)}
+    alloc = [c for c in kinds if kinds[c] in ('data', 'zero-alloc')]
+    rng.shuffle(alloc)
+    where = {}
+    for c in alloc:
+        where[c] = host * csize
+        host += 1
+    body = bytearray(host * csize)
+    entries = {}
+    for c in alloc:
+        if kinds[c] == 'data':
+            body[where[c]:where[c] + csize] = bytes(raw[c * csize:(c + 1) * csize]).ljust(csize, b'\0')
+            entries[c] = where[c] | COPIED
+        else:
+            # stale data that must not show through
+            body[where[c]:where[c] + csize] = rng.randbytes(csize)
+            entries[c] = where[c] | COPIED | ZERO
+    tail = bytearray()
+    shift = 62 - (bits - 8)
+    for c in sorted(kinds):
+        if kinds[c] == 'zero':
+            entries[c] = ZERO
+        elif kinds[c] == 'compressed':
+            z = deflate(bytes(raw[c * csize:(c + 1) * csize]).ljust(csize, b'\0'))
+            off = len(body) + len(tail)
+            tail += z
+            nsect = ((off + len(z) - 1) >> 9) - (off >> 9)
+            entries[c] = COMPRESSED | (nsect << shift) | off
+    image = body + tail
+    for t in l2used:
+        struct.pack_into('>Q', image, l1off + 8 * t, l2off[t] | COPIED)
+        for c in range(t * l2n, min((t + 1) * l2n, nclusters)):
+            if c in entries:
+                struct.pack_into('>Q', image, l2off[t] + 8 * (c % l2n), entries[c])
+
+    # 16-bit refcounts for every cluster the file touches
+    refs = [0] * ((len(image) + csize - 1) // csize)
+    for c in range(len(body) // csize):
+        refs[c] = 1
+    for c in kinds:
+        if kinds[c] == 'compressed':
+            e = entries[c]
+            off = e & ((1 << shift) - 1)
+            end = ((off >> 9) + (e >> shift & ((1 << (62 - shift)) - 1)) + 1) * 512
+            for h in range(off // csize, (min(end, len(image)) - 1) // csize + 1):
+                refs[h] += 1
+    assert len(refs) <= csize // 2
+    struct.pack_into('>Q', image, csize, 2 * csize)
+    for h, r in enumerate(refs):
+        struct.pack_into('>H', image, 2 * csize + 2 * h, r)
+
+    struct.pack_into('>IIQIIQIIQQIIQQQQII', image, 0,
+                     MAGIC, 3, 0, 0, bits, size, 0, l1size, l1off,
+                     csize, 1, 0, 0, 0, 0, 0, 4, 112)
+    with open(qpath, 'wb') as f:
+        f.write(image)
+    with open(rawpath, 'wb') as f:
+        f.write(raw)
+
+
+def toraw(qpath, rawpath):
+    with open(qpath, 'rb') as f:
+        image = f.read()
+    magic, version, backing, _, bits, size, crypt, l1size, l1off = \
+        struct.unpack_from('>IIQIIQIIQ', image, 0)
+    assert magic == MAGIC and version in (2, 3) and not backing and not crypt
+    if version == 3:
+        incompat, = struct.unpack_from('>Q', image, 72)
+        assert incompat & ~1 == 0
+    csize = 1 << bits
+    l2n = csize // 8
+    shift = 62 - (bits - 8)
+    raw = bytearray(size)
+    for t in range(l1size):
+        l2, = struct.unpack_from('>Q', image, l1off + 8 * t)
+        if not l2 & OFFSET_MASK:
+            continue
+        for k in range(l2n):
+            c = t * l2n + k
+            if c * csize >= size:
+                break
+            e, = struct.unpack_from('>Q', image, (l2 & OFFSET_MASK) + 8 * k)
+            if e & COMPRESSED:
+                off = e & ((1 << shift) - 1)
+                n = ((e >> shift & ((1 << (62 - shift)) - 1)) + 1) * 512 - (off & 511)
+                data = zlib.decompressobj(-12).decompress(image[off:off + n], csize)
+                assert len(data) == csize
+            elif e & ZERO or not e & OFFSET_MASK:
+                continue
+            else:
+                data = image[e & OFFSET_MASK:(e & OFFSET_MASK) + csize]
+            raw[c * csize:(c + 1) * csize] = data[:size - c * csize]
+    with open(rawpath, 'wb') as f:
+        f.write(raw)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) == 5 and sys.argv[1] == 'make':
+        make(int(sys.argv[2]), sys.argv[3], sys.argv[4])
+    elif len(sys.argv) == 4 and sys.argv[1] == 'raw':
+        toraw(sys.argv[2], sys.argv[3])
+    else:
+        sys.exit('usage: qcow2.py make cluster_bits out.qcow2 out.raw\n'
+                 '       qcow2.py raw in.qcow2 out.raw')
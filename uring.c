@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "uring.h"
+
+#define rc(e) (errno=(e), -1)
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+#endif
+#endif
+
+#ifdef HAVE_URING
+#include <linux/io_uring.h>
+
+static int
+enter(struct uring *u, unsigned wait)
+{
+    int n;
+
+    do {
+	n = (int)syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+			 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+	return -1;
+    u->queued -= (unsigned)n;
+    u->inflight += (unsigned)n;
+    return 0;
+}
+
+int
+uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+    int e;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+	return -1;
+    u->entries = p.sq_entries;
+    u->sqsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->cqsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cqsz > u->sqsz)
+	u->sqsz = u->cqsz;
+    u->sqesz = p.sq_entries*sizeof(struct io_uring_sqe);
+
+    u->sqmem = u->cqmem = u->sqes = MAP_FAILED;
+    u->sqmem = mmap(NULL, u->sqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sqmem == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	u->cqmem = u->sqmem;
+    else if ((u->cqmem = mmap(NULL, u->cqsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			      u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	goto fail;
+    u->sqes = mmap(NULL, u->sqesz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+	goto fail;
+
+    sq = u->sqmem;
+    cq = u->cqmem;
+    u->sqhead = (unsigned *)(sq + p.sq_off.head);
+    u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    u->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqarray = (unsigned *)(sq + p.sq_off.array);
+    u->cqhead = (unsigned *)(cq + p.cq_off.head);
+    u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    u->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+fail:
+    e = errno;
+    uring_free(u);
+    return rc(e);
+}
+
+void
+uring_free(struct uring *u)
+{
+    if (u->sqes && u->sqes != MAP_FAILED)
+	munmap(u->sqes, u->sqesz);
+    if (u->cqmem && u->cqmem != MAP_FAILED && u->cqmem != u->sqmem)
+	munmap(u->cqmem, u->cqsz);
+    if (u->sqmem && u->sqmem != MAP_FAILED)
+	munmap(u->sqmem, u->sqsz);
+    if (u->fd >= 0)
+	close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+int
+uring_buffer(struct uring *u, void *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+	return -1;
+    u->buf = buf;
+    u->buflen = len;
+    return 0;
+}
+
+int
+uring_files(struct uring *u, const int *fds, unsigned n)
+{
+    if (u->queued || u->inflight || n > 2)
+	return rc(EBUSY);
+    if (u->nfiles && syscall(__NR_io_uring_register, u->fd, IORING_UNREGISTER_FILES, NULL, 0) < 0)
+	return -1;
+    u->nfiles = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, fds, n) < 0)
+	return -1;
+    memcpy(u->files, fds, n*sizeof(int));
+    u->nfiles = n;
+    return 0;
+}
+
+int
+uring_rw(struct uring *u, bool write, int fd, void *buf, size_t len, off_t off, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, i;
+
+    if (u->queued + u->inflight >= u->entries)
+	return rc(EBUSY);
+    tail = *u->sqtail;
+    sqe = &u->sqes[tail & *u->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    if (u->buf && (unsigned char *)buf >= (unsigned char *)u->buf &&
+	(unsigned char *)buf + len <= (unsigned char *)u->buf + u->buflen) {
+	sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	sqe->buf_index = 0;
+    } else {
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    for (i = 0; i < u->nfiles; i++) {
+	if (u->files[i] == fd) {
+	    sqe->fd = (int)i;
+	    sqe->flags |= IOSQE_FIXED_FILE;
+	    break;
+	}
+    }
+    sqe->off = (uint64_t)off;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = data;
+    u->sqarray[tail & *u->sqmask] = tail & *u->sqmask;
+    __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return 0;
+}
+
+int
+uring_wait(struct uring *u, uint64_t *data, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    for (;;) {
+	head = *u->cqhead;
+	if (head != __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+	    cqe = &u->cqes[head & *u->cqmask];
+	    *data = cqe->user_data;
+	    *res = cqe->res;
+	    __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+	    u->inflight--;
+	    return 0;
+	}
+	if (!u->queued && !u->inflight)
+	    return rc(EINVAL);
+	if (enter(u, 1) < 0)
+	    return -1;
+    }
+}
+
+#else /* !HAVE_URING */
+
+int
+uring_init(struct uring *u, unsigned entries)
+{
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+    return rc(ENOSYS);
+}
+
+void
+uring_free(struct uring *u)
+{
+}
+
+int
+uring_buffer(struct uring *u, void *buf, size_t len)
+{
+    return rc(ENOSYS);
+}
+
+int
+uring_files(struct uring *u, const int *fds, unsigned n)
+{
+    return rc(ENOSYS);
+}
+
+int
+uring_rw(struct uring *u, bool write, int fd, void *buf, size_t len, off_t off, uint64_t data)
+{
+    return rc(ENOSYS);
+}
+
+int
+uring_wait(struct uring *u, uint64_t *data, int *res)
+{
+    return rc(ENOSYS);
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __URING_H_
+#define __URING_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* a minimal io_uring(7), set up and driven with raw
+ * system calls (no liburing), for plain reads and writes */
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmem, *cqmem;
+    size_t sqsz, cqsz, sqesz;
+    unsigned queued;       /* entries prepared but not yet submitted */
+    unsigned inflight;     /* entries submitted but not yet completed */
+    void *buf;             /* the registered buffer, or NULL */
+    size_t buflen;
+    int files[2];          /* the registered files */
+    unsigned nfiles;
+};
+
+/* uring_init() sets up a ring of 'entries' entries;
+ * it fails with ENOSYS (or EPERM, if io_uring has been
+ * disabled) on kernels that can't provide one */
+int uring_init(struct uring *u, unsigned entries);
+
+void uring_free(struct uring *u);
+
+/* uring_buffer() registers [buf, buf+len) so that I/O
+ * within it skips mapping the pages for each request;
+ * if that fails, I/O still works without it */
+int uring_buffer(struct uring *u, void *buf, size_t len);
+
+/* uring_files() registers up to two files (replacing
+ * any registered before) for I/O that skips looking up
+ * the fd for each request; the ring must be idle */
+int uring_files(struct uring *u, const int *fds, unsigned n);
+
+/* uring_rw() queues a pread (or pwrite, if 'write' is set)
+ * of 'len' bytes at 'off'; 'data' comes back with its completion
+ *
+ * returns -1 (with errno EBUSY) if the ring is full */
+int uring_rw(struct uring *u, bool write, int fd, void *buf, size_t len, off_t off, uint64_t data);
+
+/* uring_wait() submits what has been queued and returns
+ * the next completion: its 'data' and the result of the
+ * read or write (a byte count or -errno) */
+int uring_wait(struct uring *u, uint64_t *data, int *res);
+
+#endif
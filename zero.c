@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <string.h>
+#include "zero.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+static bool
+allzero_scalar(const unsigned char *p, size_t n)
+{
+    uint64_t w, acc;
+    size_t i;
+
+    acc = 0;
+    for (i=0; i+8 <= n; i += 8) {
+	memcpy(&w, p+i, 8);
+	acc |= w;
+	/* bail out early every 256 bytes */
+	if ((i & 255) == 248 && acc)
+	    return false;
+    }
+    for (; i<n; i++)
+	acc |= p[i];
+    return acc == 0;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static bool
+allzero_avx2(const unsigned char *p, size_t n)
+{
+    __m256i a, b, c, d;
+    size_t i;
+
+    for (i=0; i+128 <= n; i += 128) {
+	a = _mm256_loadu_si256((const __m256i *)(p+i));
+	b = _mm256_loadu_si256((const __m256i *)(p+i+32));
+	c = _mm256_loadu_si256((const __m256i *)(p+i+64));
+	d = _mm256_loadu_si256((const __m256i *)(p+i+96));
+	a = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+	if (!_mm256_testz_si256(a, a))
+	    return false;
+    }
+    return allzero_scalar(p+i, n-i);
+}
+
+__attribute__((target("sse2")))
+static bool
+allzero_sse2(const unsigned char *p, size_t n)
+{
+    __m128i a, b, c, d, z;
+    size_t i;
+
+    z = _mm_setzero_si128();
+    for (i=0; i+64 <= n; i += 64) {
+	a = _mm_loadu_si128((const __m128i *)(p+i));
+	b = _mm_loadu_si128((const __m128i *)(p+i+16));
+	c = _mm_loadu_si128((const __m128i *)(p+i+32));
+	d = _mm_loadu_si128((const __m128i *)(p+i+48));
+	a = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, z)) != 0xffff)
+	    return false;
+    }
+    return allzero_scalar(p+i, n-i);
+}
+#endif
+
+bool
+allzero(const void *p, size_t n)
+{
+#ifdef HAVE_X86
+    static int level = -1; /* racy, but every thread computes the same value */
+
+    if (level < 0) {
+	__builtin_cpu_init();
+	level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse2") ? 1 : 0;
+    }
+    if (level == 2)
+	return allzero_avx2(p, n);
+    if (level == 1)
+	return allzero_sse2(p, n);
+#endif
+    return allzero_scalar(p, n);
+}
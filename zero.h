@@ -0,0 +1,10 @@
+#ifndef __ZERO_H_
+#define __ZERO_H_
+#include <stddef.h>
+#include <stdbool.h>
+
+/* allzero() returns true if all 'n' bytes at 'p' are zero;
+ * it uses AVX2 or SSE2 where the CPU supports them */
+bool allzero(const void *p, size_t n);
+
+#endif